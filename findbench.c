@@ -0,0 +1,79 @@
+/*
+ * File:   findbench.c
+ *
+ * Micro-benchmark of state lookup.  It builds a binary tree of n states
+ * (50000 by default) with addnode() and addtrans(), in state order as a
+ * prefix tree is built, and times that.  It then times findnode() on
+ * random states two ways: on the whole pfsa, which goes through the
+ * header's index, and on its bare node list, which walks the list as
+ * findnode() did for everything before the index.  Both must find the
+ * same node.
+ *
+ * It is not part of the project build.  To build and run it:
+ *
+ *   cc -O2 -o findbench findbench.c -lm && ./findbench [n]
+ */
+
+#define MAIN
+#include <errno.h>
+#include <time.h>
+#include "pfsa.h"
+#include "misc.c"
+
+#define LOOKUPS 10000000	/* Through the index */
+#define WALKS 2000		/* Down the list */
+
+char *Prog = (char *) "findbench";
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    NODE *p, *q;
+    double t;
+    long sum;
+    int n, i, s, a, b;
+
+    n = argc > 1 ? atoi(argv[1]) : 50000;
+    startpfsa();
+    a = addsym((char *) "a");
+    b = addsym((char *) "b");
+
+    t = now();
+    for (i = 0; i < n; i++) {
+        p = addnode(Pfsa, i);
+        if (2 * i + 1 < n)
+            addtrans(p, addnode(Pfsa, 2 * i + 1), a, 1);
+        if (2 * i + 2 < n)
+            addtrans(p, addnode(Pfsa, 2 * i + 2), b, 1);
+    }
+    t = now() - t;
+    printf("%d states, %d arcs built in %.3f s\n", nstates(Pfsa),
+            trancnt(Pfsa), t);
+
+    srand(1);
+    t = now();
+    for (sum = 0, i = 0; i < LOOKUPS; i++)
+        sum += findnode(Pfsa, rand() % n)->state;
+    t = now() - t;
+    printf("index: %.0f lookups/s\n", LOOKUPS / t);
+
+    t = now();
+    for (i = 0; i < WALKS; i++) {
+        s = rand() % n;
+        p = findnode(Pfsa->nextnode, s);
+        q = findnode(Pfsa, s);
+        if (p != q) {
+            fprintf(stderr, "state %d: the list and the index differ\n", s);
+            return 1;
+        }
+        sum += p->state;
+    }
+    t = now() - t;
+    printf("list:  %.0f lookups/s\n", WALKS / t);
+    return sum < 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * File:   kbench.cpp
+ *
+ * Micro-benchmark of the distance kernels in kvec.h, which skstr.c uses
+ * for XENTROPIC, VARDIST, HELLINGER and JSDIV (see kstrdist()).
+ * For each distance and list size it times every kernel the machine
+ * can run on the same made up strings, in ns per string (the best of
+ * ROUNDS rounds of reps calls each), and checks
+ * that they all come to the same sum, to the last bit.  The "log" row
+ * is the old XENTROPIC loop, which took log(pi/qi) for every string
+ * of every pair, for comparison.
+ *
+ * It is not part of the project build.  To build and run it:
+ *
+ *   g++ -O2 -o kbench kbench.cpp && ./kbench [reps]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "kvec.h"
+
+#define NSTR 4096
+#define ROUNDS 5
+
+static struct kvecblock B[NSTR / KVECBLOCK];
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    static const char *dname[] = {"", "xentropic", "vardist", "hellinger", "jsdiv"};
+    static const char *kname[] = {"scalar", "avx2", "avx512"};
+    struct kvecblock *b = B;
+    const char *name;
+    kvecfn kern[3];
+    double acc[8], sum[3], t, best, x, y;
+    int sizes[] = {16, 64, 256, 1024, NSTR};
+    int nkern, reps, d, s, i, r, c, round;
+
+    reps = argc > 1 ? atoi(argv[1]) : 20000;
+    kern[0] = kvec_scalar;
+    nkern = 1;
+#ifdef KVEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kern[nkern++] = kvec_avx2;
+    if (__builtin_cpu_supports("avx512f"))
+        kern[nkern++] = kvec_avx512;
+#endif
+    kvecpick(&name);
+    printf("skstr uses the %s kernel on this machine\n\n", name);
+    srand(1);
+    for (i = 0; i < NSTR; i++) {
+        x = (rand() % 1000 + 1) / 1e5;
+        y = rand() % 4 ? (rand() % 1000 + 1) / 1e5 : 1e-5;
+        b[i / KVECBLOCK].x[i % KVECBLOCK] = x;
+        b[i / KVECBLOCK].y[i % KVECBLOCK] = y;
+        b[i / KVECBLOCK].m[i % KVECBLOCK] = (x + y) * log((x + y) / 2);
+    }
+
+    printf("%-10s %6s", "distance", "n");
+    for (c = 0; c < nkern; c++)
+        printf(" %9s", kname[c]);
+    printf("  ns/string\n");
+    for (d = KD_XENT; d <= KD_JS; d++) {
+        for (i = 0; i < NSTR; i++) {
+            x = b[i / KVECBLOCK].x[i % KVECBLOCK];
+            y = b[i / KVECBLOCK].y[i % KVECBLOCK];
+            b[i / KVECBLOCK].fx[i % KVECBLOCK] = d == KD_HELL ? sqrt(x) : log(x);
+            b[i / KVECBLOCK].fy[i % KVECBLOCK] = d == KD_HELL ? sqrt(y) : log(y);
+        }
+        for (s = 0; s < (int) (sizeof (sizes) / sizeof (int)); s++) {
+            printf("%-10s %6d", dname[d], sizes[s]);
+            for (c = 0; c < nkern; c++) {
+                for (best = 0, round = 0; round < ROUNDS; round++) {
+                    t = now();
+                    for (r = 0; r < reps; r++) {
+                        for (i = 0; i < 8; i++)
+                            acc[i] = 0;
+                        for (i = 0; i < sizes[s]; i += KVECBLOCK)
+                            (*kern[c])(d, &b[i / KVECBLOCK], sizes[s] - i < KVECBLOCK ?
+                                    sizes[s] - i : KVECBLOCK, acc);
+                    }
+                    t = now() - t;
+                    if (!round || t < best)
+                        best = t;
+                }
+                for (sum[c] = 0, i = 0; i < 8; i++)
+                    sum[c] += acc[i];
+                printf(" %9.3f", best / reps / sizes[s]);
+            }
+            for (c = 1; c < nkern; c++)
+                if (sum[c] != sum[0])
+                    printf("  MISMATCH %s %.17g != %.17g", kname[c], sum[c], sum[0]);
+            printf("\n");
+        }
+        if (d == KD_XENT)
+            for (s = 0; s < (int) (sizeof (sizes) / sizeof (int)); s++) {
+                printf("%-10s %6d", "  log", sizes[s]);
+                for (best = 0, round = 0; round < ROUNDS; round++) {
+                    t = now();
+                    for (r = 0; r < reps; r++)
+                        for (sum[0] = 0, i = 0; i < sizes[s]; i++) {
+                            x = b[i / KVECBLOCK].x[i % KVECBLOCK];
+                            y = b[i / KVECBLOCK].y[i % KVECBLOCK];
+                            sum[0] += (x - y) * log(x / y);
+                        }
+                    t = now() - t;
+                    if (!round || t < best)
+                        best = t;
+                }
+                printf(" %9.3f\n", best / reps / sizes[s]);
+            }
+    }
+    return sum[0] < 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * File:   kstrbench.c
+ *
+ * Benchmark of get_sorted_kstrList().  For a pfsa file it makes the
+ * whole list of k-strings of every state, PASSES times over with the
+ * cache flushed in between, as the search does after the merges that
+ * flush it, and reports the time, the mallocs (and callocs and
+ * reallocs) and the bytes cached per list.  The lists are made best
+ * first for the heuristics that take strings in order of probability,
+ * and depth first for the others, so it takes the heuristic (AND by
+ * default) as well as the tail size and the -p least probability.
+ *
+ * It is not part of the project build.  To build and run it:
+ *
+ *   cc -O2 -o kstrbench kstrbench.c -lm -lpthread &&
+ *       ./kstrbench file.pfsa [tailsize [heuristic [minprob]]]
+ */
+
+#define MAIN
+#include <errno.h>
+#include <time.h>
+#include "pfsa.h"
+#include "misc.c"
+
+/*
+ * Count what skstr.c allocates, and only that.
+ */
+static long Nallocs;
+#define malloc(n) (Nallocs++, malloc(n))
+#define calloc(n, m) (Nallocs++, calloc(n, m))
+#define realloc(p, n) (Nallocs++, realloc(p, n))
+#include "skstr.c"
+
+#define PASSES 5
+
+char *Prog = (char *) "kstrbench";
+
+/*
+ * skstr() gets this from the driver; it is never called here.
+ */
+void setfilenames(char *arg) {
+    strcpy(Infile, arg);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    struct kstrList *ksv;
+    NODE *p;
+    double t, best;
+    long nallocs, mem, nstr, ncalls;
+    int pass, syms[1];
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file.pfsa "
+                "[tailsize [heuristic [minprob]]]\n", argv[0]);
+        return 1;
+    }
+    skinit();
+    Tailsize = argc > 2 ? atoi(argv[2]) : TAILSIZE;
+    strcpy(Heuristic, argc > 3 ? argv[3] : "AND");
+    if (argc > 4)
+        Minprob = (u_long) (atof(argv[4]) * PREC);
+    if (Tailsize < 1 || skheuristic()) {
+        fprintf(stderr, "%s: bad tail size or heuristic\n", Prog);
+        return 1;
+    }
+    kvecinit();
+    buildpfsa(argv[1]);
+    sizecache(getmaxstatenum(Pfsa));
+    printf("%d states, %d arcs, tail size %d, minprob %g%%, %s (%s)\n",
+            nstates(Pfsa), trancnt(Pfsa), Tailsize, (double) Minprob / PREC,
+            Heuristic,
+            Sk_compare == sk_compare_byProb ? "best first" : "depth first");
+
+    best = 0;
+    nallocs = mem = nstr = ncalls = 0;
+    syms[0] = 0;
+    for (pass = 0; pass < PASSES; pass++) {
+        flush_cache();
+        Nallocs = 0;
+        t = now();
+        for (p = Pfsa->nextnode; p; p = p->nextnode) {
+            ksv = get_sorted_kstrList(Tailsize, p, syms, 100 * PREC);
+            kstrall(ksv);
+        }
+        t = now() - t;
+        if (!pass || t < best)
+            best = t;
+        nallocs += Nallocs;
+        ncalls += nstates(Pfsa);
+    }
+    for (p = Pfsa->nextnode; p; p = p->nextnode) {
+        mem += kstrmem(Ksv_cache[p->state]);
+        nstr += Ksv_cache[p->state]->nstr;
+    }
+    printf("%.3f us a list (best of %d passes), %.1f allocs a list\n",
+            best / nstates(Pfsa) * 1e6, PASSES, (double) nallocs / ncalls);
+    printf("%.1f strings, %.0f bytes cached a list\n",
+            (double) nstr / nstates(Pfsa), (double) mem / nstates(Pfsa));
+    skdone();
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * kvec.h
+ * The kernels that sum a distance between the string distributions of
+ * two states, over strings already lined up in a kvecblock.
+ *
+ * They keep eight partial sums, one for each i % 8, and leave it to the
+ * caller to add them up.  The scalar, AVX2 and AVX-512 kernels keep the
+ * same partial sums and round each multiply and add alike, so which
+ * one the machine has makes no difference to the answer, to the last
+ * bit.  That is why none of them may fuse a multiply and add into an
+ * FMA (KVEC_NOFUSE), even where the target has it.  kvecpick() picks
+ * the widest the machine can run.
+ *
+ * Only skstr.c and kbench.cpp include this, so the kernels are static.
+ */
+#ifndef KVEC_H
+#define KVEC_H
+#include <math.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KVEC_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * The KD_ values say which distance is summed (see kstrdist() in
+ * skstr.c for the terms).  A kvecblock holds the next KVECBLOCK strings
+ * of two states lined up, x and y being their probabilities and fx and
+ * fy some function of them, such as the log.  m is only used by
+ * KD_JS.  With the x86 kernels the arrays are aligned for them.
+ */
+#define KD_NONE 0
+#define KD_XENT 1
+#define KD_VAR 2
+#define KD_HELL 3
+#define KD_JS 4
+#define KVECBLOCK 256
+
+#ifdef KVEC_X86
+#define KVEC_ALIGN __attribute__((aligned(64)))
+#else
+#define KVEC_ALIGN
+#endif
+#ifdef __GNUC__
+#define KVEC_NOFUSE __attribute__((optimize("fp-contract=off")))
+#else
+#define KVEC_NOFUSE
+#endif
+
+struct kvecblock {
+    double x[KVECBLOCK] KVEC_ALIGN, y[KVECBLOCK] KVEC_ALIGN;
+    double fx[KVECBLOCK] KVEC_ALIGN, fy[KVECBLOCK] KVEC_ALIGN;
+    double m[KVECBLOCK] KVEC_ALIGN;
+};
+
+/*
+ * Add the terms of distance dist for the first n strings in b, n a
+ * multiple of 8, to the partial sums in acc.
+ */
+KVEC_NOFUSE
+static void kvec_scalar(int dist, const struct kvecblock *b, int n, double *acc) {
+    double a[8];
+    int i, j;
+
+    for (j = 0; j < 8; j++)
+        a[j] = acc[j];
+    switch (dist) {
+        case KD_XENT:
+            for (i = 0; i < n; i += 8)
+                for (j = 0; j < 8; j++)
+                    a[j] += (b->x[i + j] - b->y[i + j]) *
+                            (b->fx[i + j] - b->fy[i + j]);
+            break;
+        case KD_VAR:
+            for (i = 0; i < n; i += 8)
+                for (j = 0; j < 8; j++)
+                    a[j] += fabs(b->x[i + j] - b->y[i + j]);
+            break;
+        case KD_HELL:
+            for (i = 0; i < n; i += 8)
+                for (j = 0; j < 8; j++)
+                    a[j] += (b->fx[i + j] - b->fy[i + j]) *
+                            (b->fx[i + j] - b->fy[i + j]);
+            break;
+        case KD_JS:
+            for (i = 0; i < n; i += 8)
+                for (j = 0; j < 8; j++)
+                    a[j] += b->x[i + j] * b->fx[i + j] +
+                            b->y[i + j] * b->fy[i + j] - b->m[i + j];
+            break;
+    }
+    for (j = 0; j < 8; j++)
+        acc[j] = a[j];
+}
+
+#ifdef KVEC_X86
+/*
+ * As kvec_scalar(), lanes 0-3 of the partial sums in lo and 4-7 in hi.
+ */
+__attribute__((target("avx2"))) KVEC_NOFUSE
+static void kvec_avx2(int dist, const struct kvecblock *b, int n, double *acc) {
+    __m256d lo, hi, sign;
+    int i;
+
+    lo = _mm256_loadu_pd(acc);
+    hi = _mm256_loadu_pd(acc + 4);
+    sign = _mm256_set1_pd(-0.0);
+    switch (dist) {
+        case KD_XENT:
+            for (i = 0; i < n; i += 8) {
+                lo = _mm256_add_pd(lo, _mm256_mul_pd(
+                        _mm256_sub_pd(_mm256_load_pd(b->x + i), _mm256_load_pd(b->y + i)),
+                        _mm256_sub_pd(_mm256_load_pd(b->fx + i), _mm256_load_pd(b->fy + i))));
+                hi = _mm256_add_pd(hi, _mm256_mul_pd(
+                        _mm256_sub_pd(_mm256_load_pd(b->x + i + 4), _mm256_load_pd(b->y + i + 4)),
+                        _mm256_sub_pd(_mm256_load_pd(b->fx + i + 4), _mm256_load_pd(b->fy + i + 4))));
+            }
+            break;
+        case KD_VAR:
+            for (i = 0; i < n; i += 8) {
+                lo = _mm256_add_pd(lo, _mm256_andnot_pd(sign,
+                        _mm256_sub_pd(_mm256_load_pd(b->x + i), _mm256_load_pd(b->y + i))));
+                hi = _mm256_add_pd(hi, _mm256_andnot_pd(sign,
+                        _mm256_sub_pd(_mm256_load_pd(b->x + i + 4), _mm256_load_pd(b->y + i + 4))));
+            }
+            break;
+        case KD_HELL:
+            for (i = 0; i < n; i += 8) {
+                __m256d d0, d1;
+
+                d0 = _mm256_sub_pd(_mm256_load_pd(b->fx + i), _mm256_load_pd(b->fy + i));
+                d1 = _mm256_sub_pd(_mm256_load_pd(b->fx + i + 4), _mm256_load_pd(b->fy + i + 4));
+                lo = _mm256_add_pd(lo, _mm256_mul_pd(d0, d0));
+                hi = _mm256_add_pd(hi, _mm256_mul_pd(d1, d1));
+            }
+            break;
+        case KD_JS:
+            for (i = 0; i < n; i += 8) {
+                lo = _mm256_add_pd(lo, _mm256_sub_pd(_mm256_add_pd(
+                        _mm256_mul_pd(_mm256_load_pd(b->x + i), _mm256_load_pd(b->fx + i)),
+                        _mm256_mul_pd(_mm256_load_pd(b->y + i), _mm256_load_pd(b->fy + i))),
+                        _mm256_load_pd(b->m + i)));
+                hi = _mm256_add_pd(hi, _mm256_sub_pd(_mm256_add_pd(
+                        _mm256_mul_pd(_mm256_load_pd(b->x + i + 4), _mm256_load_pd(b->fx + i + 4)),
+                        _mm256_mul_pd(_mm256_load_pd(b->y + i + 4), _mm256_load_pd(b->fy + i + 4))),
+                        _mm256_load_pd(b->m + i + 4)));
+            }
+            break;
+    }
+    _mm256_storeu_pd(acc, lo);
+    _mm256_storeu_pd(acc + 4, hi);
+}
+
+/*
+ * As kvec_avx2(), with all eight partial sums in one register.
+ */
+__attribute__((target("avx512f"))) KVEC_NOFUSE
+static void kvec_avx512(int dist, const struct kvecblock *b, int n, double *acc) {
+    __m512d a, d;
+    int i;
+
+    a = _mm512_loadu_pd(acc);
+    switch (dist) {
+        case KD_XENT:
+            for (i = 0; i < n; i += 8)
+                a = _mm512_add_pd(a, _mm512_mul_pd(
+                        _mm512_sub_pd(_mm512_load_pd(b->x + i), _mm512_load_pd(b->y + i)),
+                        _mm512_sub_pd(_mm512_load_pd(b->fx + i), _mm512_load_pd(b->fy + i))));
+            break;
+        case KD_VAR:
+            for (i = 0; i < n; i += 8)
+                a = _mm512_add_pd(a, _mm512_abs_pd(
+                        _mm512_sub_pd(_mm512_load_pd(b->x + i), _mm512_load_pd(b->y + i))));
+            break;
+        case KD_HELL:
+            for (i = 0; i < n; i += 8) {
+                d = _mm512_sub_pd(_mm512_load_pd(b->fx + i), _mm512_load_pd(b->fy + i));
+                a = _mm512_add_pd(a, _mm512_mul_pd(d, d));
+            }
+            break;
+        case KD_JS:
+            for (i = 0; i < n; i += 8)
+                a = _mm512_add_pd(a, _mm512_sub_pd(_mm512_add_pd(
+                        _mm512_mul_pd(_mm512_load_pd(b->x + i), _mm512_load_pd(b->fx + i)),
+                        _mm512_mul_pd(_mm512_load_pd(b->y + i), _mm512_load_pd(b->fy + i))),
+                        _mm512_load_pd(b->m + i)));
+            break;
+    }
+    _mm512_storeu_pd(acc, a);
+}
+#endif
+
+/*
+ * The widest kernel the machine can run, and its name.
+ */
+typedef void (*kvecfn)(int, const struct kvecblock *, int, double *);
+
+static kvecfn kvecpick(const char **name) {
+#ifdef KVEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        *name = "avx512";
+        return kvec_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return kvec_avx2;
+    }
+#endif
+    *name = "scalar";
+    return kvec_scalar;
+}
+#endif
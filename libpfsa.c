@@ -0,0 +1,412 @@
+/*
+ * File:   libpfsa.c
+ *
+ * The library interface of libpfsa.h.  As main.cpp does for pfsa-fork,
+ * this includes misc.c, mml.c and skstr.c, so the library is the one
+ * object.  It is built with -fvisibility=hidden so that only the
+ * PFSA_API functions are seen from outside.
+ *
+ * A model is a CONTEXT (see pfsa.h) with its pfsa in it, and a
+ * PFSA_MODEL pointer is only ever a CONTEXT pointer in disguise.  Each
+ * call makes the model's context current on the calling thread while it
+ * runs, and sets Onerror so that bail() comes back to the call rather
+ * than ending the caller's program.  The setjmp() for that has to be in
+ * the frame of the call itself, so each one starts with it.
+ */
+
+#define MAIN
+#include <errno.h>
+#include <math.h>
+#include "libpfsa.h"
+#include "misc.c"
+#include "mml.c"
+#include "skstr.c"
+
+#define CTX(m) ((CONTEXT *) (m))
+
+char *Prog = (char *) "libpfsa";
+
+/*
+ * skstr() gets this from the driver, to name its files.  The library
+ * never calls skstr(), but must still link.
+ */
+void setfilenames(char *arg)
+{
+    strcpy(Infile, arg);
+}
+
+static void enter(PFSA_MODEL *m, jmp_buf *env)
+{
+    Onerror = env;
+    usecontext(CTX(m));
+}
+
+static void leave(CONTEXT *old)
+{
+    Onerror = (jmp_buf *) 0;
+    usecontext(old);
+}
+
+/*
+ * A new model with an empty symbol table, made current.
+ */
+static PFSA_MODEL *newmodel(char delim, jmp_buf *env)
+{
+    CONTEXT *ctx;
+
+    Onerror = env;
+    ctx = newcontext();
+    ctx->delim = delim;
+    usecontext(ctx);
+    return (PFSA_MODEL *) ctx;
+}
+
+/*
+ * Undo a failed call that was making a model, and fail with the errno
+ * that bail() set.
+ */
+static PFSA_MODEL *failed(PFSA_MODEL *m, CONTEXT *old)
+{
+    int e = errno;
+
+    leave(old);
+    pfsa_free(m);
+    errno = e;
+    return (PFSA_MODEL *) 0;
+}
+
+PFSA_MODEL *pfsa_build(const char *corpus, size_t len, char delim,
+        int nthreads)
+{
+    PFSA_MODEL *volatile m = (PFSA_MODEL *) 0;
+    CONTEXT *old = Ctx;
+    jmp_buf env;
+
+    if (setjmp(env))
+        return failed(m, old);
+    m = newmodel(delim, &env);
+    buildptabuf(corpus, len, nthreads);
+    leave(old);
+    return m;
+}
+
+PFSA_MODEL *pfsa_buildv(const char *const strings[], int n, char delim)
+{
+    PFSA_MODEL *volatile m = (PFSA_MODEL *) 0;
+    char *volatile buf = (char *) 0;
+    CONTEXT *old = Ctx;
+    jmp_buf env;
+    size_t len, size;
+    int i;
+
+    if (setjmp(env)) {
+        free(buf);
+        return failed(m, old);
+    }
+    m = newmodel(delim, &env);
+    for (size = 0, i = 0; i < n; i++)
+        size += strlen(strings[i]) + 1;
+    if (!(buf = (char *) malloc(size + 1)))
+        memerr();
+    for (size = 0, i = 0; i < n; i++) {
+        len = strlen(strings[i]);
+        memcpy(buf + size, strings[i], len);
+        size += len;
+        buf[size++] = delim;
+    }
+    buildptabuf(buf, size, 1);
+    free(buf);
+    leave(old);
+    return m;
+}
+
+PFSA_MODEL *pfsa_load(const void *buf, size_t len, char delim)
+{
+    PFSA_MODEL *volatile m = (PFSA_MODEL *) 0;
+    CONTEXT *old = Ctx;
+    jmp_buf env;
+
+    if (setjmp(env))
+        return failed(m, old);
+    m = newmodel(delim, &env);
+    buildpfsabuf((const char *) buf, len);
+    leave(old);
+    return m;
+}
+
+/*
+ * The file is read here rather than by buildpfsa(), which would leave
+ * it open, or mapped, if it failed to parse.
+ */
+PFSA_MODEL *pfsa_loadfile(const char *file, char delim)
+{
+    PFSA_MODEL *volatile m = (PFSA_MODEL *) 0;
+    char *volatile buf = (char *) 0;
+    CONTEXT *old = Ctx;
+    FILE *volatile fp;
+    jmp_buf env;
+    size_t len, size;
+    char *b;
+    int e;
+
+    if (strlen(file) >= sizeof (((CONTEXT *) 0)->infile)) {
+        errno = ENAMETOOLONG;
+        return (PFSA_MODEL *) 0;
+    }
+    if (!(fp = fopen(file, "rb"))) {
+        e = errno;
+        perror(file);
+        errno = e;
+        return (PFSA_MODEL *) 0;
+    }
+    if (setjmp(env)) {
+        if (fp)
+            fclose(fp);
+        free(buf);
+        return failed(m, old);
+    }
+    m = newmodel(delim, &env);
+    strcpy(Infile, file);
+    for (len = 0, size = LOADCHUNK;; size *= 2) {
+        if (!(b = (char *) realloc(buf, size)))
+            memerr();
+        buf = b;
+        len += fread(b + len, 1, size - len, fp);
+        if (ferror(fp))
+            Perror(Infile);
+        if (len < size)
+            break;
+    }
+    fclose(fp);
+    fp = (FILE *) 0;
+    buildpfsabuf(buf, len);
+    free(buf);
+    leave(old);
+    return m;
+}
+
+void pfsa_free(PFSA_MODEL *m)
+{
+    freecontext(CTX(m));
+}
+
+void pfsa_skdefaults(PFSA_SKPARAMS *params)
+{
+    params->heuristic = "and";
+    params->tailsize = TAILSIZE;
+    params->agreepct = AGREEPCT;
+    params->minprob = (double) MINPROB / PREC;
+    params->minentropy = -1;
+    params->budget = KSBUDGET;
+    params->nthreads = 1;
+}
+
+/*
+ * As skstr() does after reading its options and the pfsa.  The checks
+ * are those of its options, but a value out of range is an error here
+ * rather than being reset.  If the search fails part way, the pfsa is
+ * half merged and is thrown away.
+ */
+int pfsa_skstrings(PFSA_MODEL *m, const PFSA_SKPARAMS *params)
+{
+    CONTEXT *old = Ctx;
+    jmp_buf env;
+    u_long minprob;
+    int e;
+
+    minprob = (u_long) (params->minprob * PREC);
+    if (!CTX(m)->pfsa || params->tailsize < 0 ||
+            params->agreepct < 0 || params->agreepct > 100 ||
+            params->minprob <= 0 || minprob <= 0 || minprob > 100 * PREC ||
+            params->minentropy > 1 || params->budget < 0 ||
+            params->nthreads < 1 || !params->heuristic ||
+            strlen(params->heuristic) >= sizeof (((SKCTX *) 0)->heuristic)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (setjmp(env)) {
+        e = errno;
+        skdone();
+        delpfsa(Pfsa);
+        Pfsa = (NODE *) 0;
+        leave(old);
+        errno = e;
+        return -1;
+    }
+    enter(m, &env);
+    skinit();
+    strcpy(Heuristic, params->heuristic);
+    Tailsize = params->tailsize;
+    Agreepct = params->agreepct;
+    Minprob = minprob;
+    MinEntropy = params->minentropy < 0 ? -1 : params->minentropy;
+    Ksbudget = params->budget * 1024L;
+    Nthreads = params->nthreads;
+    if (skheuristic()) {
+        skdone();
+        leave(old);
+        errno = EINVAL;
+        return -1;
+    }
+    kvecinit();
+    sizecache(getmaxstatenum(Pfsa));
+    Pfsa = do_skstrings(Pfsa);
+    skdone();
+    leave(old);
+    return 0;
+}
+
+/*
+ * The symbols of string, split as ptaadd() splits a corpus, into a
+ * buffer from malloc() ending in 0, or null if one of them is not in
+ * the symbol table.  Called in the model's context.
+ */
+static int *stringsyms(const char *string)
+{
+    char *copy, *s, *tok, *end;
+    int *syms, n, last;
+
+    copy = strdup(string);
+    syms = (int *) malloc((strlen(string) + 1) * sizeof (int));
+    if (!copy || !syms) {
+        free(copy);
+        free(syms);
+        memerr();
+    }
+    for (n = 0, s = copy;;) {
+        while (*s && *s != Delim && *s != ':' && PTABLANK(*s))
+            s++;
+        for (tok = s; *s && *s != Delim && *s != ':'; s++)
+            ;
+        for (end = s; end > tok && PTABLANK(end[-1]); end--)
+            ;
+        last = !*s || *s == Delim;
+        if (end > tok) {
+            *end = '\0';
+            if (!(syms[n++] = lookupsym(tok))) {
+                free(copy);
+                free(syms);
+                return (int *) 0;
+            }
+        }
+        if (last)
+            break;
+        s++;
+    }
+    syms[n] = 0;
+    free(copy);
+    return syms;
+}
+
+double pfsa_logprob(PFSA_MODEL *m, const char *string)
+{
+    CONTEXT *old = Ctx;
+    jmp_buf env;
+    double logp;
+    int *volatile syms = (int *) 0;
+
+    if (!CTX(m)->pfsa) {
+        errno = EINVAL;
+        return -HUGE_VAL;
+    }
+    if (setjmp(env)) {
+        free(syms);
+        leave(old);
+        return -HUGE_VAL;
+    }
+    enter(m, &env);
+    syms = stringsyms(string);
+    logp = syms ? stringlogprob(Pfsa, syms) : -HUGE_VAL;
+    free(syms);
+    leave(old);
+    return logp;
+}
+
+int pfsa_accepts(PFSA_MODEL *m, const char *string)
+{
+    return pfsa_logprob(m, string) > -HUGE_VAL;
+}
+
+int pfsa_nstates(PFSA_MODEL *m)
+{
+    return CTX(m)->pfsa ? nstates(CTX(m)->pfsa) : 0;
+}
+
+int pfsa_narcs(PFSA_MODEL *m)
+{
+    return CTX(m)->pfsa ? trancnt(CTX(m)->pfsa) : 0;
+}
+
+double pfsa_mml(PFSA_MODEL *m)
+{
+    CONTEXT *old = Ctx;
+    jmp_buf env;
+    double bits;
+
+    if (!CTX(m)->pfsa) {
+        errno = EINVAL;
+        return HUGE_VAL;
+    }
+    if (setjmp(env)) {
+        leave(old);
+        return HUGE_VAL;
+    }
+    enter(m, &env);
+    bits = mml(Pfsa, (double *) 0);
+    leave(old);
+    return bits;
+}
+
+/*
+ * As output_pfsa() in main.cpp writes it, without the comments that -v
+ * adds.
+ */
+int pfsa_write(PFSA_MODEL *m, FILE *fp, int format)
+{
+    CONTEXT *old = Ctx;
+    jmp_buf env;
+
+    if (!CTX(m)->pfsa || format < PFSA_TEXT || format > PFSA_GRAPHPLACE) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (setjmp(env)) {
+        Graphplace = 0;
+        leave(old);
+        return -1;
+    }
+    enter(m, &env);
+    if (format == PFSA_BINARY)
+        writebpfsa(fp, Pfsa);
+    else if (format == PFSA_GRAPHPLACE) {
+        fprintf(fp, "%%!PS\n/makearrows true def\n");
+        Graphplace = 1;
+        writepfsa(fp, Pfsa);
+        Graphplace = 0;
+    } else
+        writepfsa(fp, Pfsa);
+    leave(old);
+    return fflush(fp) || ferror(fp) ? -1 : 0;
+}
+
+void *pfsa_serialise(PFSA_MODEL *m, int format, size_t *len)
+{
+    FILE *fp;
+    char *buf = (char *) 0;
+    int e;
+
+    if (!(fp = open_memstream(&buf, len)))
+        return (void *) 0;
+    if (pfsa_write(m, fp, format)) {
+        e = errno;
+        fclose(fp);
+        free(buf);
+        errno = e;
+        return (void *) 0;
+    }
+    if (fclose(fp)) {
+        free(buf);
+        return (void *) 0;
+    }
+    return buf;
+}
@@ -0,0 +1,111 @@
+/*
+ * libpfsa.h
+ *
+ * The pfsa programs as a library, for a program that wants to build,
+ * learn, query and save pfsas in process rather than run pfsa-fork on
+ * files.  Build with make, which puts libpfsa.a and libpfsa.so next to
+ * pfsa-fork, and link with -lpfsa -lm -lpthread.  Only the functions
+ * below are exported; the rest of misc.c and skstr.c stays inside.
+ *
+ * A PFSA_MODEL is a pfsa with its own symbol table and options.  Models
+ * share nothing, so different threads may use different models at once
+ * without locking, but one model must not be used by two threads at a
+ * time.
+ *
+ * Strings are written as in a corpus for skstr -s: symbols separated by
+ * ':', each string ending in the delimiter of the model (usually '\n').
+ * Blanks around a symbol are ignored.
+ *
+ * Where pfsa-fork would stop with a message, a function here writes the
+ * same message to stderr and fails instead: it returns NULL or -1 and
+ * sets errno, to EINVAL for bad input, ENOMEM, or whatever a failed
+ * read or write left there.  A model whose learning failed has no pfsa
+ * left, and all it is good for is pfsa_free().  The exception is running
+ * out of memory on one of the threads of pfsa_build() or
+ * pfsa_skstrings() other than the caller's, which still ends the program.
+ */
+#ifndef LIBPFSA_H
+#define LIBPFSA_H
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __GNUC__
+#define PFSA_API __attribute__ ((visibility("default")))
+#else
+#define PFSA_API
+#endif
+
+typedef struct pfsa_model PFSA_MODEL;
+
+/*
+ * The options of the sk-strings learner, as for skstr (see its usage).
+ * pfsa_skdefaults() fills in those skstr starts with.
+ */
+typedef struct {
+    const char *heuristic;	/* -H: and, or, lax, strict, xentropic,
+				 * vardist, hellinger or jsdiv */
+    int tailsize;		/* -t */
+    int agreepct;		/* -p, 0 to 100 */
+    double minprob;		/* -m, a percentage */
+    double minentropy;		/* -e, 0 to 1, or < 0 for the default */
+    long budget;		/* -b, KB of strings a state, 0 for no limit */
+    int nthreads;		/* -j */
+} PFSA_SKPARAMS;
+
+/* Formats for pfsa_write() and pfsa_serialise() */
+#define PFSA_TEXT 0		/* As pfsa-fork writes it */
+#define PFSA_BINARY 1		/* As with -B, which loads without parsing */
+#define PFSA_GRAPHPLACE 2	/* As with -g, for graphplace; not loadable */
+
+/*
+ * Making a model.  pfsa_build() makes the prefix tree acceptor of the
+ * len bytes of strings at corpus, on nthreads threads; pfsa_buildv()
+ * that of the n strings in strings[], each without its delimiter.
+ * pfsa_load() reads a pfsa, text or binary, from the len bytes at buf,
+ * and pfsa_loadfile() from a file.
+ */
+PFSA_API PFSA_MODEL *pfsa_build(const char *corpus, size_t len, char delim,
+        int nthreads);
+PFSA_API PFSA_MODEL *pfsa_buildv(const char *const strings[], int n,
+        char delim);
+PFSA_API PFSA_MODEL *pfsa_load(const void *buf, size_t len, char delim);
+PFSA_API PFSA_MODEL *pfsa_loadfile(const char *file, char delim);
+PFSA_API void pfsa_free(PFSA_MODEL *m);
+
+/*
+ * Learning.  pfsa_skstrings() merges the states of the model as skstr
+ * would, and gives the same pfsa.  It returns 0, or -1 with errno
+ * EINVAL if the parameters are out of range.
+ */
+PFSA_API void pfsa_skdefaults(PFSA_SKPARAMS *params);
+PFSA_API int pfsa_skstrings(PFSA_MODEL *m, const PFSA_SKPARAMS *params);
+
+/*
+ * Queries.  pfsa_logprob() is the log to base 2 of the probability of
+ * string, which ends in a NUL or the delimiter, summed over all the ways
+ * the model can generate it; -HUGE_VAL if it cannot, which is when
+ * pfsa_accepts() is 0.  pfsa_mml() is the message length of the model
+ * and its data in bits, as pfsa-fork -v reports it.
+ */
+PFSA_API int pfsa_accepts(PFSA_MODEL *m, const char *string);
+PFSA_API double pfsa_logprob(PFSA_MODEL *m, const char *string);
+PFSA_API int pfsa_nstates(PFSA_MODEL *m);
+PFSA_API int pfsa_narcs(PFSA_MODEL *m);
+PFSA_API double pfsa_mml(PFSA_MODEL *m);
+
+/*
+ * Saving.  pfsa_write() writes the model to fp and returns 0, or -1 if
+ * the write failed.  pfsa_serialise() returns it in a buffer from
+ * malloc(), to be freed by the caller, and sets *len to its size.
+ */
+PFSA_API int pfsa_write(PFSA_MODEL *m, FILE *fp, int format);
+PFSA_API void *pfsa_serialise(PFSA_MODEL *m, int format, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /*#ifndef LIBPFSA_H*/
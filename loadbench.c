@@ -0,0 +1,96 @@
+/*
+ * File:   loadbench.c
+ *
+ * Benchmark of buildpfsa() on pfsa files.  For each file named it times
+ * the load (the best of ROUNDS, each into a fresh pfsa) and reports the
+ * MB/s read and the arcs and states made.  With -w it instead loads the
+ * one file and writes it back with writepfsa(), which for a file that
+ * writepfsa() wrote should give the file back unchanged, with -g it
+ * writes it in Graphplace format, and with -b it writes it with
+ * writebpfsa(), to compare the two formats.  With -o out it loads the
+ * one file and times writepfsa() into out, and the Graphplace output,
+ * reporting the MB/s written.
+ *
+ * It is not part of the project build.  To build and run it:
+ *
+ *   cc -O2 -o loadbench loadbench.c -lm && ./loadbench file.pfsa ...
+ */
+
+#define MAIN
+#include <errno.h>
+#include <time.h>
+#include "pfsa.h"
+#include "misc.c"
+
+#define ROUNDS 3
+
+char *Prog = (char *) "loadbench";
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    struct stat st;
+    FILE *fp;
+    NODE *p;
+    double t, best;
+    long narcs, size;
+    int i, round;
+
+    if (argc == 3 && (!strcmp(argv[1], "-w") || !strcmp(argv[1], "-b") ||
+            !strcmp(argv[1], "-g"))) {
+        buildpfsa(argv[2]);
+        Graphplace = argv[1][1] == 'g';
+        if (argv[1][1] == 'b')
+            writebpfsa(stdout, Pfsa);
+        else
+            writepfsa(stdout, Pfsa);
+        return 0;
+    }
+    if (argc == 4 && !strcmp(argv[1], "-o")) {
+        buildpfsa(argv[3]);
+        for (narcs = 0, p = Pfsa->nextnode; p; p = p->nextnode)
+            narcs += p->ntranslist;
+        for (Graphplace = 0; Graphplace < 2; Graphplace++) {
+            for (best = 0, round = 0; round < ROUNDS; round++) {
+                if (!(fp = fopen(argv[2], "w")))
+                    Perror(argv[2]);
+                t = now();
+                writepfsa(fp, Pfsa);
+                fflush(fp);
+                t = now() - t;
+                size = ftell(fp);
+                fclose(fp);
+                if (!round || t < best)
+                    best = t;
+            }
+            printf("%s%s: %.1f MB, %ld arcs in %.3f s, %.1f MB/s\n", argv[2],
+                    Graphplace ? " (graphplace)" : "", size / 1e6, narcs, best,
+                    size / 1e6 / best);
+        }
+        return 0;
+    }
+    for (i = 1; i < argc; i++) {
+        if (stat(argv[i], &st))
+            Perror(argv[i]);
+        for (best = 0, round = 0; round < ROUNDS; round++) {
+            if (Pfsa)
+                delpfsa(Pfsa);
+            t = now();
+            buildpfsa(argv[i]);
+            t = now() - t;
+            if (!round || t < best)
+                best = t;
+        }
+        for (narcs = 0, p = Pfsa->nextnode; p; p = p->nextnode)
+            narcs += p->ntranslist;
+        printf("%s: %.1f MB, %ld arcs, %d states in %.3f s, %.1f MB/s\n",
+                argv[i], st.st_size / 1e6, narcs, nstates(Pfsa), best,
+                st.st_size / 1e6 / best);
+    }
+    return 0;
+}
@@ -3,27 +3,311 @@
  * Author: otmar
  *
  * Created on 1 de Dezembro de 2014, 22:25
+ *
+ * The driver.  The algorithm to run is picked by the name the program
+ * is called by, as with links named skstr, beams and so on to one
+ * binary, or else by the first argument, as in "pfsa-fork skstr -t 2
+ * f1".  It runs the algorithm on the canonical pfsa and writes out the
+ * result, which the algorithm leaves renumbered.  With -v, the time of
+ * each phase (load, optimise, write) goes to stderr.  SIGUSR1 turns debugging
+ * on and off; skstr also takes SIGUSR2 to report its string cache.
+ * The exit status is 0 on success, 1 for bad usage or input, and the
+ * errno of a failed system call otherwise.
+ *
+ * "pfsa-fork batch [-j jobs] manifest algorithm [options]" runs the
+ * algorithm on every file of the manifest, up to jobs at a time (1 by
+ * default), and then gives the time each took.  Each line of the
+ * manifest is "input [output [options]]", the options added to those
+ * given for the lot; blank lines and lines starting with # are skipped.
+ * The output, as without batch, is input.opfsa when not given.  Each
+ * slot is a thread, which takes the next job from the manifest as soon
+ * as its last one is done, so a long job holds up no others.  A job runs
+ * in a context of its own (see newcontext() in misc.c), so the jobs
+ * share no state, and none pays for starting the program.  A job that
+ * fails gives up only itself (see bail() in misc.c), with the status it
+ * would have exited with.  The cpu time of a job is that of its thread,
+ * not counting any threads it starts itself (as skstr -j does), and the
+ * peak memory is given for the whole batch.  The exit status is 0 if
+ * every job succeeded and 1 otherwise.
  */
 
 #include <iostream>
+#include <pthread.h>
+#include <sys/resource.h>
+#define MAIN
 #include "pfsa.h"
 #include "misc.c"
+#include "mml.c"
 #include "skstr.c"
 
 
+/* Globals */
+char *Prog;			/* The rest are in Ctx0, see pfsa.h */
+
 /*
- * 
+ * The algorithms by name.  Those whose sources are not in this tree
+ * have no function.
  */
-/* Globals */
-char *Prog;
-char Outfile[BUFSIZ]="-", Infile[BUFSIZ]="-";
-char Callstring[128] = "opt";
+static struct algorithm {
+   const char *name;
+   NODE *(*run)(int, char **);
+} Algorithms[] = {
+   { "beams", 0 },
+   { "simba", 0 },
+   { "ktail", 0 },
+   { "skstr", skstr },
+   { 0, 0 }
+};
+
+/* A job of a batch, see batch() */
+typedef struct {
+   char **argv;			/* For the algorithm, ending in a null */
+   int argc;
+   char *input;
+   double wall, cpu;
+   int status;
+} JOB;
+
+/* The jobs of a batch, which its slots take in turn */
+static struct {
+   pthread_mutex_t lock;
+   struct algorithm *a;
+   JOB *job;
+   int njobs, next;
+} Queue = { PTHREAD_MUTEX_INITIALIZER };
+
+static void usage(char *prog);
+
+static struct algorithm *findalgorithm(char *name)
+{
+   struct algorithm *a;
+
+   for (a = Algorithms; a->name; a++)
+      if (!strcmp(a->name, name))
+	 return a;
+   return (struct algorithm *) 0;
+}
+
+static int runalgorithm(struct algorithm *a, int argc, char **argv)
+{
+   NODE *pfsa;
+
+   if (!a->run) {
+      fprintf(stderr, "%s: not in this build, only skstr is\n", Prog);
+      return 1;
+   }
+   signal(SIGUSR1, onusr1);
+   phasetime((char *) 0);
+   pfsa = (*a->run)(argc, argv);
+   phasetime("optimise");
+   output_pfsa(pfsa, Outfile);
+   phasetime("write");
+   return 0;
+}
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Read the jobs of the manifest, each with the algorithm's argv: the
+ * name, the options for the lot, those of the line, -o output and the
+ * input.
+ */
+static JOB *readmanifest(char *manifest, char *name, int nopts, char **opts,
+			 int *njobs)
+{
+   FILE *fp;
+   JOB *job = (JOB *) 0, *j;
+   char *line = (char *) 0, *tok, *word[BUFSIZ];
+   size_t linesize = 0;
+   int n = 0, size = 0, nword, i, lineno = 0;
+
+   if (!(fp = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin))
+      Perror(manifest);
+   while (getline(&line, &linesize, fp) > 0) {
+      lineno++;
+      for (nword = 0, tok = strtok(line, " \t\r\n"); tok && nword < BUFSIZ;
+	   tok = strtok((char *) 0, " \t\r\n"))
+	 word[nword++] = tok;
+      if (!nword || word[0][0] == '#')
+	 continue;
+      if (n == size) {
+	 size = size ? 2 * size : 64;
+	 job = (JOB *) realloc(job, size * sizeof (JOB));
+	 if (!job)
+	    memerr();
+      }
+      j = &job[n++];
+      memset(j, 0, sizeof (JOB));
+      j->argv = (char **) malloc((nopts + nword + 4) * sizeof (char *));
+      if (!j->argv)
+	 memerr();
+      j->argv[j->argc++] = name;
+      for (i = 0; i < nopts; i++)
+	 j->argv[j->argc++] = opts[i];
+      for (i = 2; i < nword; i++)
+	 j->argv[j->argc++] = strdup(word[i]);
+      if (nword > 1) {
+	 j->argv[j->argc++] = (char *) "-o";
+	 j->argv[j->argc++] = strdup(word[1]);
+      }
+      j->argv[j->argc++] = j->input = strdup(word[0]);
+      j->argv[j->argc] = (char *) 0;
+      for (i = 0; i < j->argc; i++)
+	 if (!j->argv[i])
+	    memerr();
+   }
+   if (ferror(fp))
+      Perror(manifest);
+   if (fp != stdin)
+      fclose(fp);
+   free(line);
+   *njobs = n;
+   return job;
+}
+
+static double cputime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Run the job in a fresh context on this thread.  If it gives up, bail()
+ * comes back here with the status in errno, EINVAL standing for 1.
+ */
+static void runjob(JOB *j)
+{
+   CONTEXT *ctx;
+   jmp_buf env;
+   double start, cpu;
+
+   start = now();
+   cpu = cputime();
+   ctx = newcontext();
+   usecontext(ctx);
+   Onerror = &env;
+   if (!setjmp(env))
+      j->status = runalgorithm(Queue.a, j->argc, j->argv);
+   else {
+      j->status = errno == EINVAL ? 1 : errno;
+      skdone();
+   }
+   Onerror = (jmp_buf *) 0;
+   freecontext(ctx);
+   j->cpu = cputime() - cpu;
+   j->wall = now() - start;
+}
+
+/* A slot of a batch */
+static void *slot(void *)
+{
+   int next;
+
+   for (;;) {
+      pthread_mutex_lock(&Queue.lock);
+      next = Queue.next < Queue.njobs ? Queue.next++ : -1;
+      pthread_mutex_unlock(&Queue.lock);
+      if (next < 0)
+	 return (void *) 0;
+      runjob(&Queue.job[next]);
+   }
+}
+
+static int batch(int argc, char **argv)
+{
+   struct algorithm *a;
+   struct rusage ru;
+   pthread_t *tid;
+   JOB *j;
+   char *prog = Prog;
+   double start;
+   int slots = 1, njobs, nthreads, failed, c, i;
+
+   while ((c = getopt(argc, argv, "+j:h")) != EOF)
+      switch (c) {
+      case 'j':
+	 if ((slots = atoi(optarg)) < 1) {
+	    fprintf(stderr, "Illegal -j optarg reset to 1\n");
+	    slots = 1;
+	 }
+	 break;
+      default:
+	 usage(Prog);
+	 return 1;
+      }
+   if (argc - optind < 2 || !(a = findalgorithm(argv[optind + 1]))) {
+      usage(Prog);
+      return 1;
+   }
+   if (!a->run) {
+      fprintf(stderr, "%s: %s not in this build, only skstr is\n", Prog,
+	      argv[optind + 1]);
+      return 1;
+   }
+   Queue.a = a;
+   Queue.job = readmanifest(argv[optind], argv[optind + 1],
+			    argc - optind - 2, argv + optind + 2, &njobs);
+   Queue.njobs = njobs;
+   nthreads = slots < njobs ? slots : njobs;
+   if (!(tid = (pthread_t *) malloc((nthreads + 1) * sizeof (pthread_t))))
+      memerr();
+
+   start = now();
+   Prog = argv[optind + 1];
+   for (i = 0; i < nthreads; i++)
+      if ((errno = pthread_create(&tid[i], (pthread_attr_t *) 0, slot,
+				  (void *) 0)))
+	 Perror((char *) "pthread_create");
+   for (i = 0; i < nthreads; i++)
+      pthread_join(tid[i], (void **) 0);
+   Prog = prog;
+   free(tid);
+
+   getrusage(RUSAGE_SELF, &ru);
+   fprintf(stderr, "%8s %8s %6s  %s\n", "wall s", "cpu s", "status",
+	   "input");
+   for (failed = 0, i = 0; i < njobs; i++) {
+      j = &Queue.job[i];
+      fprintf(stderr, "%8.3f %8.3f %6d  %s\n", j->wall, j->cpu, j->status,
+	      j->input);
+      if (j->status)
+	 failed++;
+   }
+   fprintf(stderr, "%s: %d jobs, %d failed, on %d slots in %.3f s, "
+	   "max %.1f MB\n", Prog, njobs, failed, slots, now() - start,
+	   ru.ru_maxrss / 1024.0);
+   return failed > 0;
+}
 
 int main(int argc, char** argv) {
+   struct algorithm *a;
+   char *s;
 
-    
-    
-    return 0;
+   Prog = (s = strrchr(argv[0], '/')) ? s + 1 : argv[0];
+   if (!strcmp(Prog, "batch"))
+      return batch(argc, argv);
+   if (argc > 1 && !strcmp(argv[1], "batch")) {
+      Prog = argv[1];
+      return batch(argc - 1, argv + 1);
+   }
+   if (!(a = findalgorithm(Prog)) && argc > 1 && (a = findalgorithm(argv[1]))) {
+      Prog = argv[1];
+      argc--;
+      argv++;
+   }
+   if (!a) {
+      usage(Prog);
+      return 1;
+   }
+   return runalgorithm(a, argc, argv);
 }
 
 void setfilenames(char *arg)
@@ -38,7 +322,9 @@ void setfilenames(char *arg)
 
 /*
  * output_pfsa() is used to output the PFSA in the same format we expect
- * to read them in, except if the Graphplace flag is given.
+ * to read them in, except if the Graphplace flag is given.  With the
+ * Binary flag it is written in the binary format, which buildpfsa()
+ * also reads.
  */
 void output_pfsa(NODE *pfsa, char outfile[])
 {
@@ -48,17 +334,20 @@ void output_pfsa(NODE *pfsa, char outfile[])
    if (!strcmp(outfile, "-"))
       fp = stdout;
    else
-      fp = fopen(outfile, "w");
+      fp = fopen(outfile, Binary ? "wb" : "w");
    if (!fp)
       Perror(outfile);
-   if (Graphplace) {
+   if (Binary) {
+      /* No room for comments, so Verbose adds nothing */
+      writebpfsa(fp, pfsa);
+   } else if (Graphplace) {
       fprintf (fp, "%%!PS\n/makearrows true def\n");
       if (Verbose)
 	 fprintf (fp, "/Times-Roman findfont 18 scalefont setfont\n"
 		  "300 810 (%s) centertext\n", Callstring);
       writepfsa(fp, pfsa);
       if (Verbose) {
-	 sprintf(buf, "MML = %.2f bits", mml(Pfsa, (double *) 0));
+	 sprintf(buf, "MML = %.2f bits", mml(pfsa, (double *) 0));
 	 fprintf (fp, "/Times-Roman findfont 12 scalefont setfont\n"
 		  "300 36 (%s) centertext\n", buf);
       }
@@ -72,8 +361,8 @@ void output_pfsa(NODE *pfsa, char outfile[])
 	 fprintf(fp, "# MML = %.2f bits\n", mml(pfsa, (double *) 0));
       }
    }
-   if (fp != stdout)
-      (void) fclose(fp);
+   if (fflush(fp) || ferror(fp) || (fp != stdout && fclose(fp)))
+      Perror(outfile);
 }
 
 static void usage(char *prog)
@@ -85,6 +374,11 @@ static void usage(char *prog)
       "\t simba:  Do a breadth first simba search\n"
       "\t ktail:  Do Biermann & Feldman's (1979) k-tails algorithm\n"
       "\t skstr:  Do Raman & Patrick's (1995) sk-strings algorithm\n\n"
+      "or the first argument should be, as in \"pfsa-fork skstr f1.pfsa\".\n"
+      "Only skstr is in this build.\n\n"
+      "To run one on many files, up to jobs at a time, use\n\n"
+      "\t batch [-j jobs] manifest algorithm [options]\n\n"
+      "where each line of the manifest is \"input [output [options]]\".\n\n"
       "For further information on each of the algorithm's options, invoke\n"
       "the appropriate program with the -h option\n\n";
    fprintf(stderr, "This program was called with the name: %s\n", prog);
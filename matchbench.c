@@ -0,0 +1,214 @@
+/*
+ * File:   matchbench.c
+ *
+ * Check and benchmark of the memoised matchlen(), lfindtrans() and
+ * acceptable() against the plain recursive ones they replaced, which
+ * are kept here as old_*.  It builds a layered random nfa: state 0 and
+ * then layers of width states, each state with arcs arcs on NSYMS
+ * symbols into the next layer, so that most states have several arcs
+ * on the same symbol.  States of the last layer, and one in DELIMEVERY
+ * of the others, go back to state 0 on the delimiter.  It makes nstrings
+ * strings, half of them random walks from state 0 which may run on
+ * through the delimiter into a second walk, half of them random with
+ * the odd delimiter, and from every state of the first two layers asks
+ * both ways for acceptable() of each string and matchlen() and
+ * lfindtrans() at each position of it.  Any difference is an error.
+ * It reports the time each way.
+ *
+ * It is not part of the project build.  To build and run it:
+ *
+ *   cc -O2 -o matchbench matchbench.c -lm &&
+ *       ./matchbench [layers [width [arcs [nstrings]]]]
+ */
+
+#define MAIN
+#include <errno.h>
+#include <time.h>
+#include "pfsa.h"
+#include "misc.c"
+
+#define NSYMS 2
+#define DELIMEVERY 4
+#define MAXLEN 80
+
+char *Prog = (char *) "matchbench";
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * matchlen(), lfindtrans() and acceptable() as they were.
+ */
+static int old_matchlen(NODE *p, int *s) {
+    TRANS *t;
+    int len, bestlen;
+
+    t = findtrans(p->translist->next_tran, *s);
+    if (!t || !*s)
+        return 0;
+    if (Symtab[*s].label[0] == Delim)
+        return 1;
+    bestlen = 1 + old_matchlen(t->target, s + 1);
+    while (t->next_tran && t->next_tran->sym == *s) {
+        t = t->next_tran;
+        len = 1 + old_matchlen(t->target, s + 1);
+        if (bestlen < len)
+            bestlen = len;
+    }
+    return bestlen;
+}
+
+static TRANS *old_lfindtrans(TRANS *t, int *s) {
+    TRANS *best;
+
+    while (t && t->sym != *s)
+        t = t->next_tran;
+    if (!t || !*s)
+        return (TRANS *) 0;
+    if (Symtab[*s].label[0] == Delim)
+        return t;
+    best = t;
+    while (t->next_tran && t->next_tran->sym == *s) {
+        t = t->next_tran;
+        if (old_matchlen(best->target, s + 1) < old_matchlen(t->target, s + 1))
+            best = t;
+    }
+    return best;
+}
+
+static int old_acceptable(NODE *q, int *s) {
+    TRANS *tp;
+
+    while (*s) {
+        tp = old_lfindtrans(q->translist, s);
+        if (!tp)
+            return 0;
+        else
+            q = tp->target;
+        ++s;
+    }
+    return 1;
+}
+
+/*
+ * A random walk from state 0 into s, which goes on from state 0 after
+ * a delimiter one time in two.  Return its length.
+ */
+static int walk(int *s) {
+    NODE *p = findnode(Pfsa, 0);
+    TRANS *t;
+    int n = 0;
+
+    while (n < MAXLEN && p->ntranslist) {
+        t = &p->translist[1 + rand() % p->ntranslist];
+        s[n++] = t->sym;
+        p = t->target;
+        if (t->sym == DELIMITER && rand() % 2)
+            break;
+    }
+    s[n] = 0;
+    return n;
+}
+
+int main(int argc, char **argv) {
+    NODE **node, *p;
+    int **str, sym[NSYMS], layers, width, arcs, nstrings, nstates;
+    int i, j, k, n, nfirst, oldlen, newlen;
+    TRANS *oldt, *newt;
+    double told, tnew, t;
+    char label[16];
+
+    layers = argc > 1 ? atoi(argv[1]) : 16;
+    width = argc > 2 ? atoi(argv[2]) : 8;
+    arcs = argc > 3 ? atoi(argv[3]) : 4;
+    nstrings = argc > 4 ? atoi(argv[4]) : 1000;
+    if (layers < 2 || width < 1 || arcs < 1 || nstrings < 1) {
+        fprintf(stderr, "usage: %s [layers [width [arcs [nstrings]]]]\n",
+                argv[0]);
+        return 1;
+    }
+    nstates = 1 + layers * width;
+    node = (NODE **) malloc(nstates * sizeof (NODE *));
+    str = (int **) malloc(nstrings * sizeof (int *));
+    if (!node || !str)
+        memerr();
+
+    startpfsa();
+    for (i = 0; i < NSYMS; i++) {
+        sprintf(label, "%c", 'a' + i);
+        sym[i] = addsym(label);
+    }
+    srand(1);
+    for (i = 0; i < nstates; i++)
+        node[i] = addnode(Pfsa, i);
+    for (i = 0; i < nstates; i++) {
+        k = i ? (i - 1) / width + 1 : 0;	/* layer of state i */
+        if (k == layers || (k && rand() % DELIMEVERY == 0))
+            addtrans(node[i], node[0], DELIMITER, 1);
+        if (k == layers)
+            continue;
+        for (j = 0; j < (i ? arcs : width); j++)
+            addtrans(node[i], node[1 + k * width + rand() % width],
+                    sym[rand() % NSYMS], 1);
+    }
+    printf("%d states, %d arcs, %d strings\n", nstates(Pfsa), trancnt(Pfsa),
+            nstrings);
+
+    for (i = 0; i < nstrings; i++) {
+        if (!(str[i] = (int *) malloc((MAXLEN + 1) * sizeof (int))))
+            memerr();
+        if (i % 2)
+            n = walk(str[i]);
+        else {
+            n = 1 + rand() % layers;
+            for (j = 0; j < n; j++)
+                str[i][j] = rand() % 8 ? sym[rand() % NSYMS] : DELIMITER;
+            str[i][n] = 0;
+        }
+    }
+
+    /*
+     * Old and new in turn over the same strings, each one timed.
+     */
+    nfirst = 1 + 2 * width;
+    told = tnew = 0;
+    for (i = 0; i < nstrings; i++)
+        for (k = 0; k < nfirst; k++) {
+            p = node[k];
+            t = now();
+            oldlen = old_acceptable(p, str[i]);
+            told += now() - t;
+            t = now();
+            newlen = acceptable(p, str[i]);
+            tnew += now() - t;
+            if (oldlen != newlen) {
+                fprintf(stderr, "string %d from state %d: acceptable() "
+                        "was %d, now %d\n", i, p->state, oldlen, newlen);
+                return 1;
+            }
+            for (j = 0; str[i][j]; j++) {
+                t = now();
+                oldlen = old_matchlen(p, &str[i][j]);
+                oldt = old_lfindtrans(p->translist, &str[i][j]);
+                told += now() - t;
+                t = now();
+                newlen = matchlen(p, &str[i][j]);
+                newt = lfindtrans(p->translist, &str[i][j]);
+                tnew += now() - t;
+                if (oldlen != newlen || oldt != newt) {
+                    fprintf(stderr, "string %d from state %d at %d: "
+                            "matchlen() was %d, now %d%s\n", i, p->state,
+                            j, oldlen, newlen, oldt != newt ?
+                            ", lfindtrans() differs" : "");
+                    return 1;
+                }
+            }
+        }
+    printf("%d strings from %d states, the same answers\n", nstrings, nfirst);
+    printf("old %8.3f s, memoised %8.3f s\n", told, tnew);
+    return 0;
+}
@@ -7,6 +7,15 @@
 #include "pfsa.h"
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <math.h>
 #ifndef MISC_C
 #define MISC_C
 
@@ -29,45 +38,1064 @@ static void add2q(NODEQ *nq, NODE *p);
 static NODE *dequeue(NODEQ *nq);
 static void deleteq(NODEQ *nq);
 NODE *isort(NODE *p);
-STATE *consStateNode(int state, STATE *next);
+STATE *consStateNode(NODE *pfsa, int state, STATE *next);
 
-void buildpfsa(char specsfile[]) {
-    extern char Infile[];
-    char temp[BUFSIZ];
-    extern FILE *yyin;
-    int parse_err, yyparse();
+/*
+ * Translist and srclist are arrays with a dummy header at index 0 (see
+ * pfsa.h).  These grow them, open or close a gap at a given index, and
+ * re-thread the next_tran/next_src links afterwards.  Indices rather than
+ * pointers must be held across an insertion since the array may move.
+ *
+ * Srclist is kept sorted by sym and then by source state number, so
+ * that addtrans() can binary search it and merge() can restore it with
+ * a sort.  A sink such as state 0 of a canonical pfsa has an entry for
+ * nearly every state.  Translist order is sym and then arrival order as
+ * before, since that order shows in the output and in get_kstrList().
+ */
+#define LISTCHUNK 2		/* initial list size, incl. the header */
 
-    strcpy(temp, Infile);
-    strcpy(Infile, specsfile);
+static void relinktrans(NODE *p, int from);
+static void relinksrcs(NODE *p, int from);
+static TRANS *instrans(NODE *p, int i);
+static SOURCE *inssrc(NODE *p, int i);
+static void packtrans(NODE *p);
+static void sortsrcs(NODE *p);
 
-    if (strcmp(Infile, "-")) {
-        yyin = fopen(Infile, "r");
-        if (!yyin)
-            Perror(Infile);
+/*
+ * Support for trymerge() and friends, see merge().
+ */
+static void domerge(NODE *pfsa, NODE *p1, NODE *p2, MERGELOG **logp);
+static MERGELOG *savemerge(NODE *pfsa, NODE **touched, int ntouched);
+static STATE *copystates(NODE *pfsa, STATE *list);
+
+/*
+ * Memo of matchlen() for acceptable() and lfindtrans(), see matchlen().
+ * The table lives on the caller's stack, and in local[] until it grows
+ * too big, so that several threads can test strings at once.
+ */
+#define MEMOLOCAL 64		/* power of 2 */
+
+typedef struct {
+    NODE *node;			/* Null if the slot is free */
+    int *s;
+    int len;
+} MEMOENT;
+
+typedef struct {
+    int n, size;		/* size 0 until first used */
+    MEMOENT *ent;
+    MEMOENT local[MEMOLOCAL];
+} MEMO;
+
+static int memomatchlen(MEMO *m, NODE *p, int *s);
+static TRANS *memolfindtrans(MEMO *m, TRANS *t, int *s);
+static void memofree(MEMO *m);
+
+/*
+ * Maintenance of the state number -> node index in the pfsa header.
+ */
+static void setindex(NODE *pfsa, int state, NODE *p);
+static void reindex(NODE *pfsa);
+
+/*
+ * Reading a pfsa.  Each line of the file is "source target symbol freq",
+ * as writepfsa() writes them, with the delimiter written as \n.  Blank
+ * lines and lines starting with # are skipped.  A regular file is mapped
+ * and parsed where it lies; anything else (stdin, a pipe) is read
+ * LOADCHUNK bytes at a time, carrying a part line over to the next read.
+ * Nothing is allocated per line: the arcs of a source state are gathered
+ * into a batch that addarcs() adds in one go, since a file lists the
+ * arcs of each state together and in translist order.
+ */
+#define LOADCHUNK (1 << 20)
+#define LOADBLANK(c) ((c) == ' ' || (c) == '\t' || (c) == '\r')
+
+typedef struct {
+    NODE *dst;
+    int sym, freq;
+} LOADARC;
+
+typedef struct {
+    NODE *src;			/* Source of the arcs in the batch, or null */
+    LOADARC *arc;
+    int narc, arcsize;
+    char *label;		/* The label being read, as a string */
+    int labelsize;
+    char *last;			/* The last line, if it has no newline */
+    size_t lastsize;
+} LOADER;
+
+static void addsrc(NODE *dst, NODE *src, int sym, int freq);
+static void poolreserve(POOL *pool, size_t n);
+static size_t poolsize(size_t n);
+static int srccmp(const void *a, const void *b);
+
+static void loaderr(const char *msg) {
+    fprintf(stderr, "%s: line %d: %s\n", Infile, Lineno, msg);
+    bail(0);
+}
+
+/*
+ * Add the batch of arcs to their source state.  A state with no arcs
+ * yet, given them in order and none twice, as writepfsa() writes them,
+ * has its translist filled in directly; addtrans() does the rest.
+ */
+static void addarcs(LOADER *ld) {
+    NODE *src = ld->src;
+    LOADARC *a = ld->arc;
+    TRANS *tl, *tp;
+    int i, j, n, direct;
+
+    n = ld->narc;
+    ld->narc = 0;
+    direct = !src->ntranslist;
+    for (i = 1; direct && i < n; i++) {
+        if (a[i].sym < a[i - 1].sym)
+            direct = 0;
+        for (j = i - 1; direct && j >= 0 && a[j].sym == a[i].sym; j--)
+            if (a[j].dst == a[i].dst)
+                direct = 0;
     }
+    if (!direct) {
+        for (i = 0; i < n; i++)
+            addtrans(src, a[i].dst, a[i].sym, a[i].freq);
+        return;
+    }
+    if (src->translistsize < n + 1) {
+        tl = (TRANS *) poolalloc(src->pool, (n + 1) * sizeof (TRANS));
+        tl[0] = src->translist[0];
+        poolfree(src->pool, src->translist, src->translistsize * sizeof (TRANS));
+        src->translist = tl;
+        src->translistsize = n + 1;
+    }
+    for (i = 0; i < n; i++) {
+        tp = &src->translist[i + 1];
+        tp->target = a[i].dst;
+        tp->sym = a[i].sym;
+        tp->freq = a[i].freq;
+        if (!i || a[i].sym != a[i - 1].sym)
+            src->nsymbols++;
+        if (Symtab[a[i].sym].label[0] != Delim)
+            nodehdr(src)->trancnt++;
+        src->ntrans += a[i].freq;
+        a[i].dst->nvisits += a[i].freq;
+        Symtab[a[i].sym].freq += a[i].freq;
+        addsrc(a[i].dst, src, a[i].sym, a[i].freq);
+    }
+    src->ntranslist = n;
+    src->pshift = 0;
+    relinktrans(src, 0);
+}
 
-    /*
-     * Make delimiter the first symbol in the symbol table, Note Symtab[0]
-     * is a sentinel, can't use it, so symtab[1] is the first
-     */
-    sprintf(Symtab[DELIMITER].label, "%c", Delim);
+static int loadint(const char **sp) {
+    const char *s = *sp;
+    long n = 0;
+
+    if (*s < '0' || *s > '9')
+        loaderr("number expected");
+    do {
+        n = 10 * n + *s++ - '0';
+        if (n > INT_MAX)
+            loaderr("number too big");
+    } while (*s >= '0' && *s <= '9');
+    if (!LOADBLANK(*s) && *s != '\n')
+        loaderr("bad number");
+    *sp = s;
+    return (int) n;
+}
+
+static const char *loadblank(const char *s) {
+    if (!LOADBLANK(*s))
+        loaderr("too few fields");
+    while (LOADBLANK(*s))
+        s++;
+    return s;
+}
+
+/*
+ * Parse the whole lines in s..e and return where the first part line
+ * starts, or e.  A line ends in a newline, which stops every scan
+ * below, so only the search for it looks at e.
+ */
+static const char *loadlines(LOADER *ld, const char *s, const char *e) {
+    const char *nl, *label;
+    int src, dst, len, freq;
+
+    for (; s < e && (nl = (const char *) memchr(s, '\n', e - s)); s = nl + 1, Lineno++) {
+        while (LOADBLANK(*s))
+            s++;
+        if (*s == '\n' || *s == '#')
+            continue;
+        src = loadint(&s);
+        s = loadblank(s);
+        dst = loadint(&s);
+        s = loadblank(s);
+        for (label = s; !LOADBLANK(*s) && *s != '\n'; s++)
+            ;
+        len = s - label;
+        s = loadblank(s);
+        freq = loadint(&s);
+        while (LOADBLANK(*s))
+            s++;
+        if (*s != '\n')
+            loaderr("too many fields");
+
+        if (len + 1 > ld->labelsize) {
+            ld->labelsize = 2 * (len + 1);
+            ld->label = (char *) realloc(ld->label, ld->labelsize);
+            if (!ld->label)
+                memerr();
+        }
+        if (len == 2 && label[0] == '\\' && label[1] == 'n')
+            strcpy(ld->label, "\n");
+        else {
+            memcpy(ld->label, label, len);
+            ld->label[len] = '\0';
+        }
+        if (!ld->src || ld->src->state != src) {
+            if (ld->src)
+                addarcs(ld);
+            ld->src = addnode(Pfsa, src);
+        }
+        if (ld->narc == ld->arcsize) {
+            ld->arcsize = ld->arcsize ? 2 * ld->arcsize : 64;
+            ld->arc = (LOADARC *) realloc(ld->arc, ld->arcsize * sizeof (LOADARC));
+            if (!ld->arc)
+                memerr();
+        }
+        ld->arc[ld->narc].dst = addnode(Pfsa, dst);
+        ld->arc[ld->narc].sym = addsym(ld->label);
+        ld->arc[ld->narc].freq = freq;
+        ld->narc++;
+    }
+    return s;
+}
+
+/*
+ * The last line of a file need not end in a newline.
+ */
+static void loadlast(LOADER *ld, const char *s, const char *e) {
+    if (s == e)
+        return;
+    if ((size_t) (e - s) + 1 > ld->lastsize) {
+        ld->lastsize = e - s + 1;
+        ld->last = (char *) realloc(ld->last, ld->lastsize);
+        if (!ld->last)
+            memerr();
+    }
+    memcpy(ld->last, s, e - s);
+    ld->last[e - s] = '\n';
+    loadlines(ld, ld->last, ld->last + (e - s) + 1);
+}
+
+static void binerr(const char *msg) {
+    fprintf(stderr, "%s: bad binary pfsa: %s\n", Infile, msg);
+    bail(0);
+}
+
+/*
+ * Lay out the pfsa of nstates states from arrays as in the binary file
+ * (see PFSABIN in pfsa.h), with the symbols of the arcs already numbered
+ * as in Symtab.  The nodes and their lists come from one reservation of
+ * the pool, as in copypfsa().  The arcs of each state must be in
+ * translist order, with none twice.  nsrc[i] is the number of arcs into
+ * state[i].
+ */
+static void csrpfsa(NODE *pfsa, size_t nstates, const u_int32_t *state,
+        const u_int32_t *first, const u_int32_t *target, const int *sym,
+        const u_int32_t *freq, const int *nsrc) {
+    NODE **node, *p, *q;
+    TRANS *tp;
+    SOURCE *sp;
+    size_t need, i, j;
+
+    node = (NODE **) malloc((nstates + 1) * sizeof (NODE *));
+    if (!node)
+        memerr();
+    for (need = 0, i = 0; i < nstates; i++) {
+        need += poolsize(sizeof (NODE));
+        need += poolsize((first[i + 1] - first[i] + 1) * sizeof (TRANS));
+        need += poolsize((nsrc[i] + 1) * sizeof (SOURCE));
+    }
+    poolreserve(pfsa->pool, need);
+    for (q = pfsa, i = 0; i < nstates; q = p, i++) {
+        p = node[i] = (NODE *) poolalloc(pfsa->pool, sizeof (NODE));
+        p->state = state[i];
+        p->pool = pfsa->pool;
+        p->translistsize = first[i + 1] - first[i] + 1;
+        p->translist = (TRANS *) poolalloc(p->pool,
+                p->translistsize * sizeof (TRANS));
+        p->srclistsize = nsrc[i] + 1;
+        p->srclist = (SOURCE *) poolalloc(p->pool,
+                p->srclistsize * sizeof (SOURCE));
+        p->translist->sym = p->srclist->sym = -1;
+        p->prevnode = q;
+        q->nextnode = p;
+        setindex(pfsa, p->state, p);
+    }
+    for (i = 0; i < nstates; i++) {
+        p = node[i];
+        for (j = first[i]; j < first[i + 1]; j++) {
+            tp = &p->translist[++p->ntranslist];
+            tp->target = q = node[target[j]];
+            tp->sym = sym[j];
+            tp->freq = freq[j];
+            if (j == first[i] || sym[j] != sym[j - 1])
+                p->nsymbols++;
+            if (Symtab[tp->sym].label[0] != Delim)
+                incr_trancnt(pfsa);
+            p->ntrans += tp->freq;
+            q->nvisits += tp->freq;
+            Symtab[tp->sym].freq += tp->freq;
+            sp = &q->srclist[++q->nsrclist];
+            sp->source = p;
+            sp->sym = tp->sym;
+            sp->freq = tp->freq;
+        }
+        relinktrans(p, 0);
+    }
+
+    /* Each srclist has its sources in order, but not its syms */
+    for (i = 0; i < nstates; i++) {
+        p = node[i];
+        for (j = 2; j <= (size_t) p->nsrclist; j++)
+            if (p->srclist[j].sym < p->srclist[j - 1].sym)
+                break;
+        if (j <= (size_t) p->nsrclist)
+            qsort((void *) &p->srclist[1], p->nsrclist, sizeof (SOURCE), srccmp);
+        relinksrcs(p, 0);
+    }
+    nstates(pfsa) = nstates;
+    if (nstates)
+        setmaxstatenum(pfsa, state[nstates - 1]);
+    free(node);
+}
+
+/*
+ * Build the pfsa from a binary file of size bytes at b, see PFSABIN in
+ * pfsa.h.  Everything is checked before use, so a short or damaged file
+ * is an error rather than a crash.  csrpfsa() lays it out straight from
+ * the arrays.  That needs the arcs of each state in translist order once
+ * their symbols are numbered here, which they are unless this Symtab
+ * numbered some of them differently before; then addtrans() builds it
+ * instead.
+ */
+static void loadbin(const char *b, size_t size) {
+    const PFSABIN *h = (const PFSABIN *) b;
+    const u_int32_t *labelend, *state, *first, *target, *sym, *freq;
+    const char *labels;
+    NODE **node;
+    int *symmap, *nsrc, *arcsym, direct;
+    size_t need, i, j, k;
+
+    if (size < sizeof (PFSABIN))
+        binerr("too short");
+    if (h->order != PFSABIN_ORDER)
+        binerr("written with the other byte order");
+    if (h->version != PFSABIN_VERSION)
+        binerr("unknown version");
+    need = sizeof (PFSABIN) + sizeof (u_int32_t) * ((size_t) h->nsyms +
+            2 * (size_t) h->nstates + 1 + 3 * (size_t) h->narcs);
+    if (size < need)
+        binerr("too short");
+    labelend = (const u_int32_t *) (h + 1);
+    state = labelend + h->nsyms;
+    first = state + h->nstates;
+    target = first + h->nstates + 1;
+    sym = target + h->narcs;
+    freq = sym + h->narcs;
+    labels = (const char *) (freq + h->narcs);
+    if (h->nsyms && size - need < labelend[h->nsyms - 1])
+        binerr("too short");
+
+    /* All checked before anything is allocated, to fail without leaking */
+    for (i = 1, j = 0; i <= h->nsyms; j = labelend[i - 1], i++)
+        if (labelend[i - 1] <= j || labelend[i - 1] > size - need ||
+                labels[labelend[i - 1] - 1])
+            binerr("bad label");
+    if (first[0] || first[h->nstates] != h->narcs)
+        binerr("bad arc index");
+    for (i = 0; i < h->nstates; i++) {
+        if ((i && state[i] <= state[i - 1]) || state[i] > INT_MAX)
+            binerr("bad state number");
+        if (first[i + 1] < first[i])
+            binerr("bad arc index");
+    }
+    for (i = 0; i < h->narcs; i++)
+        if (target[i] >= h->nstates || !sym[i] || sym[i] > h->nsyms ||
+                freq[i] > INT_MAX)
+            binerr("bad arc");
+
+    symmap = (int *) malloc((h->nsyms + 1) * sizeof (int));
+    nsrc = (int *) calloc(h->nstates + 1, sizeof (int));
+    if (!symmap || !nsrc)
+        memerr();
+    direct = 1;
+    for (i = 1, j = 0; i <= h->nsyms; j = labelend[i - 1], i++) {
+        symmap[i] = addsym((char *) labels + j);
+        if (i > 1 && symmap[i] <= symmap[i - 1])
+            direct = 0;
+    }
+    for (i = 0; i < h->narcs; i++)
+        nsrc[target[i]]++;
+    for (i = 0; direct && i < h->nstates; i++)
+        for (j = first[i] + 1; direct && j < first[i + 1]; j++) {
+            if (sym[j] < sym[j - 1])
+                direct = 0;
+            for (k = j; direct && k-- > first[i] && sym[k] == sym[j];)
+                if (target[k] == target[j])
+                    direct = 0;
+        }
+
+    if (!direct) {
+        node = (NODE **) malloc((h->nstates + 1) * sizeof (NODE *));
+        if (!node)
+            memerr();
+        for (i = 0; i < h->nstates; i++)
+            node[i] = addnode(Pfsa, state[i]);
+        for (i = 0; i < h->nstates; i++)
+            for (j = first[i]; j < first[i + 1]; j++)
+                addtrans(node[i], node[target[j]], symmap[sym[j]], freq[j]);
+        free(node);
+    } else {
+        arcsym = (int *) malloc((h->narcs + 1) * sizeof (int));
+        if (!arcsym)
+            memerr();
+        for (i = 0; i < h->narcs; i++)
+            arcsym[i] = symmap[sym[i]];
+        csrpfsa(Pfsa, h->nstates, state, first, target, arcsym, freq, nsrc);
+        free(arcsym);
+    }
+    free(symmap);
+    free(nsrc);
+}
+
+/*
+ * Load the pfsa, binary or text, in b[0 .. size-1].
+ */
+static void loadmem(LOADER *ld, const char *b, size_t size) {
+    const char *s;
+
+    if (size >= 4 && !memcmp(b, PFSABIN_MAGIC, 4))
+        loadbin(b, size);
+    else {
+        s = loadlines(ld, b, b + size);
+        loadlast(ld, s, b + size);
+    }
+}
+
+/*
+ * The loader of this context, emptied for a new load.  Its buffers stay
+ * in the context from one load to the next, so that a load that fails
+ * part way leaves them to freecontext().
+ */
+static LOADER *startload(void) {
+    LOADER *ld = (LOADER *) Ctx->loader;
+
+    if (!ld && !(ld = (LOADER *) calloc(1, sizeof (LOADER))))
+        memerr();
+    Ctx->loader = ld;
+    ld->src = (NODE *) 0;
+    ld->narc = 0;
+    Lineno = 1;
+    return ld;
+}
+
+static void loadpfsa(char *file) {
+    LOADER *ld;
+    struct stat st;
+    const char *s;
+    char *map, *buf;
+    size_t size, len;
+    ssize_t got;
+    int fd, bin;
+
+    ld = startload();
+    fd = strcmp(file, "-") ? open(file, O_RDONLY) : 0;
+    if (fd < 0)
+        Perror(file);
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (void *) (map = (char *) mmap((void *) 0, st.st_size, PROT_READ,
+            MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+        (void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+        loadmem(ld, map, st.st_size);
+        (void) munmap(map, st.st_size);
+    } else {
+        /* A binary stream is read whole, text a chunk at a time */
+        size = LOADCHUNK;
+        len = 0;
+        bin = 0;
+        buf = (char *) malloc(size);
+        if (!buf)
+            memerr();
+        while ((got = read(fd, buf + len, size - len)) > 0) {
+            len += got;
+            if (!bin && len >= 4 && !memcmp(buf, PFSABIN_MAGIC, 4))
+                bin = 1;
+            if (!bin) {
+                s = loadlines(ld, buf, buf + len);
+                len -= s - buf;
+                memmove(buf, s, len);
+            }
+            if (len == size) {	/* a line longer than buf, or binary */
+                size *= 2;
+                buf = (char *) realloc(buf, size);
+                if (!buf)
+                    memerr();
+            }
+        }
+        if (got < 0)
+            Perror(file);
+        if (bin)
+            loadbin(buf, len);
+        else
+            loadlast(ld, buf, buf + len);
+        free(buf);
+    }
+    if (ld->src)
+        addarcs(ld);
+    if (fd)
+        (void) close(fd);
+}
+
+/*
+ * Make delimiter the first symbol in the symbol table, Note Symtab[0]
+ * is a sentinel, can't use it, so symtab[1] is the first.  Then start
+ * the pfsa to build into.
+ */
+static void startpfsa(void) {
+    char delim[2];
+
+    delim[0] = Delim;
+    delim[1] = '\0';
+    if (addsym(delim) != DELIMITER) {
+        fprintf(stderr, "Delimiter must be the first symbol\n");
+        bail(0);
+    }
+    Pfsa = createpfsa();
+}
+
+void buildpfsa(char specsfile[]) {
+    char temp[BUFSIZ];
+
+    strcpy(temp, Infile);
+    if (specsfile != Infile)
+        strcpy(Infile, specsfile);
 
     /*
      * Build the pfsa from the specs in the file.
      */
-    Pfsa = (NODE *) calloc(1, sizeof (NODE)); /* set up header */
-    if (!Pfsa)
+    startpfsa();
+    loadpfsa(Infile);
+    setprobs(Pfsa);
+    strcpy(Infile, temp);
+}
+
+/*
+ * The same for a pfsa in memory, b[0 .. size-1].
+ */
+void buildpfsabuf(const char *b, size_t size) {
+    LOADER *ld;
+
+    startpfsa();
+    ld = startload();
+    loadmem(ld, b, size);
+    if (ld->src)
+        addarcs(ld);
+    setprobs(Pfsa);
+}
+
+/*
+ * Building the canonical pfsa, the prefix tree acceptor, straight from
+ * a corpus of strings rather than from a pfsa file.  Each string ends in
+ * Delim and its symbols are separated by ':', as toks2syms() takes them;
+ * blanks around a symbol are dropped, since a pfsa file could not hold
+ * them, and so are empty symbols and strings.
+ *
+ * The corpus is split at string ends into one part per thread, and each
+ * thread builds a trie of its part (a PTA), with its own symbol numbers.
+ * A regular file is mapped and split whole; anything else is read in
+ * blocks of PTACHUNK bytes a thread.  After each block the new symbols
+ * of the threads are added to Symtab in turn, which numbers them in
+ * order of first use, as reading the corpus in one go would.  At the
+ * end the tries are merged into the first and laid out by csrpfsa() in
+ * breadth first order, each state's arcs in sym order, the delimiter
+ * back to state 0 first.  So the pfsa is the same whatever the number
+ * of threads, and the same as bf_renumber() would make of it.
+ */
+#define PTACHUNK (16 << 20)
+#define PTABLANK(c) (LOADBLANK(c) || ((c) == '\n' && Delim != '\n'))
+
+typedef struct {
+    int parent, sym;
+    long freq;			/* Strings through this node */
+    long end;			/* Strings that end here */
+} PTANODE;
+
+typedef struct {
+    CONTEXT *ctx;		/* Of the thread that started this one */
+    const char *s, *e;		/* The part of the corpus to add */
+    PTANODE *node;		/* node[0] is the root */
+    int nnodes, nodesize;
+    int *slot;			/* Hash of nodes by parent and sym */
+    unsigned nslot;
+    char *label;		/* The symbols, each NUL terminated */
+    size_t labellen, labelsize;
+    size_t *symoff;		/* symoff[i] is where symbol i starts */
+    unsigned *symhashv;
+    int nsym, symsize;
+    int *symslot;		/* Hash of symbols */
+    unsigned nsymslot;
+    int *symmap;		/* Symtab numbers of symbols 1..nmapped */
+    int nmapped;
+} PTA;
+
+static unsigned ptaslot(PTA *t, int parent, int sym) {
+    u_long h;
+
+    h = (u_long) parent * 0x9E3779B97F4A7C15UL ^ (u_long) sym * 0xC2B2AE3D27D4EB4FUL;
+    return (unsigned) (h ^ h >> 29) & (t->nslot - 1);
+}
+
+static void ptarehash(PTA *t) {
+    unsigned i;
+    int n;
+
+    free(t->slot);
+    t->slot = (int *) calloc(t->nslot, sizeof (int));
+    if (!t->slot)
+        memerr();
+    for (n = 1; n < t->nnodes; n++) {
+        for (i = ptaslot(t, t->node[n].parent, t->node[n].sym); t->slot[i];
+                i = (i + 1) & (t->nslot - 1))
+            ;
+        t->slot[i] = n;
+    }
+}
+
+/*
+ * The child of parent on sym, made if there is none.
+ */
+static int ptachild(PTA *t, int parent, int sym) {
+    PTANODE *q;
+    unsigned i;
+    int n;
+
+    for (i = ptaslot(t, parent, sym); (n = t->slot[i]); i = (i + 1) & (t->nslot - 1))
+        if (t->node[n].sym == sym && t->node[n].parent == parent)
+            return n;
+    if (t->nnodes == INT_MAX) {
+        fprintf(stderr, "Too many states in the prefix tree\n");
+        bail(EOVERFLOW);
+    }
+    if (t->nnodes == t->nodesize) {
+        t->nodesize = t->nodesize < INT_MAX / 2 ? 2 * t->nodesize : INT_MAX;
+        t->node = (PTANODE *) realloc(t->node, t->nodesize * sizeof (PTANODE));
+        if (!t->node)
+            memerr();
+    }
+    n = t->nnodes++;
+    q = &t->node[n];
+    q->parent = parent;
+    q->sym = sym;
+    q->freq = q->end = 0;
+    if (2 * (u_long) t->nnodes > t->nslot) {
+        t->nslot *= 2;
+        ptarehash(t);
+    } else
+        t->slot[i] = n;
+    return n;
+}
+
+/*
+ * The number of the symbol of len bytes at s in the trie, from 1 up,
+ * made if there is none.
+ */
+static int ptasym(PTA *t, const char *s, size_t len) {
+    const char *l;
+    unsigned h, i;
+    size_t k;
+    int n;
+
+    for (h = 2166136261U, k = 0; k < len; k++)
+        h = (h ^ (unsigned char) s[k]) * 16777619U;
+    for (i = h & (t->nsymslot - 1); (n = t->symslot[i]); i = (i + 1) & (t->nsymslot - 1)) {
+        l = t->label + t->symoff[n];
+        if (t->symhashv[n] == h && !memcmp(l, s, len) && !l[len])
+            return n;
+    }
+    if (++t->nsym == t->symsize) {
+        t->symsize *= 2;
+        t->symoff = (size_t *) realloc(t->symoff, t->symsize * sizeof (size_t));
+        t->symhashv = (unsigned *) realloc(t->symhashv, t->symsize * sizeof (unsigned));
+        if (!t->symoff || !t->symhashv)
+            memerr();
+    }
+    n = t->nsym;
+    if (t->labellen + len + 1 > t->labelsize) {
+        while (t->labellen + len + 1 > t->labelsize)
+            t->labelsize *= 2;
+        t->label = (char *) realloc(t->label, t->labelsize);
+        if (!t->label)
+            memerr();
+    }
+    t->symoff[n] = t->labellen;
+    t->symhashv[n] = h;
+    memcpy(t->label + t->labellen, s, len);
+    t->label[t->labellen + len] = '\0';
+    t->labellen += len + 1;
+    t->symslot[i] = n;
+    if (2 * (unsigned) t->nsym > t->nsymslot) {
+        t->nsymslot *= 2;
+        free(t->symslot);
+        t->symslot = (int *) calloc(t->nsymslot, sizeof (int));
+        if (!t->symslot)
+            memerr();
+        for (n = 1; n <= t->nsym; n++) {
+            for (i = t->symhashv[n] & (t->nsymslot - 1); t->symslot[i];
+                    i = (i + 1) & (t->nsymslot - 1))
+                ;
+            t->symslot[i] = n;
+        }
+    }
+    return t->nsym;
+}
+
+static void ptainit(PTA *t) {
+    memset(t, 0, sizeof (PTA));
+    t->nodesize = 1024;
+    t->node = (PTANODE *) malloc(t->nodesize * sizeof (PTANODE));
+    t->nslot = 2048;
+    t->slot = (int *) calloc(t->nslot, sizeof (int));
+    t->labelsize = 4096;
+    t->label = (char *) malloc(t->labelsize);
+    t->symsize = 64;
+    t->symoff = (size_t *) malloc(t->symsize * sizeof (size_t));
+    t->symhashv = (unsigned *) malloc(t->symsize * sizeof (unsigned));
+    t->nsymslot = 128;
+    t->symslot = (int *) calloc(t->nsymslot, sizeof (int));
+    if (!t->node || !t->slot || !t->label || !t->symoff || !t->symhashv ||
+            !t->symslot)
+        memerr();
+    t->nnodes = 1;
+    t->node[0].parent = t->node[0].sym = -1;
+    t->node[0].freq = t->node[0].end = 0;
+}
+
+static void ptafree(PTA *t) {
+    free(t->node);
+    free(t->slot);
+    free(t->label);
+    free(t->symoff);
+    free(t->symhashv);
+    free(t->symslot);
+    free(t->symmap);
+}
+
+/*
+ * Add the strings in t->s..t->e to the trie.  The last need not end in
+ * Delim.  Run by each thread on its own part, in the context of the
+ * thread that started them all.
+ */
+static void *ptaadd(void *arg) {
+    PTA *t = (PTA *) arg;
+    const char *s = t->s, *e = t->e, *tok, *end;
+    int n, len;
+
+    Ctx = t->ctx;
+    while (s < e) {
+        n = 0;
+        for (;;) {
+            while (s < e && *s != Delim && *s != ':' && PTABLANK(*s))
+                s++;
+            for (tok = s; s < e && *s != Delim && *s != ':'; s++)
+                ;
+            for (end = s; end > tok && PTABLANK(end[-1]); end--)
+                ;
+            if ((len = end - tok) > 0) {
+                n = ptachild(t, n, ptasym(t, tok, len));
+                t->node[n].freq++;
+            }
+            if (s == e || *s++ == Delim)
+                break;
+        }
+        if (!n)
+            continue;
+        t->node[n].end++;
+        t->node[0].freq++;
+    }
+    t->s = t->e = (const char *) 0;
+    return (void *) 0;
+}
+
+/*
+ * Add s..e to the tries, split among n threads at string ends, then
+ * give their new symbols Symtab numbers.
+ */
+static void ptablock(PTA *pta, int n, const char *s, const char *e) {
+    jmp_buf *onerror;
+    pthread_t *tid;
+    const char *p;
+    long nstr;
+    int k;
+
+    tid = (pthread_t *) malloc(n * sizeof (pthread_t));
+    if (!tid)
         memerr();
-    Pfsa->state = -1;
-    if ((parse_err = yyparse())) {
-        fprintf(stderr, "yyparse() returned %d\n", parse_err);
-        exit(parse_err);
+    for (k = 0; k < n; k++) {
+        p = k == n - 1 ? e : s + (e - s) / (n - k);
+        while (p > s && p < e && p[-1] != Delim)
+            p++;
+        pta[k].ctx = Ctx;
+        pta[k].s = s;
+        pta[k].e = s = p;
+    }
+    /* The others cannot bail() back to a caller, so nor can this one */
+    onerror = Onerror;
+    if (n > 1)
+        Onerror = (jmp_buf *) 0;
+    for (k = 1; k < n; k++)
+        if (pthread_create(&tid[k], (pthread_attr_t *) 0, ptaadd, &pta[k]))
+            Perror((char *) "pthread_create");
+    ptaadd(&pta[0]);
+    for (k = 1; k < n; k++)
+        pthread_join(tid[k], (void **) 0);
+    Onerror = onerror;
+    free(tid);
+
+    for (nstr = 0, k = 0; k < n; k++) {
+        nstr += pta[k].node[0].freq;
+        pta[k].symmap = (int *) realloc(pta[k].symmap,
+                (pta[k].nsym + 1) * sizeof (int));
+        if (!pta[k].symmap)
+            memerr();
+        for (; pta[k].nmapped < pta[k].nsym; pta[k].nmapped++)
+            pta[k].symmap[pta[k].nmapped + 1] =
+                addsym(pta[k].label + pta[k].symoff[pta[k].nmapped + 1]);
+    }
+    if (nstr > INT_MAX) {
+        fprintf(stderr, "Too many strings in the corpus\n");
+        bail(EOVERFLOW);
     }
-    if (yyin != stdin)
-        (void) fclose(yyin);
+}
+
+/*
+ * Merge the tries into pta[0], in Symtab numbers, and lay it out as the
+ * pfsa.  A node always comes after its parent in a trie, so a merge in
+ * order of node number finds the parent already there.
+ */
+static void ptapfsa(PTA *pta, int n) {
+    PTA *t = &pta[0], *u;
+    PTANODE *q;
+    u_int32_t *state, *first, *target, *freq, *order, *at;
+    int *map, *sym, *nsrc, *kids, *newid;
+    size_t narcs;
+    int i, j, k, c, nn;
+
+    for (i = 1; i < t->nnodes; i++)
+        t->node[i].sym = t->symmap[t->node[i].sym];
+    if (n > 1)
+        ptarehash(t);
+    for (k = 1; k < n; k++) {
+        u = &pta[k];
+        map = (int *) malloc(u->nnodes * sizeof (int));
+        if (!map)
+            memerr();
+        map[0] = 0;
+        t->node[0].freq += u->node[0].freq;
+        for (i = 1; i < u->nnodes; i++) {
+            q = &u->node[i];
+            map[i] = c = ptachild(t, map[q->parent], u->symmap[q->sym]);
+            t->node[c].freq += q->freq;
+            t->node[c].end += q->end;
+        }
+        free(map);
+    }
+    free(t->slot);
+    t->slot = (int *) 0;
+    nn = t->nnodes;
+    if (nn == 1)
+        return;
+
+    /* The children of each node, in sym order: sort by sym, then parent */
+    kids = (int *) malloc(nn * sizeof (int));
+    at = (u_int32_t *) calloc((Nsyms > nn ? Nsyms : nn) + 2, sizeof (u_int32_t));
+    order = (u_int32_t *) malloc(nn * sizeof (u_int32_t));
+    if (!kids || !at || !order)
+        memerr();
+    for (i = 1; i < nn; i++)
+        at[t->node[i].sym + 1]++;
+    for (i = 1; i <= Nsyms + 1; i++)
+        at[i] += at[i - 1];
+    for (i = 1; i < nn; i++)
+        order[at[t->node[i].sym]++] = i;
+    memset(at, 0, (nn + 1) * sizeof (u_int32_t));
+    for (i = 1; i < nn; i++)
+        at[t->node[i].parent + 1]++;
+    for (i = 1; i <= nn; i++)
+        at[i] += at[i - 1];
+    for (i = 0; i < nn - 1; i++)
+        kids[at[t->node[order[i]].parent]++] = order[i];
+    for (i = nn; i > 0; i--)	/* at[p] is the first child of p again */
+        at[i] = at[i - 1];
+    at[0] = 0;
+
+    /* Number the states breadth first */
+    newid = (int *) malloc(nn * sizeof (int));
+    if (!newid)
+        memerr();
+    order[0] = 0;
+    for (i = 0, j = 1; i < nn; i++)
+        for (c = at[order[i]]; c < (int) at[order[i] + 1]; c++)
+            order[j++] = kids[c];
+    for (i = 0; i < nn; i++)
+        newid[order[i]] = i;
+
+    narcs = nn - 1;
+    for (i = 1; i < nn; i++)
+        if (t->node[i].end)
+            narcs++;
+    state = (u_int32_t *) malloc(nn * sizeof (u_int32_t));
+    first = (u_int32_t *) malloc((nn + 1) * sizeof (u_int32_t));
+    nsrc = (int *) malloc(nn * sizeof (int));
+    target = (u_int32_t *) malloc(narcs * sizeof (u_int32_t));
+    sym = (int *) malloc(narcs * sizeof (int));
+    freq = (u_int32_t *) malloc(narcs * sizeof (u_int32_t));
+    if (!state || !first || !nsrc || !target || !sym || !freq)
+        memerr();
+    nsrc[0] = 0;
+    for (narcs = 0, i = 0; i < nn; i++) {
+        q = &t->node[order[i]];
+        state[i] = i;
+        first[i] = narcs;
+        if (i)
+            nsrc[i] = 1;
+        if (q->end) {
+            target[narcs] = 0;
+            sym[narcs] = DELIMITER;
+            freq[narcs++] = q->end;
+            nsrc[0]++;
+        }
+        for (c = at[order[i]]; c < (int) at[order[i] + 1]; c++) {
+            target[narcs] = newid[kids[c]];
+            sym[narcs] = t->node[kids[c]].sym;
+            freq[narcs++] = t->node[kids[c]].freq;
+        }
+    }
+    first[nn] = narcs;
+    free(kids);
+    free(at);
+    free(order);
+    free(newid);
+    csrpfsa(Pfsa, nn, state, first, target, sym, freq, nsrc);
+    free(state);
+    free(first);
+    free(nsrc);
+    free(target);
+    free(sym);
+    free(freq);
+}
+
+static PTA *ptastart(int nthreads) {
+    PTA *pta;
+    int k;
+
+    startpfsa();
+    pta = (PTA *) malloc(nthreads * sizeof (PTA));
+    if (!pta)
+        memerr();
+    for (k = 0; k < nthreads; k++)
+        ptainit(&pta[k]);
+    return pta;
+}
+
+static void ptafinish(PTA *pta, int nthreads) {
+    int k;
+
+    ptapfsa(pta, nthreads);
+    for (k = 0; k < nthreads; k++)
+        ptafree(&pta[k]);
+    free(pta);
+    setprobs(Pfsa);
+}
+
+/*
+ * Build the prefix tree acceptor of the strings in corpusfile, "-" for
+ * stdin, on nthreads threads.
+ */
+void buildpta(char corpusfile[], int nthreads) {
+    char temp[BUFSIZ], *map, *buf;
+    struct stat st;
+    const char *s;
+    size_t size, len;
+    ssize_t got;
+    PTA *pta;
+    int fd;
+
+    strcpy(temp, Infile);
+    if (corpusfile != Infile)
+        strcpy(Infile, corpusfile);
+    if (nthreads < 1)
+        nthreads = 1;
+    pta = ptastart(nthreads);
+
+    fd = strcmp(Infile, "-") ? open(Infile, O_RDONLY) : 0;
+    if (fd < 0)
+        Perror(Infile);
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (void *) (map = (char *) mmap((void *) 0, st.st_size, PROT_READ,
+            MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+        (void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+        ptablock(pta, nthreads, map, map + st.st_size);
+        (void) munmap(map, st.st_size);
+    } else {
+        /* Each block ends at a string end; the rest waits for the next */
+        size = (size_t) nthreads * PTACHUNK;
+        len = 0;
+        buf = (char *) malloc(size);
+        if (!buf)
+            memerr();
+        while ((got = read(fd, buf + len, size - len)) > 0) {
+            len += got;
+            if (len < size)
+                continue;
+            for (s = buf + len; s > buf && s[-1] != Delim; s--)
+                ;
+            if (s == buf) {	/* a string longer than buf */
+                size *= 2;
+                buf = (char *) realloc(buf, size);
+                if (!buf)
+                    memerr();
+                continue;
+            }
+            ptablock(pta, nthreads, buf, s);
+            len -= s - buf;
+            memmove(buf, s, len);
+        }
+        if (got < 0)
+            Perror(Infile);
+        ptablock(pta, nthreads, buf, buf + len);
+        free(buf);
+    }
+    if (fd)
+        (void) close(fd);
+    ptafinish(pta, nthreads);
     strcpy(Infile, temp);
 }
 
+/*
+ * The same for a corpus in memory, b[0 .. size-1].
+ */
+void buildptabuf(const char *b, size_t size, int nthreads) {
+    PTA *pta;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    pta = ptastart(nthreads);
+    ptablock(pta, nthreads, b, b + size);
+    ptafinish(pta, nthreads);
+}
+
 /* This function - superceded by macro, 16/5/96
    
 int nstates(pfsa)
@@ -83,49 +1111,348 @@ NODE *pfsa;
  */
 
 void resetmaxstatenum(NODE *pfsa) /* 16/6/96 */ {
+    PFSAHDR *hdr = pfsa->hdr;
+    int n;
+
+    /*
+     * Scan the index downwards from the old maximum.  This is only
+     * called when the highest state has gone, so the gap is short.
+     */
+    n = getmaxstatenum(pfsa);
+    if (n >= hdr->indexsize)
+        n = hdr->indexsize - 1;
+    while (n > 0 && !hdr->index[n])
+        n--;
+    setmaxstatenum(pfsa, n < 0 ? 0 : n);
+}
+
+static void setindex(NODE *pfsa, int state, NODE *p) {
+    PFSAHDR *hdr = pfsa->hdr;
+    int n;
+
+    if (state >= hdr->indexsize) {
+        if (!p)
+            return;
+        for (n = hdr->indexsize ? hdr->indexsize : 64; n <= state; n *= 2)
+            ;
+        hdr->index = (NODE **) realloc(hdr->index, n * sizeof (NODE *));
+        if (!hdr->index)
+            memerr();
+        memset(&hdr->index[hdr->indexsize], 0,
+                (n - hdr->indexsize) * sizeof (NODE *));
+        hdr->indexsize = n;
+    }
+    hdr->index[state] = p;
+}
+
+/*
+ * Rebuild the index from scratch after the states have been renumbered.
+ */
+static void reindex(NODE *pfsa) {
     NODE *p;
 
-    setmaxstatenum(pfsa, 0);
-    p = pfsa;
-    while ((p = p->nextnode))
-        if (p->state > getmaxstatenum(pfsa))
-            setmaxstatenum(pfsa, p->state);
+    if (pfsa->hdr->indexsize)
+        memset(pfsa->hdr->index, 0, pfsa->hdr->indexsize * sizeof (NODE *));
+    for (p = pfsa->nextnode; p; p = p->nextnode)
+        setindex(pfsa, p->state, p);
 }
 
-NODE *createnode() {
-    NODE *instance;
+/*
+ * The pool allocator behind the nodes of a pfsa (see POOL in pfsa.h).
+ * Requests of up to POOLSMALL bytes are rounded up to a multiple of 8
+ * and larger ones to a power of two; each rounded size is a class with
+ * its own free list.  Blocks grow with the pool from POOLMINBLK up to
+ * POOLMAXBLK bytes, and a request too big for that gets a block of its
+ * own.  Cells come back zeroed, as from calloc().
+ */
+#define POOLSMALL 256
+#define POOLMINBLK 65536
+#define POOLMAXBLK (16 << 20)
+
+static int poolclass(size_t n, size_t *size) {
+    int c;
+
+    if (n <= POOLSMALL) {
+        *size = n ? (n + 7) & ~(size_t) 7 : 8;
+        return (int) (*size >> 3);
+    }
+    for (c = POOLSMALL / 8 + 1, *size = 2 * POOLSMALL; *size < n; c++)
+        *size *= 2;
+    if (c >= NPOOLCLASSES)
+        memerr();
+    return c;
+}
+
+/*
+ * Make sure that the next n bytes of requests can be met from a single
+ * block.  copypfsa() uses this to get the whole copy in one allocation.
+ */
+static void poolreserve(POOL *pool, size_t n) {
+    POOLBLK *b;
+
+    if (n <= pool->left)
+        return;
+    if (n < POOLMINBLK)
+        n = POOLMINBLK;
+    b = (POOLBLK *) malloc(sizeof (POOLBLK) + n);
+    if (!b)
+        memerr();
+    b->next = pool->blocks;
+    pool->blocks = b;
+    pool->bump = (char *) (b + 1);
+    pool->left = n;
+    pool->total += n;
+}
+
+void *poolalloc(POOL *pool, size_t n) {
+    POOLBLK *b;
+    size_t size, blksize;
+    void *p;
+    int c;
+
+    c = poolclass(n, &size);
+    if ((p = pool->cells[c])) {
+        pool->cells[c] = *(void **) p;
+        return memset(p, 0, size);
+    }
+    if (size > pool->left) {
+        blksize = pool->total;
+        if (blksize < POOLMINBLK)
+            blksize = POOLMINBLK;
+        if (blksize > POOLMAXBLK)
+            blksize = POOLMAXBLK;
+        if (size > blksize / 4) {
+            /* A block to itself, behind the current one */
+            b = (POOLBLK *) calloc(1, sizeof (POOLBLK) + size);
+            if (!b)
+                memerr();
+            if (pool->blocks) {
+                b->next = pool->blocks->next;
+                pool->blocks->next = b;
+            } else
+                pool->blocks = b;
+            pool->total += size;
+            return (void *) (b + 1);
+        }
+        poolreserve(pool, blksize);
+    }
+    p = (void *) pool->bump;
+    pool->bump += size;
+    pool->left -= size;
+    return memset(p, 0, size);
+}
 
-    instance = (NODE *) calloc(1, sizeof (NODE));
-    if (!instance)
+/*
+ * Give back a cell of n bytes (the size it was asked for with).
+ */
+void poolfree(POOL *pool, void *p, size_t n) {
+    size_t size;
+    int c;
+
+    if (!p)
+        return;
+    c = poolclass(n, &size);
+    *(void **) p = pool->cells[c];
+    pool->cells[c] = p;
+}
+
+static size_t poolsize(size_t n) {
+    size_t size;
+
+    poolclass(n, &size);
+    return size;
+}
+
+/*
+ * Create the dummy header node of an empty pfsa.
+ */
+NODE *createpfsa() {
+    NODE *root;
+
+    root = (NODE *) calloc(1, sizeof (NODE));
+    if (!root)
         memerr();
-    instance->translist = (TRANS *) calloc(1, sizeof (TRANS));
-    instance->srclist = (SOURCE *) calloc(1, sizeof (SOURCE));
-    if (!instance->translist || !instance->srclist)
+    root->hdr = (PFSAHDR *) calloc(1, sizeof (PFSAHDR));
+    if (!root->hdr)
         memerr();
+    root->pool = &root->hdr->pool;
+    root->state = -1;
+    return root;
+}
+
+/*
+ * Create a node in the pool of pfsa (any node of it will do).  It is
+ * not linked in; see newnode() and addnode().
+ */
+NODE *createnode(NODE *pfsa) {
+    NODE *instance;
+    POOL *pool = pfsa->pool;
+
+    instance = (NODE *) poolalloc(pool, sizeof (NODE));
+    instance->pool = pool;
+    instance->translist = (TRANS *) poolalloc(pool, LISTCHUNK * sizeof (TRANS));
+    instance->srclist = (SOURCE *) poolalloc(pool, LISTCHUNK * sizeof (SOURCE));
+    instance->translistsize = instance->srclistsize = LISTCHUNK;
     instance->translist->sym = instance->srclist->sym = -1;
     return instance;
 }
 
-void statelimiterror() {
-    fprintf(stderr, "More than %d nodes in this PFSA!\n", MAXNODES);
-    fprintf(stderr, "Change set size in the DFA conversion program\n");
-    fprintf(stderr, "and the statelist array size in copypfsa()\n");
-    exit(1);
+/*
+ * Re-thread the links of entries from index "from" onwards.
+ */
+static void relinktrans(NODE *p, int from) {
+    int i;
+
+    for (i = from; i < p->ntranslist; i++)
+        p->translist[i].next_tran = &p->translist[i + 1];
+    p->translist[p->ntranslist].next_tran = (TRANS *) 0;
+}
+
+static void relinksrcs(NODE *p, int from) {
+    int i;
+
+    for (i = from; i < p->nsrclist; i++)
+        p->srclist[i].next_src = &p->srclist[i + 1];
+    p->srclist[p->nsrclist].next_src = (SOURCE *) 0;
+}
+
+/*
+ * Open up a zeroed slot at index i (1 <= i <= ntranslist + 1) of
+ * p's translist and return it.  Only the entries that moved need
+ * relinking, unless the whole array did.
+ */
+static TRANS *instrans(NODE *p, int i) {
+    TRANS *old = p->translist;
+
+    if (p->ntranslist + 1 == p->translistsize) {
+        p->translist = (TRANS *) poolalloc(p->pool,
+                2 * p->translistsize * sizeof (TRANS));
+        memcpy(p->translist, old, p->translistsize * sizeof (TRANS));
+        poolfree(p->pool, old, p->translistsize * sizeof (TRANS));
+        p->translistsize *= 2;
+    }
+    memmove(&p->translist[i + 1], &p->translist[i],
+            (p->ntranslist + 1 - i) * sizeof (TRANS));
+    memset(&p->translist[i], 0, sizeof (TRANS));
+    p->ntranslist++;
+    relinktrans(p, p->translist == old ? i - 1 : 0);
+    return &p->translist[i];
+}
+
+static SOURCE *inssrc(NODE *p, int i) {
+    SOURCE *old = p->srclist;
+
+    if (p->nsrclist + 1 == p->srclistsize) {
+        p->srclist = (SOURCE *) poolalloc(p->pool,
+                2 * p->srclistsize * sizeof (SOURCE));
+        memcpy(p->srclist, old, p->srclistsize * sizeof (SOURCE));
+        poolfree(p->pool, old, p->srclistsize * sizeof (SOURCE));
+        p->srclistsize *= 2;
+    }
+    memmove(&p->srclist[i + 1], &p->srclist[i],
+            (p->nsrclist + 1 - i) * sizeof (SOURCE));
+    memset(&p->srclist[i], 0, sizeof (SOURCE));
+    p->nsrclist++;
+    relinksrcs(p, p->srclist == old ? i - 1 : 0);
+    return &p->srclist[i];
+}
+
+/*
+ * Squeeze out the entries of a list whose target (source) has been set
+ * to null, keeping the rest in order.
+ */
+static void packtrans(NODE *p) {
+    int i, j;
+
+    for (i = j = 1; i <= p->ntranslist; i++)
+        if (p->translist[i].target)
+            p->translist[j++] = p->translist[i];
+    p->ntranslist = j - 1;
+    relinktrans(p, 0);
+}
+
+static int srccmp(const void *a, const void *b) {
+    const SOURCE *x = (const SOURCE *) a, *y = (const SOURCE *) b;
+
+    if (x->sym != y->sym)
+        return x->sym - y->sym;
+    return x->source->state - y->source->state;
+}
+
+/*
+ * Put p's srclist back in (sym, source state) order and fold entries
+ * for the same arc together.  Entries with no source (see trim()) are
+ * dropped.  Those of zero freq are kept: their arcs still have to be
+ * retargeted when a merge moves the state they go to.  After a merge
+ * only the few entries that named the merged state are out of place, so
+ * unless there are more than SORTINSERT of them they are moved in by
+ * insertion, and the list is relinked only from the first entry that
+ * moved.  A state with a huge srclist, such as state 0 of a prefix
+ * tree, then costs a merge one pass over it rather than a sort.
+ */
+#define SORTINSERT 8
+
+static void sortsrcs(NODE *p) {
+    SOURCE *sp, x;
+    int i, j, lo, ndesc;
+
+    sp = p->srclist;
+    lo = p->nsrclist + 1;	/* The first entry moved */
+    for (i = j = 1; i <= p->nsrclist; i++)
+        if (sp[i].source) {
+            if (i != j) {
+                sp[j] = sp[i];
+                if (j < lo)
+                    lo = j;
+            }
+            j++;
+        }
+    p->nsrclist = j - 1;
+    for (ndesc = 0, i = 2; i <= p->nsrclist && ndesc <= SORTINSERT; i++)
+        if (srccmp(&sp[i - 1], &sp[i]) > 0)
+            ndesc++;
+    if (ndesc > SORTINSERT) {
+        qsort((void *) &sp[1], p->nsrclist, sizeof (SOURCE), srccmp);
+        lo = 1;
+    } else if (ndesc)
+        for (i = 2; i <= p->nsrclist; i++) {
+            if (srccmp(&sp[i - 1], &sp[i]) <= 0)
+                continue;
+            x = sp[i];
+            for (j = i; j > 1 && srccmp(&sp[j - 1], &x) > 0; j--)
+                sp[j] = sp[j - 1];
+            sp[j] = x;
+            if (j < lo)
+                lo = j;
+        }
+    for (i = 1, j = 0; i <= p->nsrclist; i++) {
+        if (j && sp[i].sym == sp[j].sym && sp[i].source == sp[j].source)
+            sp[j].freq += sp[i].freq;
+        else if (++j != i) {
+            sp[j] = sp[i];
+            if (j < lo)
+                lo = j;
+        }
+    }
+    p->nsrclist = j;
+    relinksrcs(p, lo < p->nsrclist ? lo : p->nsrclist);
 }
 
 NODE *newnode(NODE *pfsa) /* Create a new node at the end of list pfsa */ {
     NODE *p;
 
-    p = pfsa;
-    while (p->nextnode)
-        p = p->nextnode;
+    p = findnode(pfsa, getmaxstatenum(pfsa));
+    if (!p || p->nextnode)
+        for (p = pfsa; p->nextnode; p = p->nextnode)
+            ;
 
-    p->nextnode = createnode();
+    p->nextnode = createnode(pfsa);
     p->nextnode->state = p->state + 1;
+    p->nextnode->prevnode = p;
 
-    if (p->nextnode->state == MAXNODES)
-        statelimiterror();
     incr_nodecnt(pfsa);
+    setmaxstatenum(pfsa, p->nextnode->state);
+    setindex(pfsa, p->nextnode->state, p->nextnode);
     return p->nextnode;
 }
 
@@ -133,96 +1460,160 @@ NODE *newnode(NODE *pfsa) /* Create a new node at the end of list pfsa */ {
  * add the node for the state numbered "state". If it already exists
  * then return a pointer to it. Nodes are kept sorted in order of state 
  * number. Remember, the first node is a dummy header guaranteed to exist.
+ * The index gives both the node, if it exists, and its predecessor in
+ * the list, which is the nearest lower numbered state.
  */
 NODE *addnode(NODE *pfsa,
         int state) {
     NODE *p, *newInstance;
+    int n;
 
-    p = pfsa;
-    while (p) {
-        if (!p->nextnode || p->nextnode->state > state) {
-            if (!p->nextnode)
-                setmaxstatenum(pfsa, state);
-            if (incr_nodecnt(pfsa) >= MAXNODES)
-                statelimiterror();
-            newInstance = createnode();
-            newInstance->state = state;
-            newInstance->nextnode = p->nextnode;
-            p->nextnode = newInstance;
-            return newInstance;
-        } else if (p->nextnode->state == state)
-            return p->nextnode;
-        else
-            p = p->nextnode;
-    }
-    return (NODE *) 0; /* Not reached */
+    if ((p = findnode(pfsa, state)))
+        return p;
+    incr_nodecnt(pfsa);
+    if (!pfsa->nextnode || state > getmaxstatenum(pfsa))
+        setmaxstatenum(pfsa, state);
+    n = state < pfsa->hdr->indexsize ? state : pfsa->hdr->indexsize;
+    while (--n >= 0 && !pfsa->hdr->index[n])
+        ;
+    p = n < 0 ? pfsa : pfsa->hdr->index[n];
+    newInstance = createnode(pfsa);
+    newInstance->state = state;
+    newInstance->nextnode = p->nextnode;
+    newInstance->prevnode = p;
+    if (p->nextnode)
+        p->nextnode->prevnode = newInstance;
+    p->nextnode = newInstance;
+    setindex(pfsa, state, newInstance);
+    return newInstance;
 }
 
 /* I realise now that I should have ordered both translist and srclist
  * using the state number as a secondary key in addition to using sym
  * as the primary key.  Hopefully, I should re-implement this soon
  * when I get some time. 15/01/97
+ * Srclist is now ordered that way, see the top of this file.
  */
 void addtrans(NODE *src, NODE *dst,
         int sym,
         int freq) {
-    TRANS *tp, *newtp;
-    SOURCE *sp, *newsp;
-    int newsym = 1;
+    TRANS *tl, *newtp;
+    int lo, hi, mid, i, n, newsym;
 
-    tp = src->translist;
-    while (tp) {
-        if (!tp->next_tran || tp->next_tran->sym > sym) {
-            if (tp->sym == sym)
-                newsym = 0;
-            newtp = (TRANS *) calloc(1, sizeof (*tp->next_tran));
-            if (!newtp)
-                memerr();
-            newtp->sym = sym;
-            newtp->freq = freq;
-            newtp->target = dst;
-            newtp->next_tran = tp->next_tran;
-            tp->next_tran = newtp;
-            if (Symtab[sym].label[0] != Delim)
-                incr_trancnt(Pfsa);
-            break;
-        } else if (tp->next_tran->sym == sym && tp->next_tran->target == dst) {
-            newsym = 0;
-            tp->next_tran->freq += freq;
-            break;
-        } else
-            tp = tp->next_tran;
-    }
-    /* Add a back pointer to the source node from the dest node on sym
+    /* Binary search for the run of transitions on sym, then look along
+     * it for dst.  A new transition goes at the end of the run.
      */
-    sp = dst->srclist;
-    while (sp) {
-        if (!sp->next_src || sp->next_src->sym > sym) {
-            newsp = (SOURCE *) calloc(1, sizeof (*sp->next_src));
-            if (!newsp)
-                memerr();
-            newsp->sym = sym;
-            newsp->freq = freq;
-            newsp->source = src;
-            newsp->next_src = sp->next_src;
-            sp->next_src = newsp;
-            break;
-        } else if (sp->next_src->sym == sym && sp->next_src->source == src) {
-            sp->next_src->freq += freq;
+    tl = src->translist;
+    n = src->ntranslist;
+    for (lo = 1, hi = n + 1; lo < hi;) {
+        mid = (lo + hi) / 2;
+        if (tl[mid].sym < sym)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    newsym = lo > n || tl[lo].sym != sym;
+    for (i = lo; i <= n && tl[i].sym == sym; i++)
+        if (tl[i].target == dst) {
+            tl[i].freq += freq;
             break;
-        } else
-            sp = sp->next_src;
+        }
+    if (i > n || tl[i].sym != sym) {
+        newtp = instrans(src, i);
+        newtp->sym = sym;
+        newtp->freq = freq;
+        newtp->target = dst;
+        if (Symtab[sym].label[0] != Delim)
+            nodehdr(src)->trancnt++;
     }
 
+    addsrc(dst, src, sym, freq);
     if (newsym)
         src->nsymbols++;
     src->ntrans += freq;
+    src->pshift = 0;		/* until setprobs() */
     dst->nvisits += freq;
     Symtab[sym].freq += freq;
 }
 
+/*
+ * Add a back pointer to the source node from the dest node on sym.
+ */
+static void addsrc(NODE *dst, NODE *src, int sym, int freq) {
+    SOURCE *sl, *newsp;
+    int lo, hi, mid, n;
+
+    sl = dst->srclist;
+    n = dst->nsrclist;
+    for (lo = 1, hi = n + 1; lo < hi;) {
+        mid = (lo + hi) / 2;
+        if (sl[mid].sym < sym ||
+                (sl[mid].sym == sym && sl[mid].source->state < src->state))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo <= n && sl[lo].sym == sym && sl[lo].source == src)
+        sl[lo].freq += freq;
+    else {
+        newsp = inssrc(dst, lo);
+        newsp->sym = sym;
+        newsp->freq = freq;
+        newsp->source = src;
+    }
+}
+
+/*
+ * Work out the pmul of each arc of p for tranprob(), see pfsa.h.
+ * With n the bit length of ntrans, pmul is freq * 2^(TPROBBITS+n) /
+ * ntrans rounded up, which is within 1 of the exact value, so for any
+ * prob below 2^TPROBBITS it is out by less than prob / 2^(TPROBBITS+n)
+ * < 1/ntrans, not enough to carry the floor over the next integer.
+ * It is done in two steps, since freq << (TPROBBITS+n) need not fit
+ * in 64 bits.  prob * pmul is below 2^(2*TPROBBITS+n), so states with
+ * 2^29 or more transitions are left dividing.
+ */
+static void nodeprobs(NODE *p) {
+    TRANS *tp;
+    u_long d, q, r;
+    int n;
+
+    p->pshift = 0;
+    d = p->ntrans;
+    for (n = 0; n < 64 && d >> n; n++)
+        ;
+    if (!d || 2 * TPROBBITS + n > 8 * (int) sizeof (u_long) - 1)
+        return;
+    for (tp = p->translist->next_tran; tp; tp = tp->next_tran) {
+        if ((u_long) tp->freq > d)
+            return;
+        q = ((u_long) tp->freq << TPROBBITS) / d;
+        r = ((u_long) tp->freq << TPROBBITS) % d;
+        tp->pmul = (q << n) + ((r << n) + d - 1) / d;
+    }
+    p->pshift = TPROBBITS + n;
+}
+
+/*
+ * Bring the pmuls of the whole pfsa up to date.  buildpfsa() does
+ * this once it is built, and merge() keeps them so for the states it
+ * changes; addtrans() only marks its state stale, since it is called
+ * once per arc while building.
+ */
+void setprobs(NODE *pfsa) {
+    NODE *p;
+
+    for (p = pfsa->nextnode; p; p = p->nextnode)
+        nodeprobs(p);
+}
+
 NODE *findnode(NODE *p,
         int state) /* find a node "state" in a nodelist p */ {
+    if (p && p->hdr) { /* the whole pfsa: use its index */
+        if (state < 0 || state >= p->hdr->indexsize)
+            return (NODE *) 0;
+        return p->hdr->index[state];
+    }
     while (p && p->state != state)
         p = p->nextnode;
     return p;
@@ -235,6 +1626,84 @@ TRANS *findtrans(TRANS *tp,
     return tp;
 }
 
+/*
+ * The symbol table behind addsym() and findsym().  Symtab grows by
+ * doubling.  Symhash is an open addressed table of symbol numbers, kept
+ * at most half full, keyed on the label; 0 marks an empty slot since
+ * symbol zero is the sentinel.  Labels are copied into an arena of
+ * SYMARENA sized blocks which are never moved, so Symtab[].label
+ * pointers stay valid for the life of the context.  The blocks, and
+ * labels too long for them, are chained through Symblocks for
+ * freecontext().
+ */
+#define SYMARENA 65536
+
+#define Symhash (Ctx->symhash)
+#define Symhashsize (Ctx->symhashsize)
+#define Symtabsize (Ctx->symtabsize)
+#define Symarena (Ctx->symarena)
+#define Symarenaleft (Ctx->symarenaleft)
+#define Symblocks (Ctx->symblocks)
+
+static unsigned symhash(const char *label) {
+    unsigned h = 2166136261u;	/* FNV-1a */
+
+    while (*label)
+        h = (h ^ (unsigned char) *label++) * 16777619u;
+    return h;
+}
+
+/*
+ * Return the Symhash slot holding label, or the empty slot where it
+ * would go.
+ */
+static unsigned symslot(const char *label) {
+    unsigned i = symhash(label) & (Symhashsize - 1);
+
+    while (Symhash[i] && strcmp(Symtab[Symhash[i]].label, label))
+        i = (i + 1) & (Symhashsize - 1);
+    return i;
+}
+
+static void growsymhash(void) {
+    int s;
+
+    free(Symhash);
+    Symhashsize = Symhashsize ? 2 * Symhashsize : 1024;
+    if (!(Symhash = (int *) calloc(Symhashsize, sizeof(int))))
+        memerr();
+    for (s = 1; s < Nsyms; s++)
+        Symhash[symslot(Symtab[s].label)] = s;
+}
+
+static char *symblock(size_t len) {
+    char *b;
+
+    if (!(b = (char *) malloc(sizeof (char *) + len)))
+        memerr();
+    *(char **) b = Symblocks;
+    Symblocks = b;
+    return b + sizeof (char *);
+}
+
+static char *symstrdup(const char *label) {
+    size_t len = strlen(label) + 1;
+    char *p;
+
+    if (len > SYMARENA / 4)
+        p = symblock(len);
+    else {
+        if (len > Symarenaleft) {
+            Symarena = symblock(SYMARENA);
+            Symarenaleft = SYMARENA;
+        }
+        p = Symarena;
+        Symarena += len;
+        Symarenaleft -= len;
+    }
+    return (char *) memcpy(p, label, len);
+}
+
 /*
  * If the label is already known return its index in the symbol table.
  * Otherwise, create a new label by that name and return its index.
@@ -242,18 +1711,29 @@ TRANS *findtrans(TRANS *tp,
  * Note: Symbol zero is reserved as sentinel.
  */
 int addsym(char label[]) {
-    int i;
-
-    for (i = 1; i < MAXSYMS; i++) {
-        if (!Symtab[i].label[0]) {
-            strncpy(Symtab[i].label, label, MAXSYMSIZE - 1);
-            return i;
-        }
-        if (!strncmp(Symtab[i].label, label, MAXSYMSIZE))
-            return i;
+    unsigned i;
+
+    if (2 * (unsigned) Nsyms >= Symhashsize)
+        growsymhash();
+    i = symslot(label);
+    if (Symhash[i])
+        return Symhash[i];
+
+    if (Nsyms + 1 >= Symtabsize) {
+        Symtabsize = Symtabsize ? 2 * Symtabsize : 256;
+        Symtab = (SYMBOL *) realloc(Symtab, Symtabsize * sizeof(SYMBOL));
+        if (!Symtab)
+            memerr();
+    }
+    if (!Nsyms) {		/* the sentinel */
+        Symtab[0].label = (char *) "";
+        Symtab[0].freq = 0;
+        Nsyms = 1;
     }
-    fprintf(stderr, "Too many symbols: Consider increasing Sym table size\n");
-    exit(1);
+    Symtab[Nsyms].label = symstrdup(label);
+    Symtab[Nsyms].freq = 0;
+    Symhash[i] = Nsyms;
+    return Nsyms++;
 }
 
 void printsyms(int *syms) {
@@ -274,21 +1754,96 @@ void printsyms(int *syms) {
  * Note: Symbol zero is reserved as sentinel.
  */
 int findsym(char label[]) {
-    int i;
+    int sym;
 
-    for (i = 1; i < MAXSYMS && Symtab[i].label[0]; i++)
-        if (!strncmp(Symtab[i].label, label, MAXSYMSIZE))
-            return i;
+    if ((sym = lookupsym(label)))
+        return sym;
     fprintf(stderr, "Couldn't find symbol %s in table\n",
             label[0] == '\n' ? "\\n" : label);
-    exit(1);
+    bail(0);
+    return 0;
+}
+
+/*
+ * The same, but 0 if the label is not in the table, for callers that
+ * can carry on without it.
+ */
+int lookupsym(char label[]) {
+    unsigned i;
+
+    if (Symhashsize) {
+        i = symslot(label);
+        if (Symhash[i])
+            return Symhash[i];
+    }
+    return 0;
 }
 
 /*
  * How far into node p in the pfsa can you insert the string of symbols s?
+ *
+ * Where a state has several transitions on the same symbol, every one
+ * of them is followed, so the plain recursion is exponential in the
+ * length of s on a nondeterministic pfsa.  The answer depends only on
+ * the node and on how far along s it is, so memomatchlen() keeps the
+ * answers it has worked out in a MEMO and looks there first.
+ * acceptable() and lfindtrans() share one MEMO over all the calls they
+ * make for the same s, which makes a whole acceptable() call linear
+ * in the number of (node, position) pairs reachable.
  */
 int matchlen(NODE *p, int *s) {
+    MEMO m;
+    int len;
+
+    m.n = m.size = 0;
+    len = memomatchlen(&m, p, s);
+    memofree(&m);
+    return len;
+}
+
+static MEMOENT *memoslot(MEMO *m, NODE *p, int *s) {
+    unsigned h;
+    MEMOENT *e;
+
+    h = (unsigned) (((size_t) p >> 4) * 31 + ((size_t) s >> 2)) * 2654435761u;
+    for (h &= m->size - 1;; h = (h + 1) & (m->size - 1)) {
+        e = &m->ent[h];
+        if (!e->node || (e->node == p && e->s == s))
+            return e;
+    }
+}
+
+static void memogrow(MEMO *m) {
+    MEMOENT *old = m->ent, *e;
+    int i, oldsize = m->size;
+
+    if (!oldsize) {
+        m->size = MEMOLOCAL;
+        m->ent = m->local;
+    } else {
+        m->size *= 2;
+        m->ent = (MEMOENT *) malloc(m->size * sizeof (MEMOENT));
+        if (!m->ent)
+            memerr();
+    }
+    memset(m->ent, 0, m->size * sizeof (MEMOENT));
+    for (i = 0; i < oldsize; i++)
+        if (old[i].node) {
+            e = memoslot(m, old[i].node, old[i].s);
+            *e = old[i];
+        }
+    if (old != m->local && oldsize)
+        free(old);
+}
+
+static void memofree(MEMO *m) {
+    if (m->size && m->ent != m->local)
+        free(m->ent);
+}
+
+static int memomatchlen(MEMO *m, NODE *p, int *s) {
     TRANS *t;
+    MEMOENT *e;
     int len, bestlen;
 
     /*
@@ -300,13 +1855,28 @@ int matchlen(NODE *p, int *s) {
         return 0;
     if (Symtab[*s].label[0] == Delim)
         return 1;
-    bestlen = 1 + matchlen(t->target, s + 1);
+    if (!t->next_tran || t->next_tran->sym != *s)	/* no choice here */
+        return 1 + memomatchlen(m, t->target, s + 1);
+
+    if (2 * m->n >= m->size)
+        memogrow(m);
+    e = memoslot(m, p, s);
+    if (e->node)
+        return e->len;
+    bestlen = 1 + memomatchlen(m, t->target, s + 1);
     while (t->next_tran && t->next_tran->sym == *s) {
         t = t->next_tran;
-        len = 1 + matchlen(t->target, s + 1);
+        len = 1 + memomatchlen(m, t->target, s + 1);
         if (bestlen < len)
             bestlen = len;
     }
+    if (2 * m->n >= m->size)	/* the recursion may have filled it */
+        memogrow(m);
+    e = memoslot(m, p, s);
+    e->node = p;
+    e->s = s;
+    e->len = bestlen;
+    m->n++;
     return bestlen;
 }
 
@@ -316,6 +1886,15 @@ int matchlen(NODE *p, int *s) {
  * one which promises the most consumption of symbols in s is chosen
  */
 TRANS *lfindtrans(TRANS *t, int *s) {
+    MEMO m;
+
+    m.n = m.size = 0;
+    t = memolfindtrans(&m, t, s);
+    memofree(&m);
+    return t;
+}
+
+static TRANS *memolfindtrans(MEMO *m, TRANS *t, int *s) {
     TRANS *best;
 
     while (t && t->sym != *s) /* find first transition on sym *s */
@@ -333,7 +1912,7 @@ TRANS *lfindtrans(TRANS *t, int *s) {
     best = t;
     while (t->next_tran && t->next_tran->sym == *s) {
         t = t->next_tran;
-        if (matchlen(best->target, s + 1) < matchlen(t->target, s + 1))
+        if (memomatchlen(m, best->target, s + 1) < memomatchlen(m, t->target, s + 1))
             best = t;
     }
     return best;
@@ -341,16 +1920,107 @@ TRANS *lfindtrans(TRANS *t, int *s) {
 
 int acceptable(NODE *q, int *s) {
     TRANS *tp;
+    MEMO m;
 
+    m.n = m.size = 0;
     while (*s) {
-        tp = lfindtrans(q->translist, s);
+        tp = memolfindtrans(&m, q->translist, s);
         if (!tp)
-            return 0;
+            break;
         else
             q = tp->target;
         ++s;
     }
-    return 1;
+    memofree(&m);
+    return !*s;
+}
+
+/*
+ * The first of the arcs out of p on sym, which follow it in the
+ * translist, or 0 if there are none.
+ */
+TRANS *firsttrans(NODE *p, int sym) {
+    TRANS *tl = p->translist;
+    int lo, hi, mid;
+
+    for (lo = 1, hi = p->ntranslist + 1; lo < hi;) {
+        mid = (lo + hi) / 2;
+        if (tl[mid].sym < sym)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo <= p->ntranslist && tl[lo].sym == sym ? &tl[lo] : (TRANS *) 0;
+}
+
+/*
+ * The probability that the pfsa generates the string of symbols s from
+ * state 0: the sum, over every path that reads s and then the delimiter,
+ * of the product of the probabilities of its arcs.  s ends in 0 or in
+ * the delimiter.  Unlike acceptable(), which takes one path, this
+ * follows all the paths at once, a symbol at a time, so it is linear in
+ * the length of s.  The sums are scaled at each step so that long
+ * strings do not underflow, and what is returned is the log to base 2
+ * of the probability, or -HUGE_VAL if the pfsa does not accept s.  An
+ * arc of zero freq can be followed but adds nothing, so the states of
+ * the next step are marked in queued rather than told by their weight,
+ * and a step with no weight at all means s is not accepted.
+ */
+double stringlogprob(NODE *pfsa, int *s) {
+    NODE *p, **nodes, **cur, **next, **tmp;
+    double *weights, *w, *nw, *dtmp, x, sum, logp = 0;
+    int size, n, nn, i, sym;
+    char *queued;
+    TRANS *tp;
+
+    if (!(p = findnode(pfsa, 0)))
+        return -HUGE_VAL;
+    size = getmaxstatenum(pfsa) + 1;
+    weights = (double *) calloc(2 * size, sizeof (double));
+    nodes = (NODE **) malloc(2 * size * sizeof (NODE *));
+    queued = (char *) calloc(size, 1);
+    if (!weights || !nodes || !queued)
+        memerr();
+    w = weights;
+    nw = w + size;
+    cur = nodes;
+    next = cur + size;
+    cur[0] = p;
+    w[0] = 1;
+    for (n = 1;; s++, n = nn) {
+        sym = *s && Symtab[*s].label[0] != Delim ? *s : DELIMITER;
+        for (sum = 0, nn = 0, i = 0; i < n; i++) {
+            p = cur[i];
+            x = w[p->state];
+            w[p->state] = 0;
+            if (!p->ntrans)
+                continue;
+            x /= p->ntrans;
+            for (tp = firsttrans(p, sym); tp && tp->sym == sym; tp = tp->next_tran) {
+                if (!queued[tp->target->state]) {
+                    queued[tp->target->state] = 1;
+                    next[nn++] = tp->target;
+                }
+                nw[tp->target->state] += x * tp->freq;
+                sum += x * tp->freq;
+            }
+        }
+        if (sum <= 0)
+            nn = 0;
+        for (i = 0; i < nn; i++) {
+            nw[next[i]->state] /= sum;
+            queued[next[i]->state] = 0;
+        }
+        if (!nn || sym == DELIMITER)
+            break;
+        logp += log2(sum);
+        tmp = cur, cur = next, next = tmp;
+        dtmp = w, w = nw, nw = dtmp;
+    }
+    free(weights);
+    free(nodes);
+    free(queued);
+    return nn ? logp + log2(sum) : -HUGE_VAL;
 }
 
 /*
@@ -369,6 +2039,7 @@ NODE *renumber(NODE *pfsa) {
     for (p = pfsa; p; p = p->nextnode)
         p->state = prev++;
     setmaxstatenum(pfsa, prev - 1);
+    reindex(pfsa);
     return pfsa;
 }
 
@@ -423,22 +2094,48 @@ static void deleteq(NODEQ *nq) {
     free((void *) nq);
 }
 
-NODE *isort(NODE *p) /* insertion sort to improve output */ {
-    NODE *q, *r, *s;
+/*
+ * isort() used to be a recursive insertion sort, which is quadratic and
+ * runs out of stack on large pfsa.  It now sorts an array of the nodes
+ * and relinks them, using the original position as a secondary key so
+ * that the order of nodes with equal state numbers is kept as before.
+ */
+typedef struct {
+    NODE *nodep;
+    int pos;
+} SORTCELL;
+
+static int sortcell_cmp(const void *a, const void *b) {
+    const SORTCELL *x = (const SORTCELL *) a, *y = (const SORTCELL *) b;
+
+    if (x->nodep->state != y->nodep->state)
+        return x->nodep->state < y->nodep->state ? -1 : 1;
+    return x->pos - y->pos;
+}
+
+NODE *isort(NODE *p) /* sort to improve output */ {
+    SORTCELL *cells;
+    NODE *q;
+    int i, n;
 
-    if (!p->nextnode)
+    for (n = 0, q = p; q; q = q->nextnode)
+        n++;
+    if (n < 2)
         return p;
-    p->nextnode = isort(p->nextnode);
-    if (p->nextnode->state >= p->state)
-        return p;
-    r = p;
-    q = p->nextnode;
-    while (r->nextnode && r->nextnode->state < p->state)
-        r = r->nextnode;
-    s = r->nextnode;
-    r->nextnode = p;
-    p->nextnode = s;
-    return q;
+    cells = (SORTCELL *) malloc(n * sizeof (SORTCELL));
+    if (!cells)
+        memerr();
+    for (i = 0, q = p; q; q = q->nextnode, i++) {
+        cells[i].nodep = q;
+        cells[i].pos = i;
+    }
+    qsort((void *) cells, n, sizeof (SORTCELL), sortcell_cmp);
+    for (i = 0; i < n - 1; i++)
+        cells[i].nodep->nextnode = cells[i + 1].nodep;
+    cells[n - 1].nodep->nextnode = (NODE *) 0;
+    p = cells[0].nodep;
+    free((void *) cells);
+    return p;
 }
 
 void printq(NODEQ *nodeq) {
@@ -475,36 +2172,31 @@ NODE *bf_renumber(NODE *pfsa) {
     }
     deleteq(nodeq);
     pfsa->nextnode = isort(pfsa->nextnode);
+    for (p = pfsa; p->nextnode; p = p->nextnode) {
+        p->nextnode->prevnode = p;
+        sortsrcs(p->nextnode);
+    }
+    reindex(pfsa);
+    resetmaxstatenum(pfsa);
     return pfsa;
 }
 
+/*
+ * All the storage of the nodes is in the pool, so dropping its blocks
+ * gets rid of the lot without visiting the nodes.
+ */
 void delpfsa(NODE *pfsa) {
-    NODE *p;
-    TRANS *tp;
-    SOURCE *sp;
-    STATE *stp;
+    POOLBLK *b;
 
-    while (pfsa) {
-        while (pfsa->translist) {
-            tp = pfsa->translist;
-            pfsa->translist = tp->next_tran;
-            free((void *) tp);
-        }
-        while (pfsa->srclist) {
-            sp = pfsa->srclist;
-            pfsa->srclist = sp->next_src;
-            free((void *) sp);
-        }
-        /* PONDY remove the state list */
-        while (pfsa->state_list) {
-            stp = pfsa->state_list;
-            pfsa->state_list = stp->next;
-            free((void *) stp);
-        }
-        p = pfsa;
-        pfsa = pfsa->nextnode;
-        free((void *) p);
+    if (!pfsa)
+        return;
+    while ((b = pfsa->hdr->pool.blocks)) {
+        pfsa->hdr->pool.blocks = b->next;
+        free((void *) b);
     }
+    free((void *) pfsa->hdr->index);
+    free((void *) pfsa->hdr);
+    free((void *) pfsa);
 }
 
 void ps(NODE *p) {
@@ -543,18 +2235,40 @@ void ps(NODE *p) {
  * I have now changed this into a two-pass function.
  */
 NODE *copypfsa(NODE *oldpfsa) {
-    NODE *newpfsa, *newp, *oldp, *statelist[MAXNODES];
+    NODE *newpfsa, *newp, *oldp, **statelist;
     TRANS *newtp, *oldtp;
     SOURCE *newsp, *oldsp;
     STATE *rest, *tail; /*PONDY for copying the statelist */
+    POOL *pool;
+    size_t need;
+    int i;
 
     /*
      * First create all the state nodes.  Then fill in the transitions
+     * Work out the storage needed beforehand so that it all comes from
+     * one block of the new pool.
      */
-    newpfsa = (NODE *) calloc(1, sizeof (NODE));
-    if (!newpfsa)
-        memerr();
-    memcpy(newpfsa, oldpfsa, sizeof (NODE));
+    newpfsa = createpfsa();
+    pool = newpfsa->pool;
+    need = 0;
+    for (oldp = oldpfsa->nextnode; oldp; oldp = oldp->nextnode) {
+        need += poolsize(sizeof (NODE));
+        need += poolsize((oldp->ntranslist + 1) * sizeof (TRANS));
+        need += poolsize((oldp->nsrclist + 1) * sizeof (SOURCE));
+        for (rest = oldp->state_list; rest; rest = rest->next)
+            need += poolsize(sizeof (STATE));
+    }
+    poolreserve(pool, need);
+    if (oldpfsa->hdr->indexsize) {
+        newpfsa->hdr->index = (NODE **) calloc(oldpfsa->hdr->indexsize,
+                sizeof (NODE *));
+        if (!newpfsa->hdr->index)
+            memerr();
+        newpfsa->hdr->indexsize = oldpfsa->hdr->indexsize;
+    }
+    nstates(newpfsa) = nstates(oldpfsa);
+    trancnt(newpfsa) = trancnt(oldpfsa);
+    setmaxstatenum(newpfsa, getmaxstatenum(oldpfsa));
 
     oldp = oldpfsa;
     newp = newpfsa;
@@ -562,21 +2276,21 @@ NODE *copypfsa(NODE *oldpfsa) {
     /* PASS 1: Create the list of nodes and remember their addresses
      */
     while (oldp->nextnode) {
-        newp->nextnode = (NODE *) calloc(1, sizeof (NODE));
-        if (!newp->nextnode)
-            memerr();
+        newp->nextnode = (NODE *) poolalloc(pool, sizeof (NODE));
         memcpy(newp->nextnode, oldp->nextnode, sizeof (NODE));
-        statelist[newp->nextnode->state] = newp->nextnode;
+        newp->nextnode->prevnode = newp;
+        newp->nextnode->pool = pool;
+        setindex(newpfsa, newp->nextnode->state, newp->nextnode);
         /*
          * PONDY Create newp->state_list list of state, if there is one there.
          */
         rest = oldp->nextnode->state_list;
         if (rest) {
-            newp->nextnode->state_list = consStateNode(rest->state, NULL);
+            newp->nextnode->state_list = consStateNode(newpfsa, rest->state, NULL);
             tail = newp->nextnode->state_list;
             rest = rest->next;
             while (rest) {
-                tail->next = consStateNode(rest->state, NULL);
+                tail->next = consStateNode(newpfsa, rest->state, NULL);
                 tail = tail->next;
                 rest = rest->next;
             }
@@ -586,50 +2300,29 @@ NODE *copypfsa(NODE *oldpfsa) {
     }
 
 
-    /* PASS 2: Now go through and create the transition and source lists
-     *         using node addresses from the NEW pfsa node list.
+    /* PASS 2: Now go through and copy the transition and source arrays,
+     *         pointing them at node addresses from the NEW pfsa node list.
+     *         The new node still holds the old node's list pointers from
+     *         the memcpy in pass 1.  The arrays are copied at their exact size.
      */
-    oldp = oldpfsa;
-    newp = newpfsa;
-    while (oldp->nextnode) {
-        /*
-         * Create newp->nextnode->translist
-         */
-        newp->nextnode->translist = (TRANS *) calloc(1, sizeof (TRANS));
-        if (!newp->nextnode->translist)
-            memerr();
-        oldtp = oldp->nextnode->translist;
-        newtp = newp->nextnode->translist;
-        while (oldtp->next_tran) {
-            newtp->next_tran = (TRANS *) calloc(1, sizeof (TRANS));
-            if (!newtp->next_tran)
-                memerr();
-            memcpy(newtp->next_tran, oldtp->next_tran, sizeof (TRANS));
-            newtp->next_tran->target = statelist[oldtp->next_tran->target->state];
-            oldtp = oldtp->next_tran;
-            newtp = newtp->next_tran;
-        }
-
-        /*
-         * Create newp->nextnode->srclist
-         */
-        newp->nextnode->srclist = (SOURCE *) calloc(1, sizeof (SOURCE));
-        if (!newp->nextnode->srclist)
-            memerr();
-        oldsp = oldp->nextnode->srclist;
-        newsp = newp->nextnode->srclist;
-        while (oldsp->next_src) {
-            newsp->next_src = (SOURCE *) calloc(1, sizeof (SOURCE));
-            if (!newsp->next_src)
-                memerr();
-            memcpy(newsp->next_src, oldsp->next_src, sizeof (SOURCE));
-            newsp->next_src->source = statelist[oldsp->next_src->source->state];
-            oldsp = oldsp->next_src;
-            newsp = newsp->next_src;
-        }
-
-        oldp = oldp->nextnode;
-        newp = newp->nextnode;
+    statelist = newpfsa->hdr->index;
+    for (newp = newpfsa->nextnode; newp; newp = newp->nextnode) {
+        oldtp = newp->translist;
+        oldsp = newp->srclist;
+        newtp = (TRANS *) poolalloc(pool, (newp->ntranslist + 1) * sizeof (TRANS));
+        newsp = (SOURCE *) poolalloc(pool, (newp->nsrclist + 1) * sizeof (SOURCE));
+        memcpy(newtp, oldtp, (newp->ntranslist + 1) * sizeof (TRANS));
+        memcpy(newsp, oldsp, (newp->nsrclist + 1) * sizeof (SOURCE));
+        newp->translist = newtp;
+        newp->srclist = newsp;
+        newp->translistsize = newp->ntranslist + 1;
+        newp->srclistsize = newp->nsrclist + 1;
+        for (i = 1; i <= newp->ntranslist; i++)
+            newtp[i].target = statelist[newtp[i].target->state];
+        for (i = 1; i <= newp->nsrclist; i++)
+            newsp[i].source = statelist[newsp[i].source->state];
+        relinktrans(newp, 0);
+        relinksrcs(newp, 0);
     }
     return newpfsa;
 }
@@ -871,20 +2564,50 @@ int isequiv_unrealised(NODE *proot, NODE *p1, NODE *p2, NODE *qroot, NODE *q1, N
 }
 
 /* PONDY Constructs a node in a linked list of states */
-STATE *consStateNode(int state, STATE *next) {
+STATE *consStateNode(NODE *pfsa, int state, STATE *next) {
     STATE *ans;
-    ans = (STATE *) calloc(1, sizeof (STATE));
-    if (!ans)
-        memerr();
+    ans = (STATE *) poolalloc(pfsa->pool, sizeof (STATE));
     ans->state = state;
     ans->next = next;
     return ans;
 }
 
+/*
+ * Fold duplicate entries of p's translist into the first of their run.
+ * Entries with the same sym are adjacent, so each duplicate is nulled
+ * and the array packed in one go afterwards.  (Srclists are done by
+ * sortsrcs().)  Returns the number folded, since the freqs, and so the
+ * pmuls, of p only change if there were any.
+ */
+static int collapsetrans(NODE *pfsa, NODE *p) {
+    TRANS *tp, *tp1;
+    int i, j, n = 0;
+
+    for (i = 1; i <= p->ntranslist; i++) {
+        tp = &p->translist[i];
+        if (!tp->target)
+            continue;
+        for (j = i + 1; j <= p->ntranslist && p->translist[j].sym == tp->sym; j++) {
+            tp1 = &p->translist[j];
+            if (tp1->target == tp->target) {
+                tp->freq += tp1->freq;
+                if (Symtab[tp1->sym].label[0] != Delim)
+                    decr_trancnt(pfsa);
+                tp1->target = (NODE *) 0;
+                n++;
+            }
+        }
+    }
+    packtrans(p);
+    return n;
+}
+
 /*
  * Merge nodes p and q in the pfsa.
- * This is currently an O(n) algorithm. As soon as I get some time I should
- * convert this to an O(1) algorithm.
+ * This is O(d) where d is the total size of the lists of p2, p1 and
+ * their immediate neighbours, independent of the size of the pfsa.
+ * It relies on srclist being exact: every arc into a node is listed
+ * in its srclist, so the neighbours of p2 are all that need looking at.
  *
  * This is currently the only place where an unrealised pfsa is realised.
  *
@@ -892,22 +2615,55 @@ STATE *consStateNode(int state, STATE *next) {
  *       you can't refer to p2.  The process is symmetric, but the 
  *       nomenclature is not.
  */
-void merge(NODE *pfsa,NODE *p1,NODE *p2) {
-    NODE *p;
-    TRANS *tp, *tp1, *tp2, *temptp;
-    SOURCE *sp, *sp1, *sp2, *tempsp;
+static void domerge(NODE *pfsa, NODE *p1, NODE *p2, MERGELOG **logp) {
+    NODE **touched, *p;
+    TRANS *tp, *tp1, *tp2, *newtp;
+    SOURCE *sp, *sp2, *newsp;
+    int i, ntouched, state2;
     if (p1 == p2)
         return;
+    state2 = p2->state;
 
     /* Any node that has p2 as a target needs to be changed to have p1
      * instead.  These nodes are in p2->srclist.  Likewise, any node
      * that has p2 as a source needs to be changed to have p1 instead.
-     * These nodes are in p2->translist
-     *
-     * (Actually works out faster to traverse the node list rather than
-     * sourcelist and translist since they tend to have duplicates.)
+     * These nodes are in p2->translist.  Collect them (once each, using
+     * the mark field) together with p1 and p2 before changing anything,
+     * since a self loop on p2 shows up on both sides.  These are also
+     * the only nodes that can end up with duplicate entries below.
+     * Marks may have been left set by a traversal, so clear them first.
      */
-    for (p = pfsa->nextnode; p; p = p->nextnode) {
+    if (Ctx->touchedsize < p2->nsrclist + p2->ntranslist + 2) {
+        Ctx->touchedsize = 2 * (p2->nsrclist + p2->ntranslist + 2);
+        Ctx->touched = (NODE **) realloc(Ctx->touched,
+                Ctx->touchedsize * sizeof (NODE *));
+        if (!Ctx->touched)
+            memerr();
+    }
+    touched = Ctx->touched;
+    for (sp = p2->srclist->next_src; sp; sp = sp->next_src)
+        sp->source->mark = 0;
+    for (tp = p2->translist->next_tran; tp; tp = tp->next_tran)
+        tp->target->mark = 0;
+    ntouched = 0;
+    p1->mark = p2->mark = 1;
+    touched[ntouched++] = p1;
+    touched[ntouched++] = p2;
+    for (sp = p2->srclist->next_src; sp; sp = sp->next_src)
+        if (!sp->source->mark) {
+            sp->source->mark = 1;
+            touched[ntouched++] = sp->source;
+        }
+    for (tp = p2->translist->next_tran; tp; tp = tp->next_tran)
+        if (!tp->target->mark) {
+            tp->target->mark = 1;
+            touched[ntouched++] = tp->target;
+        }
+    if (logp)
+        *logp = savemerge(pfsa, touched, ntouched);
+    for (i = 0; i < ntouched; i++) {
+        p = touched[i];
+        p->mark = 0;
         for (tp = p->translist->next_tran; tp; tp = tp->next_tran)
             if (tp->target == p2)
                 tp->target = p1;
@@ -919,12 +2675,19 @@ void merge(NODE *pfsa,NODE *p1,NODE *p2) {
     /* PONDY  Merge the state list of p2 into p1 must be new copy
        (can't share because of need to dispose)  */
 
+    /* A speculative merge splices copies, so that the saved lists
+     * are still intact if it is undone. */
+    if (logp) {
+        p1->state_list = copystates(pfsa, p1->state_list);
+        p2->state_list = copystates(pfsa, p2->state_list);
+    }
+
     if (!p1->state_list) { /* p1 was a one state node */
-        p1->state_list = consStateNode(p2->state, p2->state_list);
+        p1->state_list = consStateNode(pfsa, p2->state, p2->state_list);
     } else {
         STATE *list2, *rest1, *temp; /* PONDY for merging the state lists */
 
-        list2 = consStateNode(p2->state, p2->state_list);
+        list2 = consStateNode(pfsa, p2->state, p2->state_list);
 
         /* p1 has a statelist of its own, but we know that
          * p1->state < list2->state.
@@ -949,105 +2712,218 @@ void merge(NODE *pfsa,NODE *p1,NODE *p2) {
     /* Merge the transition list of p2 into p1.  This may result in
      * duplicate transitions - eg (a->4)..(a->3)..(a,4), but this will
      * be collapsed in the next step where we merge duplicate
-     * transitions.
+     * transitions.  i indexes p1's list rather than a pointer into it,
+     * since inserting into the array may move it.
      */
-    tp1 = p1->translist;
-    tp2 = p2->translist;
-    while (tp2->next_tran) {
-        temptp = tp2->next_tran;
-        tp2->next_tran = temptp->next_tran; /* unlink */
-        while (tp1->next_tran && tp1->next_tran->sym < temptp->sym)
-            tp1 = tp1->next_tran;
-        if (tp1->next_tran && tp1->next_tran->sym == temptp->sym &&
-                tp1->next_tran->target == temptp->target) {
-            tp1->next_tran->freq += temptp->freq;
-            free((void *) temptp);
-            if (Symtab[tp1->next_tran->sym].label[0] != Delim)
+    i = 0;
+    for (tp2 = p2->translist->next_tran; tp2; tp2 = tp2->next_tran) {
+        while (i < p1->ntranslist && p1->translist[i + 1].sym < tp2->sym)
+            i++;
+        tp1 = p1->translist[i].next_tran;
+        if (tp1 && tp1->sym == tp2->sym && tp1->target == tp2->target) {
+            tp1->freq += tp2->freq;
+            if (Symtab[tp1->sym].label[0] != Delim)
                 decr_trancnt(pfsa);
         } else {
-            if (!tp1->next_tran ||
-                    (tp1->next_tran && tp1->next_tran->sym > temptp->sym))
+            if (!tp1 || tp1->sym > tp2->sym)
                 p1->nsymbols++;
-            temptp->next_tran = tp1->next_tran;
-            tp1->next_tran = temptp;
+            newtp = instrans(p1, i + 1);
+            newtp->target = tp2->target;
+            newtp->sym = tp2->sym;
+            newtp->freq = tp2->freq;
         }
     }
-    free((void *) p2->translist);
 
-    /* Likewise for p2's source list.
+    /* Likewise for p2's source list, except that its entries are just
+     * appended to p1's.  Sorting p1's list below puts them in place.
      */
-    sp1 = p1->srclist;
-    sp2 = p2->srclist;
-    while (sp2->next_src) {
-        tempsp = sp2->next_src;
-        sp2->next_src = tempsp->next_src; /* unlink */
-        while (sp1->next_src && sp1->next_src->sym < tempsp->sym)
-            sp1 = sp1->next_src;
-        if (sp1->next_src && sp1->next_src->sym == tempsp->sym &&
-                sp1->next_src->source == tempsp->source) {
-            sp1->next_src->freq += tempsp->freq;
-            free((void *) tempsp);
-        } else {
-            tempsp->next_src = sp1->next_src;
-            sp1->next_src = tempsp;
-        }
+    for (sp2 = p2->srclist->next_src; sp2; sp2 = sp2->next_src) {
+        newsp = inssrc(p1, p1->nsrclist + 1);
+        newsp->source = sp2->source;
+        newsp->sym = sp2->sym;
+        newsp->freq = sp2->freq;
     }
-    free((void *) p2->srclist);
+    p2->ntranslist = p2->nsrclist = 0;
+    relinktrans(p2, 0);
+    relinksrcs(p2, 0);
 
     /* The previous steps would have caused duplicate transitions and
      * sources in the lists, eg, (1,a)->(2,a)->... may become
      * (1,a)->(1,a)->..  on merging 1 and 2.  Merge all such duplicate
-     * items.
+     * items.  p2's lists are empty by now.  Retargeting p2 to p1 has
+     * also upset the order of the srclists touched, so sort them.
+     * p1 (touched[0]) needs new pmuls, the rest only if arcs folded.
      */
-    for (p = pfsa->nextnode; p; p = p->nextnode) {
-        for (tp = p->translist; tp; tp = tp->next_tran) {
-            tp1 = tp;
-            while (tp1->next_tran && tp->sym == tp1->next_tran->sym) {
-                if (tp->target == tp1->next_tran->target) {
-                    tp->freq += tp1->next_tran->freq;
-                    if (Symtab[tp1->next_tran->sym].label[0] != Delim)
-                        decr_trancnt(pfsa);
-                    temptp = tp1->next_tran;
-                    tp1->next_tran = temptp->next_tran;
-                    free((void *) temptp);
-                    continue;
-                }
-                tp1 = tp1->next_tran;
-            }
-        }
-        for (sp = p->srclist; sp; sp = sp->next_src) {
-            sp1 = sp;
-            while (sp1->next_src && sp->sym == sp1->next_src->sym) {
-                if (sp->source == sp1->next_src->source) {
-                    sp->freq += sp1->next_src->freq;
-                    tempsp = sp1->next_src;
-                    sp1->next_src = tempsp->next_src;
-                    free((void *) tempsp);
-                    continue;
-                }
-                sp1 = sp1->next_src;
-            }
-        }
-    }
-
     p1->nvisits += p2->nvisits;
     p1->ntrans += p2->ntrans;
+    for (i = 0; i < ntouched; i++) {
+        if (collapsetrans(pfsa, touched[i]) || !i)
+            nodeprobs(touched[i]);
+        sortsrcs(touched[i]);
+    }
 
     /*
      * Step 3: Unlink p2
      */
-    for (p = pfsa; p->nextnode; p = p->nextnode) {
-        if (p->nextnode == p2) {
-            p->nextnode = p2->nextnode;
-            free((void *) p2);
-            break;
-        }
+    p2->prevnode->nextnode = p2->nextnode;
+    if (p2->nextnode)
+        p2->nextnode->prevnode = p2->prevnode;
+    if (!logp) {		/* else p2 is kept for undomerge() */
+        poolfree(pfsa->pool, p2->translist,
+                p2->translistsize * sizeof (TRANS));
+        poolfree(pfsa->pool, p2->srclist, p2->srclistsize * sizeof (SOURCE));
+        poolfree(pfsa->pool, p2, sizeof (NODE));
     }
-    if (p2->state == getmaxstatenum(pfsa))
+    setindex(pfsa, state2, (NODE *) 0);
+    if (state2 == getmaxstatenum(pfsa))
         resetmaxstatenum(pfsa);
     decr_nodecnt(pfsa);
 }
 
+void merge(NODE *pfsa, NODE *p1, NODE *p2) {
+    domerge(pfsa, p1, p2, (MERGELOG **) 0);
+}
+
+/*
+ * Speculative merges.  trymerge() merges p2 into p1 in place, just as
+ * merge() does, but first saves the nodes it is about to change (p1,
+ * p2 and their neighbours) in a MERGELOG.  The merged pfsa can then be
+ * scored, compared with isequiv() and so on like any other.
+ * undomerge() puts the saved nodes back, and keepmerge() throws the log
+ * away and so makes the merge permanent.  Both cost time in proportion
+ * to the nodes touched, not to the size of the pfsa, unlike mergecopy().
+ * Logs may be stacked, but must be resolved in reverse order.
+ */
+struct mergelog {
+    NODE *pfsa;
+    NODE *p2;			/* Unlinked, but not freed until kept */
+    int nstates, trancnt, maxstate;
+    int nsaved;
+    NODE **node;		/* Array of the nodes changed, and ... */
+    NODE *before;		/* ... their contents beforehand */
+};
+
+static STATE *copystates(NODE *pfsa, STATE *list) {
+    STATE *head, **tail;
+
+    head = (STATE *) 0;
+    for (tail = &head; list; list = list->next, tail = &(*tail)->next)
+        *tail = consStateNode(pfsa, list->state, (STATE *) 0);
+    return head;
+}
+
+static void freestates(NODE *pfsa, STATE *list) {
+    STATE *next;
+
+    for (; list; list = next) {
+        next = list->next;
+        poolfree(pfsa->pool, list, sizeof (STATE));
+    }
+}
+
+/*
+ * Save the nodes a merge is about to change.  The saved copies of the
+ * lists are exact size, and become the node's lists again on undo.
+ */
+static MERGELOG *savemerge(NODE *pfsa, NODE **touched, int ntouched) {
+    MERGELOG *log;
+    NODE *b;
+    int i;
+
+    log = (MERGELOG *) poolalloc(pfsa->pool, sizeof (MERGELOG));
+    log->pfsa = pfsa;
+    log->p2 = touched[1];
+    log->nstates = nstates(pfsa);
+    log->trancnt = trancnt(pfsa);
+    log->maxstate = getmaxstatenum(pfsa);
+    log->nsaved = ntouched;
+    log->node = (NODE **) poolalloc(pfsa->pool, ntouched * sizeof (NODE *));
+    log->before = (NODE *) poolalloc(pfsa->pool, ntouched * sizeof (NODE));
+    for (i = 0; i < ntouched; i++) {
+        log->node[i] = touched[i];
+        b = &log->before[i];
+        *b = *touched[i];
+        b->mark = 0;		/* merge() leaves them clear */
+        b->translistsize = b->ntranslist + 1;
+        b->srclistsize = b->nsrclist + 1;
+        b->translist = (TRANS *) poolalloc(pfsa->pool,
+                b->translistsize * sizeof (TRANS));
+        b->srclist = (SOURCE *) poolalloc(pfsa->pool,
+                b->srclistsize * sizeof (SOURCE));
+        memcpy(b->translist, touched[i]->translist,
+                b->translistsize * sizeof (TRANS));
+        memcpy(b->srclist, touched[i]->srclist,
+                b->srclistsize * sizeof (SOURCE));
+    }
+    return log;
+}
+
+static void freelog(MERGELOG *log) {
+    POOL *pool = log->pfsa->pool;
+
+    poolfree(pool, log->node, log->nsaved * sizeof (NODE *));
+    poolfree(pool, log->before, log->nsaved * sizeof (NODE));
+    poolfree(pool, log, sizeof (MERGELOG));
+}
+
+MERGELOG *trymerge(NODE *pfsa, NODE *p1, NODE *p2) {
+    MERGELOG *log = (MERGELOG *) 0;
+
+    domerge(pfsa, p1, p2, &log);
+    return log;
+}
+
+void undomerge(MERGELOG *log) {
+    NODE *pfsa, *p, *b;
+    int i;
+
+    if (!log)
+        return;
+    pfsa = log->pfsa;
+    /* p1 is touched[0]: its state list is all new cells */
+    freestates(pfsa, log->node[0]->state_list);
+    for (i = 0; i < log->nsaved; i++) {
+        p = log->node[i];
+        b = &log->before[i];
+        poolfree(pfsa->pool, p->translist, p->translistsize * sizeof (TRANS));
+        poolfree(pfsa->pool, p->srclist, p->srclistsize * sizeof (SOURCE));
+        *p = *b;
+        relinktrans(p, 0);
+        relinksrcs(p, 0);
+    }
+    p = log->p2;
+    p->prevnode->nextnode = p;
+    if (p->nextnode)
+        p->nextnode->prevnode = p;
+    setindex(pfsa, p->state, p);
+    nstates(pfsa) = log->nstates;
+    trancnt(pfsa) = log->trancnt;
+    setmaxstatenum(pfsa, log->maxstate);
+    freelog(log);
+}
+
+void keepmerge(MERGELOG *log) {
+    NODE *pfsa, *b;
+    int i;
+
+    if (!log)
+        return;
+    pfsa = log->pfsa;
+    for (i = 0; i < log->nsaved; i++) {
+        b = &log->before[i];
+        poolfree(pfsa->pool, b->translist, b->translistsize * sizeof (TRANS));
+        poolfree(pfsa->pool, b->srclist, b->srclistsize * sizeof (SOURCE));
+    }
+    /* The old state lists of p1 and p2 were copied, not spliced */
+    freestates(pfsa, log->before[0].state_list);
+    freestates(pfsa, log->before[1].state_list);
+    b = log->p2;
+    poolfree(pfsa->pool, b->translist, b->translistsize * sizeof (TRANS));
+    poolfree(pfsa->pool, b->srclist, b->srclistsize * sizeof (SOURCE));
+    poolfree(pfsa->pool, b, sizeof (NODE));
+    freelog(log);
+}
+
 /*
  * mergecopy is the same as merge - in fact it calls merge() to do the job,
  * but it returns a copy of the merged pfsa, leaving the original pfsa
@@ -1105,106 +2981,323 @@ void printpfsa(NODE *pfsa) {
 }
 
 /*
- * getanno() is used to make a character string to annotate an edge
- * for the graphplace program.  This is used because if there is more
- * than one transition to the same target from the same source, graphplace
- * will print them one over the other, thus making all but one illegible.
- * getanno() will order all such transitions as a single continuous string.
- * The way it works is that each time getanno() is called with a transition
- * pointer, it will return a string with annotations of all transitions to
- * that target.  If the current transition is to a target that has already
- * been handled, it will return a NULL string;
- * Because it is prettier to have the arc frequency in superscript, which is
- * only possible if there is a single transition to a state, we build both
- * possibilities (Singleanno requires "(freq) (label)", multianno requires
- * () (label^freq,label^freq,label^freq,...)", but discard the former if
- * there is more than one transition to the same state.
+ * Writing a pfsa goes through an OUTBUF, a buffer of OUTCHUNK bytes that
+ * is handed to fwrite() whole, with the numbers formatted here rather
+ * than by printf().  Anything written to fp before or after goes in the
+ * right place, since the buffer is flushed through fp.
+ */
+#define OUTCHUNK (1 << 20)
+
+typedef struct {
+    FILE *fp;
+    char *buf;
+    size_t len;
+} OUTBUF;
+
+static void outflush(OUTBUF *o) {
+    if (o->len && fwrite(o->buf, 1, o->len, o->fp) != o->len)
+        Perror((char *) "write");
+    o->len = 0;
+}
+
+static void outmem(OUTBUF *o, const char *s, size_t n) {
+    size_t k;
+
+    while (n > OUTCHUNK - o->len) {
+        k = OUTCHUNK - o->len;
+        memcpy(o->buf + o->len, s, k);
+        o->len += k;
+        s += k;
+        n -= k;
+        outflush(o);
+    }
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+}
+
+static void outstr(OUTBUF *o, const char *s) {
+    outmem(o, s, strlen(s));
+}
+
+/*
+ * Format n into the end of buf, which must have room for 21 chars, and
+ * return where it starts.
+ */
+static char *fmtint(char *end, long n) {
+    u_long u = n < 0 ? -(u_long) n : (u_long) n;
+
+    do
+        *--end = '0' + u % 10;
+    while (u /= 10);
+    if (n < 0)
+        *--end = '-';
+    return end;
+}
+
+static void outint(OUTBUF *o, long n) {
+    char buf[24], *s;
+
+    s = fmtint(buf + sizeof (buf), n);
+    outmem(o, s, buf + sizeof (buf) - s);
+}
+
+/*
+ * putanno() writes the annotation of the edge for the graphplace program
+ * from the source state of arc[i] to its target.  If there is more than
+ * one transition to the same target from the same source, graphplace
+ * will print them one over the other, thus making all but one illegible,
+ * so all such transitions from arc[i] on are written as a single
+ * continuous string.  next[j] is the index of the next arc after arc[j]
+ * to the same target, or -1.  Because it is prettier to have the arc
+ * frequency in superscript, which is only possible if there is a single
+ * transition to a state, a single transition is written as
+ * "(freq) (label)", and several as "() (label^freq,label^freq,...)".
  * Also, to make things tidier, frequency counts of 1 are not displayed.
  */
-char *getanno(TRANS *trans, TRANS *tp) {
-    extern char *Prog;
-    TRANS *t;
-    static char annos[512], singleanno[64];
-    char buf[256];
-    int singletrans = 1;
+static void putanno(OUTBUF *o, TRANS **arc, int *next, int i) {
+    TRANS *tp = arc[i];
+
+    if (next[i] < 0) {
+        outstr(o, "(");
+        if (tp->freq != 1)
+            outint(o, tp->freq);
+        outstr(o, ") (");
+        outstr(o, Symtab[tp->sym].label);
+        outstr(o, ")");
+        return;
+    }
+    outstr(o, "() (");
+    outstr(o, Symtab[tp->sym].label);
+    if (tp->freq != 1) {
+        outstr(o, "^");
+        outint(o, tp->freq);
+    }
+    for (i = next[i]; i >= 0; i = next[i]) {
+        tp = arc[i];
+        outstr(o, ",");
+        outstr(o, Symtab[tp->sym].label);
+        if (tp->freq > 1) {
+            outstr(o, "^");
+            outint(o, tp->freq);
+        }
+    }
+    outstr(o, ")");
+}
 
-    /*
-     * First go through all the targets in translist before the current
-     * one (tp->target) and see if we have already handled this target on
-     * non-delimiter symbols.
-     */
-    for (t = trans; t != tp; t = t->next_tran)
-        if (t->target == tp->target && Symtab[t->sym].label[0] != Delim)
-            return (char *) 0;
-
-    if (tp->freq == 1)
-        sprintf(singleanno, "() (%s)", Symtab[tp->sym].label);
-    else
-        sprintf(singleanno, "(%d) (%s)", tp->freq, Symtab[tp->sym].label);
-
-    if (tp->freq == 1)
-        sprintf(annos, "() (%s", Symtab[tp->sym].label);
-    else
-        sprintf(annos, "() (%s^%d", Symtab[tp->sym].label, tp->freq);
-
-    while ((t = t->next_tran)) {
-        if (t->target == tp->target) {
-            if (strlen(annos) > 500) {
-                fprintf(stderr, "%s: Anno too long on arc to %d\n", Prog,
-                        tp->target->state);
-                exit(1);
+/*
+ * Graphplace output.  The arcs of each state are grouped by target in
+ * one pass, and the edge to a target is written at the first arc to it
+ * not on the delimiter, annotated by putanno().  last[], mark[] and
+ * seen[] are indexed by target state; mark[] says which source state
+ * the other two are for.
+ */
+static void writegraph(OUTBUF *o, NODE *pfsa) {
+    NODE *p;
+    TRANS *tp, **arc = (TRANS **) 0;
+    int *next = (int *) 0, *last, *mark, narcsize = 0;
+    char *seen, *label;
+    int n, i, s, ndelims; /* no. of delims from a state */
+
+    n = getmaxstatenum(pfsa) + 1;
+    last = (int *) malloc(n * sizeof (int));
+    mark = (int *) malloc(n * sizeof (int));
+    seen = (char *) malloc(n);
+    if (!last || !mark || !seen)
+        memerr();
+    for (i = 0; i < n; i++)
+        mark[i] = -1;
+    for (p = pfsa->nextnode; p; p = p->nextnode) {
+        if (p->ntranslist > narcsize) {
+            narcsize = 2 * p->ntranslist;
+            arc = (TRANS **) realloc(arc, narcsize * sizeof (TRANS *));
+            next = (int *) realloc(next, narcsize * sizeof (int));
+            if (!arc || !next)
+                memerr();
+        }
+        n = 0;
+        for (tp = p->translist->next_tran; tp; tp = tp->next_tran) {
+            s = tp->target->state;
+            arc[n] = tp;
+            next[n] = -1;
+            if (mark[s] == p->state)
+                next[last[s]] = n;
+            else {
+                mark[s] = p->state;
+                seen[s] = 0;
+            }
+            last[s] = n++;
+        }
+        ndelims = 0;
+        for (i = 0; i < n; i++) {
+            tp = arc[i];
+            s = tp->target->state;
+            label = Symtab[tp->sym].label;
+            if (label[0] == '\n')
+                ndelims += tp->freq;
+            else if (!seen[s]) {
+                putanno(o, arc, next, i);
+                outstr(o, " ");
+                outint(o, p->state);
+                outstr(o, " ");
+                outint(o, s);
+                outstr(o, " edge\n");
             }
-            singletrans = 0;
-            if (t->freq > 1)
-                sprintf(buf, ",%s^%d", Symtab[t->sym].label, t->freq);
-            else
-                sprintf(buf, ",%s", Symtab[t->sym].label);
-            strcat(annos, buf);
+            if (label[0] != Delim)
+                seen[s] = 1;
         }
+        if (ndelims) {
+            outstr(o, "(!^");
+            outint(o, ndelims);
+            outstr(o, ") (");
+        } else
+            outstr(o, "(");
+        outint(o, p->state);
+        outstr(o, ") () ");
+        outint(o, p->state);
+        outstr(o, " node\n");
     }
-    if (singletrans)
-        return singleanno;
-    strcat(annos, ")");
-    return annos;
+    free(arc);
+    free(next);
+    free(last);
+    free(mark);
+    free(seen);
 }
 
+/*
+ * Each arc is a line "source target label freq", the label right
+ * justified in 20 columns, as "%d\t%d\t%20s\t%d\n" would have it.  The
+ * source is formatted once for all its arcs, and the labels padded once
+ * for the lot.
+ */
 void writepfsa(FILE *fp,
         NODE *pfsa) {
+    OUTBUF o;
     NODE *p;
     TRANS *tp;
-    char *label, *s;
-    int ndelims; /* no. of delims from a state (for graphplace) */
+    char **pad, *label, src[24], num[24], *s, *e;
+    int *padlen, nsrc, i, n;
 
+    o.fp = fp;
+    o.len = 0;
+    o.buf = (char *) malloc(OUTCHUNK);
+    if (!o.buf)
+        memerr();
     if (Graphplace) {
-        for (p = pfsa->nextnode; p; p = p->nextnode) {
-            ndelims = 0;
-            tp = p->translist->next_tran;
-            while (tp) {
-                label = Symtab[tp->sym].label;
-                if (label[0] == '\n')
-                    ndelims += tp->freq;
-                else if ((s = getanno(p->translist->next_tran, tp)))
-                    fprintf(fp, "%s %d %d edge\n", s, p->state, tp->target->state);
-                tp = tp->next_tran;
-            }
-            if (ndelims)
-                fprintf(fp, "(!^%d) (%d) () %d node\n", ndelims, p->state, p->state);
-            else
-                fprintf(fp, "(%d) () %d node\n", p->state, p->state);
-        }
-    } else {
-        for (p = pfsa->nextnode; p; p = p->nextnode) {
-            tp = p->translist->next_tran;
-            while (tp) {
-                label = Symtab[tp->sym].label;
-                fprintf(fp, "%d\t%d\t%20s\t%d\n", p->state,
-                        tp->target->state,
-                        label[0] == '\n' ? "\\n" : label,
-                        tp->freq);
-                tp = tp->next_tran;
-            }
+        writegraph(&o, pfsa);
+        outflush(&o);
+        free(o.buf);
+        return;
+    }
+
+    pad = (char **) malloc((Nsyms + 1) * sizeof (char *));
+    padlen = (int *) malloc((Nsyms + 1) * sizeof (int));
+    if (!pad || !padlen)
+        memerr();
+    for (i = 1; i < Nsyms; i++) {
+        label = Symtab[i].label;
+        if (label[0] == '\n')
+            label = (char *) "\\n";
+        n = strlen(label);
+        padlen[i] = n < 20 ? 20 : n;
+        pad[i] = (char *) malloc(padlen[i]);
+        if (!pad[i])
+            memerr();
+        memset(pad[i], ' ', padlen[i] - n);
+        memcpy(pad[i] + padlen[i] - n, label, n);
+    }
+    e = num + sizeof (num);
+    for (p = pfsa->nextnode; p; p = p->nextnode) {
+        s = fmtint(src + sizeof (src) - 1, p->state);
+        src[sizeof (src) - 1] = '\t';
+        nsrc = src + sizeof (src) - s;
+        for (tp = p->translist->next_tran; tp; tp = tp->next_tran) {
+            if (OUTCHUNK - o.len < 64 + (size_t) padlen[tp->sym])
+                outflush(&o);
+            memcpy(o.buf + o.len, s, nsrc);
+            o.len += nsrc;
+            label = fmtint(e, tp->target->state);
+            memcpy(o.buf + o.len, label, e - label);
+            o.len += e - label;
+            o.buf[o.len++] = '\t';
+            memcpy(o.buf + o.len, pad[tp->sym], padlen[tp->sym]);
+            o.len += padlen[tp->sym];
+            o.buf[o.len++] = '\t';
+            label = fmtint(e, tp->freq);
+            memcpy(o.buf + o.len, label, e - label);
+            o.len += e - label;
+            o.buf[o.len++] = '\n';
         }
     }
+    outflush(&o);
+    for (i = 1; i < Nsyms; i++)
+        free(pad[i]);
+    free(pad);
+    free(padlen);
+    free(o.buf);
+}
+
+/*
+ * Write the pfsa in the binary format described at PFSABIN in pfsa.h.
+ * Every symbol of Symtab is written, used or not, so that a program
+ * that reads the file back numbers its symbols the same way.
+ */
+void writebpfsa(FILE *fp,
+        NODE *pfsa) {
+    PFSABIN h;
+    NODE *p;
+    TRANS *tp;
+    u_int32_t *pos, *a, *first, *labelend;
+    size_t narcs, i, n;
+    int s;
+
+    memcpy(h.magic, PFSABIN_MAGIC, sizeof (h.magic));
+    h.version = PFSABIN_VERSION;
+    h.order = PFSABIN_ORDER;
+    h.nsyms = Nsyms ? Nsyms - 1 : 0;
+    h.nstates = nstates(pfsa);
+    for (narcs = 0, p = pfsa->nextnode; p; p = p->nextnode)
+        narcs += p->ntranslist;
+    h.narcs = narcs;
+
+    pos = (u_int32_t *) malloc((getmaxstatenum(pfsa) + 1) * sizeof (u_int32_t));
+    first = (u_int32_t *) malloc((h.nstates + 1) * sizeof (u_int32_t));
+    labelend = (u_int32_t *) malloc((h.nsyms + 1) * sizeof (u_int32_t));
+    a = (u_int32_t *) malloc((narcs + h.nstates + 1) * sizeof (u_int32_t));
+    if (!pos || !first || !labelend || !a)
+        memerr();
+    for (n = 0, s = 1; s <= (int) h.nsyms; s++)
+        labelend[s - 1] = n += strlen(Symtab[s].label) + 1;
+    for (i = 0, n = 0, p = pfsa->nextnode; p; p = p->nextnode, i++) {
+        pos[p->state] = i;
+        a[i] = p->state;
+        first[i] = n;
+        n += p->ntranslist;
+    }
+    first[i] = n;
+    fwrite((void *) &h, sizeof (h), 1, fp);
+    fwrite((void *) labelend, sizeof (u_int32_t), h.nsyms, fp);
+    fwrite((void *) a, sizeof (u_int32_t), h.nstates, fp);
+    fwrite((void *) first, sizeof (u_int32_t), h.nstates + 1, fp);
+
+    /* target[], sym[] and freq[] in turn, through a */
+    for (i = 0, p = pfsa->nextnode; p; p = p->nextnode)
+        for (tp = p->translist->next_tran; tp; tp = tp->next_tran)
+            a[i++] = pos[tp->target->state];
+    fwrite((void *) a, sizeof (u_int32_t), narcs, fp);
+    for (i = 0, p = pfsa->nextnode; p; p = p->nextnode)
+        for (tp = p->translist->next_tran; tp; tp = tp->next_tran)
+            a[i++] = tp->sym;
+    fwrite((void *) a, sizeof (u_int32_t), narcs, fp);
+    for (i = 0, p = pfsa->nextnode; p; p = p->nextnode)
+        for (tp = p->translist->next_tran; tp; tp = tp->next_tran)
+            a[i++] = tp->freq;
+    fwrite((void *) a, sizeof (u_int32_t), narcs, fp);
+    for (s = 1; s <= (int) h.nsyms; s++)
+        fwrite((void *) Symtab[s].label, 1, strlen(Symtab[s].label) + 1, fp);
+    free(pos);
+    free(first);
+    free(labelend);
+    free(a);
 }
 
 /*
@@ -1217,10 +3310,26 @@ void memerr() {
 
 void Perror(char *s) /* Fatal perror() */
 {
-    extern int errno;
+    int e = errno;
 
     perror(s);
-    exit(errno);
+    bail(e);
+}
+
+/*
+ * Give up, having said why on stderr.  e is the errno value of what went
+ * wrong, or 0 for bad input.  A program exits with e as its status, or
+ * 1 for bad input.  Inside a libpfsa call, which sets Onerror on its
+ * thread, errno is set to e (EINVAL for bad input) and the call gets
+ * control back instead.
+ */
+void bail(int e)
+{
+    if (Onerror) {
+        errno = e ? e : EINVAL;
+        longjmp(*Onerror, 1);
+    }
+    exit(e ? e : 1);
 }
 
 /*
@@ -1231,8 +3340,14 @@ void Perror(char *s) /* Fatal perror() */
  */
 char *mkfname(char *fname, char *ext)
 {
-    static char buf[BUFSIZ], *p;
+    extern char *Prog;
+    char *buf = Ctx->fname, *p;
 
+    /* Room for ext either way, and for setfilenames() to make .opfsa */
+    if (strlen(fname) + strlen(ext) >= sizeof (Ctx->fname)) {
+        fprintf(stderr, "%s: file name too long\n", Prog);
+        bail(0);
+    }
     strcpy(buf, fname);
     if (strcmp(fname, "-")) {
         p = strrchr(fname, '.');
@@ -1241,7 +3356,7 @@ char *mkfname(char *fname, char *ext)
         else if (strcmp(p, ext)) {
             fprintf(stderr, "Unexpected file type %s when expecting %s\n",
                     fname, ext + 1);
-            exit(1);
+            bail(0);
         }
     }
     return buf;
@@ -1253,15 +3368,15 @@ char *mkfname(char *fname, char *ext)
  */
 int *toks2syms(char *buf)
 {
-    static int symbols[BUFSIZ];
-    char *label;
+    int *symbols = Ctx->syms;
+    char *label, *last;
     int sym, i = 0;
 
-    label = strtok(buf, ":");
+    label = strtok_r(buf, ":", &last);
     while (label && i < BUFSIZ - 1) {
         sym = findsym(label);
         symbols[i++] = sym;
-        label = strtok((char *) NULL, ":");
+        label = strtok_r((char *) NULL, ":", &last);
     }
     symbols[i] = 0;
     return symbols;
@@ -1273,8 +3388,7 @@ int *toks2syms(char *buf)
  */
 char *syms2toks(int *p)
 {
-    static char buf[BUFSIZ];
-    char *label = (char *) 0;
+    char *buf = Ctx->toks, *label = (char *) 0;
 
     buf[0] = '\0';
     while (*p) {
@@ -1292,6 +3406,85 @@ char *syms2toks(int *p)
     return buf;
 }
 
+/*
+ * For the driver's report of where the time goes: phasetime(name) ends
+ * the phase name, begun at the previous call, and with Verbose says how
+ * long it took.  phasetime(0) starts the clock.
+ */
+void phasetime(const char *name)
+{
+    extern char *Prog;
+    struct timespec now, *last = &Ctx->phase;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (name && Verbose)
+        fprintf(stderr, "%s: %s %.3f s\n", Prog, name,
+                (now.tv_sec - last->tv_sec) + (now.tv_nsec - last->tv_nsec) * 1e-9);
+    *last = now;
+}
+
+/*
+ * Make a new context, with an empty symbol table and the options as a
+ * program starts with them.  It is not put to use; see usecontext().
+ */
+CONTEXT *newcontext(void)
+{
+    CONTEXT *ctx;
+
+    if (!(ctx = (CONTEXT *) calloc(1, sizeof (CONTEXT))))
+        memerr();
+    ctx->delim = '\n';
+    ctx->lineno = 1;
+    strcpy(ctx->infile, "-");
+    strcpy(ctx->outfile, "-");
+    strcpy(ctx->callstring, "opt");
+    return ctx;
+}
+
+/*
+ * Make ctx (Ctx0 if null) the current context of this thread, and
+ * return the one it replaces.
+ */
+CONTEXT *usecontext(CONTEXT *ctx)
+{
+    CONTEXT *old = Ctx;
+
+    Ctx = ctx ? ctx : &Ctx0;
+    return old;
+}
+
+/*
+ * Free a context from newcontext(), with its symbol table and its pfsa
+ * if it still has one.  A thread using it goes back to Ctx0.  Any other
+ * pfsa built with its symbols is meaningless afterwards.
+ */
+void freecontext(CONTEXT *ctx)
+{
+    LOADER *ld;
+    char *b;
+
+    if (!ctx || ctx == &Ctx0)
+        return;
+    if (ctx->pfsa)
+        delpfsa(ctx->pfsa);
+    if ((ld = (LOADER *) ctx->loader)) {
+        free(ld->arc);
+        free(ld->label);
+        free(ld->last);
+        free(ld);
+    }
+    while ((b = ctx->symblocks)) {
+        ctx->symblocks = *(char **) b;
+        free(b);
+    }
+    free(ctx->symtab);
+    free(ctx->symhash);
+    free(ctx->touched);
+    free(ctx);
+    if (Ctx == ctx)
+        Ctx = &Ctx0;
+}
+
 /*
  * Turns debug on and off during a long execution
  */
@@ -1377,28 +3570,37 @@ int *intdup(int *p)
  */
 NODE * trim(NODE *pfsa) {
     NODE *p, *temp_p;
-    TRANS *tp, *temp_tp;
+    TRANS *tp;
+    SOURCE *sp;
 
     p = pfsa;
     while (p->nextnode) {
-        tp = p->nextnode->translist;
-        while (tp->next_tran) {
-            if (!tp->next_tran->freq) {
-                if (tp->next_tran->sym != DELIMITER)
+        for (tp = p->nextnode->translist->next_tran; tp; tp = tp->next_tran)
+            if (!tp->freq) {
+                if (tp->sym != DELIMITER)
                     decr_trancnt(pfsa);
-                temp_tp = tp->next_tran;
-                tp->next_tran = tp->next_tran->next_tran;
-                free((void *) temp_tp);
-            } else
-                tp = tp->next_tran;
-        }
+                /* Keep srclist exact for merge(): drop the back pointer */
+                for (sp = tp->target->srclist->next_src; sp; sp = sp->next_src)
+                    if (sp->source == p->nextnode && sp->sym == tp->sym)
+                        sp->source = (NODE *) 0;
+                sortsrcs(tp->target);
+                tp->target = (NODE *) 0;
+            }
+        packtrans(p->nextnode);
 
         /* Remove node if all trans have gone 
          */
         if (!p->nextnode->translist->next_tran) {
             temp_p = p->nextnode;
             p->nextnode = p->nextnode->nextnode;
-            free((void *) temp_p);
+            if (p->nextnode)
+                p->nextnode->prevnode = p;
+            setindex(pfsa, temp_p->state, (NODE *) 0);
+            poolfree(pfsa->pool, temp_p->translist,
+                    temp_p->translistsize * sizeof (TRANS));
+            poolfree(pfsa->pool, temp_p->srclist,
+                    temp_p->srclistsize * sizeof (SOURCE));
+            poolfree(pfsa->pool, temp_p, sizeof (NODE));
             decr_nodecnt(pfsa);
         } else
             p = p->nextnode;
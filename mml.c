@@ -0,0 +1,197 @@
+/*
+ * mml.c
+ * The minimum message length of a pfsa: the bits needed to state the
+ * pfsa and then the strings it was built from, by Wallace & Georgeff's
+ * formula as used in the sk-strings papers.  For N states and V symbols
+ * (the delimiter included), with t_j the number of times state j is
+ * left, n_ij the number of those on arc i and M_j the number of arcs,
+ *
+ *   MML = Sum_j [ log (t_j + V - 1)! / ((V - 1)! Prod_i n_ij!)
+ *                 + M_j log V ] + trancnt log N - log (N - 1)!
+ *
+ * The first term codes the strings' choice of arc at each state, as a
+ * multinomial with a uniform prior, the second the symbol of each arc,
+ * and the third its target, except for arcs on the delimiter, whose
+ * target is state 0 (see trancnt in pfsa.h).  The states other than 0
+ * may come in any order, hence the last term.  All logs are base 2.
+ * mml_dfa() counts the arcs on one symbol from a state as one arc, and
+ * mml_nfa() counts them apart.
+ */
+#include "pfsa.h"
+#include <math.h>
+#ifndef MML_C
+#define MML_C
+
+static double log2fact(int n)
+{
+    return lgamma(n + 1.0) / M_LN2;
+}
+
+/*
+ * The cost of the strings' choices of arc at p, and of the symbols of
+ * its arcs, for an alphabet of V.  With dfa, the arcs on one symbol are
+ * taken together.
+ */
+static double statecost(NODE *p, int V, int dfa, double *data)
+{
+    TRANS *tp;
+    double bits;
+    int n, m;
+
+    bits = log2fact(p->ntrans + V - 1) - log2fact(V - 1);
+    for (m = 0, tp = p->translist->next_tran; tp; tp = tp->next_tran, m++) {
+        n = tp->freq;
+        while (dfa && tp->next_tran && tp->next_tran->sym == tp->sym) {
+            tp = tp->next_tran;
+            n += tp->freq;
+        }
+        bits -= log2fact(n);
+    }
+    *data += bits;
+    return bits + m * log2((double) V);
+}
+
+static double pfsacost(NODE *pfsa, double *data, int dfa)
+{
+    NODE *p;
+    double bits = 0, strings = 0;
+    int N = nstates(pfsa), V = Nsyms - 1;
+
+    if (N > 0 && V > 0) {
+        for (p = pfsa->nextnode; p; p = p->nextnode)
+            bits += statecost(p, V, dfa, &strings);
+        bits += trancnt(pfsa) * log2((double) N) - log2fact(N - 1);
+    }
+    if (data)
+        *data = strings;
+    return bits;
+}
+
+/*
+ * The MML of pfsa in bits.  If data is not null, the part of it that
+ * codes the strings is put there.
+ */
+double mml_dfa(NODE *pfsa, double *data)
+{
+    return pfsacost(pfsa, data, 1);
+}
+
+double mml_nfa(NODE *pfsa, double *data)
+{
+    return pfsacost(pfsa, data, 0);
+}
+
+/*
+ * The cost, as statecost() has it, of the state that merging q into p
+ * makes, without making it.  Arcs to q become arcs to p, and then arcs
+ * on one symbol to one target are folded into one, as merge() folds
+ * them; *folded counts the folds that take an arc off trancnt.  Both
+ * translists are in symbol order, so they are walked side by side, and
+ * the few arcs on each symbol are compared pairwise.
+ */
+static double mergedstatecost(NODE *p, NODE *q, int V, int dfa, int *folded)
+{
+    TRANS *a = p->translist, *b = q->translist, *tk, *tl;
+    NODE *target;
+    double bits;
+    int i, j, na, nb, k, l, n, sym, m;
+
+    bits = log2fact(p->ntrans + q->ntrans + V - 1) - log2fact(V - 1);
+    for (m = 0, i = j = 1; i <= p->ntranslist || j <= q->ntranslist;
+            i += na, j += nb) {
+        if (j > q->ntranslist || (i <= p->ntranslist && a[i].sym < b[j].sym))
+            sym = a[i].sym;
+        else
+            sym = b[j].sym;
+        for (na = 0; i + na <= p->ntranslist && a[i + na].sym == sym; na++)
+            ;
+        for (nb = 0; j + nb <= q->ntranslist && b[j + nb].sym == sym; nb++)
+            ;
+        if (dfa) {
+            for (n = 0, k = 0; k < na + nb; k++)
+                n += k < na ? a[i + k].freq : b[j + k - na].freq;
+            bits -= log2fact(n);
+            m++;
+        }
+        for (k = 0; k < na + nb; k++) {
+            tk = k < na ? &a[i + k] : &b[j + k - na];
+            target = tk->target == q ? p : tk->target;
+            for (l = 0; l < k; l++) {
+                tl = l < na ? &a[i + l] : &b[j + l - na];
+                if ((tl->target == q ? p : tl->target) == target)
+                    break;
+            }
+            if (l < k) {		/* folded into the arc at l */
+                if (Symtab[sym].label[0] != Delim)
+                    (*folded)++;
+                continue;
+            }
+            if (dfa)
+                continue;
+            for (n = tk->freq, l = k + 1; l < na + nb; l++) {
+                tl = l < na ? &a[i + l] : &b[j + l - na];
+                if ((tl->target == q ? p : tl->target) == target)
+                    n += tl->freq;
+            }
+            bits -= log2fact(n);
+            m++;
+        }
+    }
+    return bits + m * log2((double) V);
+}
+
+/*
+ * The MML of pfsa if q were merged into p, given that it is oldmml now.
+ * Only the costs that the merge changes are worked out: those of p and
+ * q, which give way to the merged state, and those of the other states
+ * with arcs to q on a symbol on which they also go to p, whose two arcs
+ * become one.  With trancnt and N, which go down, that is all, so this
+ * takes time in proportion to the arcs of p and q and the sources of q,
+ * not to the size of the pfsa, and changes nothing.  It relies on the
+ * srclists being exact, as merge() does.
+ */
+static double mergedcost(NODE *pfsa, NODE *p, NODE *q, double oldmml, int dfa)
+{
+    SOURCE *sp;
+    TRANS *tp, *tq, *t;
+    double bits, data;
+    int N = nstates(pfsa), V = Nsyms - 1, folded = 0;
+
+    if (p == q || N < 2 || V < 1)
+        return oldmml;
+    bits = oldmml - statecost(p, V, dfa, &data) - statecost(q, V, dfa, &data);
+    bits += mergedstatecost(p, q, V, dfa, &folded);
+    for (sp = q->srclist->next_src; sp; sp = sp->next_src) {
+        if (sp->source == p || sp->source == q)
+            continue;
+        tp = tq = (TRANS *) 0;
+        for (t = firsttrans(sp->source, sp->sym); t && t->sym == sp->sym;
+                t = t->next_tran)
+            if (t->target == p)
+                tp = t;
+            else if (t->target == q)
+                tq = t;
+        if (!tp || !tq)
+            continue;
+        if (Symtab[sp->sym].label[0] != Delim)
+            folded++;
+        if (!dfa)		/* a dfa counts them together anyway */
+            bits += log2fact(tp->freq) + log2fact(tq->freq) -
+                    log2fact(tp->freq + tq->freq) - log2((double) V);
+    }
+    bits -= trancnt(pfsa) * log2((double) N) - log2fact(N - 1);
+    bits += (trancnt(pfsa) - folded) * log2((double) (N - 1)) - log2fact(N - 2);
+    return bits;
+}
+
+double mergedmml_dfa(NODE *pfsa, NODE *p, NODE *q, double oldmml)
+{
+    return mergedcost(pfsa, p, q, oldmml, 1);
+}
+
+double mergedmml_nfa(NODE *pfsa, NODE *p, NODE *q, double oldmml)
+{
+    return mergedcost(pfsa, p, q, oldmml, 0);
+}
+
+#endif /* MML_C */
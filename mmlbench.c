@@ -0,0 +1,95 @@
+/*
+ * File:   mmlbench.c
+ *
+ * Check and benchmark of mergedmml_nfa() and mergedmml_dfa().  For a
+ * pfsa file it takes n pairs of states at random (the same pairs for
+ * every run) and for each works out the MML the merge would give, both
+ * with mergedmml() and the slow way, by trymerge(), mml() of the whole
+ * pfsa and undomerge().  It reports the largest difference of the two,
+ * which should be rounding, and the time each way per pair.  Every
+ * tenth pair is then merged for good, so that the later pairs are
+ * scored on a pfsa that has had merges, as in a search.
+ *
+ * It is not part of the project build.  To build and run it:
+ *
+ *   cc -O2 -o mmlbench mmlbench.c -lm && ./mmlbench file.pfsa [n]
+ */
+
+#define MAIN
+#include <errno.h>
+#include <time.h>
+#include "pfsa.h"
+#include "misc.c"
+#include "mml.c"
+
+char *Prog = (char *) "mmlbench";
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    NODE **node, *p, *q, *r;
+    MERGELOG *log;
+    double old[2], fast[2], slow[2], diff[2], tfast, tslow, t;
+    int n, npairs, nnodes, i, j, dfa;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file.pfsa [pairs]\n", argv[0]);
+        return 1;
+    }
+    npairs = argc > 2 ? atoi(argv[2]) : 1000;
+    buildpfsa(argv[1]);
+    node = (NODE **) malloc((nstates(Pfsa) + 1) * sizeof (NODE *));
+    if (!node)
+        memerr();
+    printf("%d states, %d arcs, MML %.3f bits (dfa %.3f)\n", nstates(Pfsa),
+            trancnt(Pfsa), mml_nfa(Pfsa, (double *) 0),
+            mml_dfa(Pfsa, (double *) 0));
+    srand(1);
+    diff[0] = diff[1] = tfast = tslow = 0;
+    for (n = 0; n < npairs && nstates(Pfsa) > 1; n++) {
+        for (nnodes = 0, p = Pfsa->nextnode; p; p = p->nextnode)
+            node[nnodes++] = p;
+        i = rand() % nnodes;
+        while ((j = rand() % nnodes) == i)
+            ;
+        p = node[i < j ? i : j];
+        q = node[i < j ? j : i];
+        for (dfa = 0; dfa < 2; dfa++)
+            old[dfa] = dfa ? mml_dfa(Pfsa, (double *) 0) :
+                mml_nfa(Pfsa, (double *) 0);
+
+        t = now();
+        fast[0] = mergedmml_nfa(Pfsa, p, q, old[0]);
+        fast[1] = mergedmml_dfa(Pfsa, p, q, old[1]);
+        tfast += now() - t;
+
+        t = now();
+        log = trymerge(Pfsa, p, q);
+        slow[0] = mml_nfa(Pfsa, (double *) 0);
+        slow[1] = mml_dfa(Pfsa, (double *) 0);
+        undomerge(log);
+        tslow += now() - t;
+
+        for (dfa = 0; dfa < 2; dfa++)
+            if (fabs(fast[dfa] - slow[dfa]) > diff[dfa])
+                diff[dfa] = fabs(fast[dfa] - slow[dfa]);
+        for (r = Pfsa->nextnode; r && r != q; r = r->nextnode)
+            ;
+        if (!r) {
+            fprintf(stderr, "undomerge() lost state %d\n", q->state);
+            return 1;
+        }
+        if (n % 10 == 9)
+            merge(Pfsa, p, q);
+    }
+    printf("%d pairs, largest difference nfa %.3g bits, dfa %.3g bits\n",
+            n, diff[0], diff[1]);
+    printf("mergedmml %.3f us a pair, trymerge+mml+undomerge %.3f us\n",
+            tfast / n * 1e6, tslow / n * 1e6);
+    return diff[0] > 1e-6 || diff[1] > 1e-6;
+}
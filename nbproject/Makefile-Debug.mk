@@ -14,6 +14,7 @@ GREP=grep
 NM=nm
 CCADMIN=CCadmin
 RANLIB=ranlib
+OBJCOPY=objcopy
 CC=gcc
 CCC=g++
 CXX=g++
@@ -35,9 +36,11 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 
 # Object Files
 OBJECTFILES= \
-	${OBJECTDIR}/main.o \
-	${OBJECTDIR}/misc.o \
-	${OBJECTDIR}/skstr.o
+	${OBJECTDIR}/main.o
+
+# The library, see libpfsa.h
+LIBOBJECTFILES= \
+	${OBJECTDIR}/libpfsa.o
 
 
 # C Compiler Flags
@@ -54,11 +57,12 @@ FFLAGS=
 ASFLAGS=
 
 # Link Libraries and Options
-LDLIBSOPTIONS=
+LDLIBSOPTIONS=-lpthread
+LIBLDLIBSOPTIONS=-lm -lpthread
 
 # Build Targets
 .build-conf: ${BUILD_SUBPROJECTS}
-	"${MAKE}"  -f nbproject/Makefile-${CND_CONF}.mk ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/pfsa-fork
+	"${MAKE}"  -f nbproject/Makefile-${CND_CONF}.mk ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/pfsa-fork ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/libpfsa.a ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/libpfsa.${CND_DLIB_EXT}
 
 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/pfsa-fork: ${OBJECTFILES}
 	${MKDIR} -p ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}
@@ -69,15 +73,23 @@ ${OBJECTDIR}/main.o: main.cpp
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/main.o main.cpp
 
-${OBJECTDIR}/misc.o: misc.c 
-	${MKDIR} -p ${OBJECTDIR}
-	${RM} "$@.d"
-	$(COMPILE.c) -g -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/misc.o misc.c
+# The archive gets a copy of libpfsa.o with the hidden symbols made local,
+# as the shared library has them, so they cannot clash with the caller's.
+${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/libpfsa.a: ${LIBOBJECTFILES}
+	${MKDIR} -p ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}
+	${RM} ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/libpfsa.a
+	${OBJCOPY} --localize-hidden ${OBJECTDIR}/libpfsa.o ${OBJECTDIR}/libpfsa-a.o
+	${AR} -rv ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/libpfsa.a ${OBJECTDIR}/libpfsa-a.o
+	$(RANLIB) ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/libpfsa.a
+
+${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/libpfsa.${CND_DLIB_EXT}: ${LIBOBJECTFILES}
+	${MKDIR} -p ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}
+	${LINK.c} -shared -o ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/libpfsa.${CND_DLIB_EXT} ${LIBOBJECTFILES} ${LIBLDLIBSOPTIONS}
 
-${OBJECTDIR}/skstr.o: skstr.c 
+${OBJECTDIR}/libpfsa.o: libpfsa.c 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
-	$(COMPILE.c) -g -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/skstr.o skstr.c
+	$(COMPILE.c) -g -fPIC -fvisibility=hidden -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/libpfsa.o libpfsa.c
 
 # Subprojects
 .build-subprojects:
@@ -86,6 +98,8 @@ ${OBJECTDIR}/skstr.o: skstr.c
 .clean-conf: ${CLEAN_SUBPROJECTS}
 	${RM} -r ${CND_BUILDDIR}/${CND_CONF}
 	${RM} ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/pfsa-fork
+	${RM} ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/libpfsa.a
+	${RM} ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/libpfsa.${CND_DLIB_EXT}
 
 # Subprojects
 .clean-subprojects:
@@ -10,16 +10,24 @@
  * the state number, nsymbols stores the number of distinct symbols from that
  * state, ntrans stores the total number of transitions from that state, and
  * nvisits stores the total number of times this state is targeted by other
- * states.  Translist is a linked list of transitions again with a dummy
- * header.  Srclist (not implemented) is a list of states for which this
- * state is a target.  The mark field is used by various algorithms that use
- * this PFSA, see for instance beams.c.
+ * states.  Translist is the array of transitions from this state, and
+ * srclist the array of arcs into it (source, symbol, freq), both laid out
+ * as described below; merge() relies on the srclists mirroring the
+ * translists exactly.  The mark field is used by various algorithms that
+ * use this PFSA, see for instance beams.c.
  * state_list stores an ordered list of states from which this node was constructed.
  *   used only in beam search
  *   does not include the lowest state, which is stored in the state field.
  * In the root node (dummy header) of the pfsa, the state field should be
- * set to -1, ntrans stores the total number of states in the pfsa and
- * nsymbols stores the number of the maximum numbered state.
+ * set to -1 and hdr points to a PFSAHDR holding the number of states, the
+ * number of arcs and the maximum state number of the pfsa.
+ *
+ * Translist and srclist are no longer chains of individually allocated
+ * cells.  Each is a contiguous array owned by its node: element 0 is the
+ * dummy header, the live entries follow in sorted order, and next_tran
+ * (next_src) links each element to the one after it so that the old
+ * linked list traversals still work unchanged.  Only misc.c should add
+ * or remove entries, through addtrans(), merge() and trim().
  *
  * 24 Sep 96: I fixed this so that the transition count is not affected
  * by transitions on delimiter symbols.  The trancnt is mainly used in
@@ -30,11 +38,14 @@
 #ifndef PFSA_H
 #define PFSA_H
 #include <sys/types.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <setjmp.h>
 
 /*extern char yytext[];*/
 
@@ -63,6 +74,7 @@ typedef struct trans {
    int sym;			/* Really an index into Symtab where sym is */
    int freq;
    struct trans *next_tran;
+   u_long pmul;			/* freq / ntrans in fixed point, see tranprob() */
 } TRANS;
 
 typedef struct source {
@@ -72,6 +84,32 @@ typedef struct source {
    struct source *next_src;
 } SOURCE;
 
+/*
+ * Every node, transition and source array and state list cell of a
+ * pfsa is carved out of a POOL owned by the pfsa (see poolalloc() in
+ * misc.c), so that building, copying and deleting a pfsa takes a few
+ * large allocations rather than one per cell.  Freed cells go onto a
+ * free list for their size class and are reused by the same pfsa;
+ * nothing is returned to malloc until delpfsa() drops the blocks.
+ */
+#define NPOOLCLASSES 64
+
+typedef struct poolblk {
+   struct poolblk *next;
+   double align;		/* Cells start after this, suitably aligned */
+} POOLBLK;
+
+typedef struct pool {
+   POOLBLK *blocks;		/* All blocks of the pool */
+   char *bump;			/* Unused tail of the newest block */
+   size_t left;			/* # of bytes at bump */
+   size_t total;		/* # of bytes in all blocks */
+   void *cells[NPOOLCLASSES];	/* Free lists by size class */
+} POOL;
+
+/* Undo record of a speculative merge, see trymerge() in misc.c */
+typedef struct mergelog MERGELOG;
+
 /*
  * ntrans below should be equal to nvisits by kirchoff's law.  The
  * field is preserved for historical reasons.
@@ -83,100 +121,185 @@ typedef struct node {
    int ntrans;			/* # of transitions from this state */
    int nvisits;			/* # of times this state is visited */
    u_char mark;			/* To mark the node as visited in traversals */
-   TRANS *translist;            /* llist of targetnode, symbol (index to), and freq */
+   TRANS *translist;            /* array of targetnode, symbol (index to), and freq */
+   int ntranslist;		/* # of live entries in translist */
+   int translistsize;		/* # of entries allocated, incl. header */
+   int pshift;			/* Scale of the pmuls, 0 if they are stale */
    SOURCE *srclist;		/* To get at all source nodes */
+   int nsrclist;		/* # of live entries in srclist */
+   int srclistsize;		/* # of entries allocated, incl. header */
    STATE *state_list;     /* PONDY Ordered list of states merged into this node */
+   struct pfsahdr *hdr;		/* Root node only, see below */
+   POOL *pool;			/* Where this node's storage comes from */
    struct node *nextnode;
+   struct node *prevnode;	/* So that merge() can unlink in O(1) */
 } NODE;
 
 /*
- * For efficiency reasons, we use the ntrans field of the root node
- * of the pfsa to store its number of states and the nsymbols field
- * to store the maximum state number.  We also store the total number
- * of unique arcs (NOT ON DELIMITER SYMBOLS) in the whole pfsa
- * in the nvisits field of the root node.
+ * The counters for the whole pfsa live in a PFSAHDR hung off the root
+ * node.  They used to be squeezed into the ntrans, nsymbols and nvisits
+ * fields of the root, which is why the accessors below are macros.
+ * trancnt is the total number of unique arcs (NOT ON DELIMITER SYMBOLS)
+ * in the whole pfsa.  index maps a state number to its node (or null if
+ * there is no such state) and is kept up to date by misc.c whenever
+ * states are added, merged away, trimmed or renumbered.
  *
  * 23/9/96: For the purposes of MML, the transition count only includes
  * the total number of unique transitions not on the delimiter symbol.
  */
-#define incr_nodecnt(p) ((p)->ntrans++)
-#define decr_nodecnt(p) ((p)->ntrans--)
-#define nodecnt(p) ((p)->ntrans)
-#define nstates(p) ((p)->ntrans)
-#define incr_trancnt(p) ((p)->nvisits++)
-#define decr_trancnt(p) ((p)->nvisits--)
-#define trancnt(p) ((p)->nvisits)
-#define setmaxstatenum(p,n) ((p)->nsymbols=n)
-#define getmaxstatenum(p) ((p)->nsymbols)
-
-#ifndef MAXNODES
-# define MAXNODES 4096		/* Max nodes our dfa program can handle */
-#endif
+typedef struct pfsahdr {
+   int nstates;			/* # of states in the pfsa */
+   int trancnt;			/* # of unique non-delimiter arcs */
+   int maxstate;		/* Highest state number in use */
+   struct node **index;		/* State number -> node */
+   int indexsize;		/* # of slots allocated in index */
+   POOL pool;			/* Storage for the nodes and their lists */
+} PFSAHDR;
+
+#define incr_nodecnt(p) ((p)->hdr->nstates++)
+#define decr_nodecnt(p) ((p)->hdr->nstates--)
+#define nodecnt(p) ((p)->hdr->nstates)
+#define nstates(p) ((p)->hdr->nstates)
+#define incr_trancnt(p) ((p)->hdr->trancnt++)
+#define decr_trancnt(p) ((p)->hdr->trancnt--)
+#define trancnt(p) ((p)->hdr->trancnt)
+#define setmaxstatenum(p,n) ((p)->hdr->maxstate=n)
+#define getmaxstatenum(p) ((p)->hdr->maxstate)
+
+/* The PFSAHDR of the pfsa that node p is in, found through its pool */
+#define nodehdr(p) ((PFSAHDR *) ((char *) (p)->pool - offsetof(PFSAHDR, pool)))
+
+/*
+ * tranprob(p, tp, prob) is prob * tp->freq / p->ntrans, rounded down,
+ * for the arc tp out of p and any prob below 2^TPROBBITS.  It takes a
+ * multiply and a shift by the pmul and pshift that setprobs() keeps in
+ * the lists, and is exact, not an approximation: pmul is freq/ntrans
+ * rounded up to pshift bits, with pshift big enough that the error
+ * never reaches the next integer.  Where pshift is 0 (ntrans too big
+ * for 64 bits, or the arc counts changed since) it divides as before.
+ */
+#define TPROBBITS 17
+#define tranprob(p,tp,prob) ((p)->pshift ? \
+        ((prob) * (tp)->pmul) >> (p)->pshift : \
+        (prob) * (tp)->freq / (p)->ntrans)
+
+/*
+ * The binary pfsa file, written by writebpfsa() and read by buildpfsa()
+ * in place of the text format whenever a file starts with PFSABIN_MAGIC.
+ * It is a PFSABIN header followed by arrays of 32 bit integers:
+ *
+ *   labelend[nsyms]	 labels[] offset just past the label of symbol s+1
+ *   state[nstates]	 state numbers, ascending
+ *   first[nstates + 1]	 the arcs of state[i] are first[i] .. first[i+1]-1
+ *   target[narcs]	 index in state[] of the target of each arc
+ *   sym[narcs]		 symbol of each arc, 1 .. nsyms as in Symtab
+ *   freq[narcs]
+ *   labels		 the nsyms labels, each ending in a NUL
+ *
+ * The arcs of each state are in translist order.  Nothing in the file is
+ * a pointer, so a program can map it and use the arrays where they lie.
+ * Integers are in the byte order of the writer, which order records.
+ */
+#define PFSABIN_MAGIC "\177PFS"
+#define PFSABIN_VERSION 1
+#define PFSABIN_ORDER 0x01020304
 
-#define MAXSYMS 256
-#define MAXSYMSIZE 64
+typedef struct {
+   char magic[4];		/* PFSABIN_MAGIC, without the NUL */
+   u_int32_t version;		/* PFSABIN_VERSION */
+   u_int32_t order;		/* PFSABIN_ORDER */
+   u_int32_t nsyms;
+   u_int32_t nstates;
+   u_int32_t narcs;
+} PFSABIN;
+
+/*
+ * The symbol table.  Symtab grows as symbols are added and is indexed by
+ * symbol number; Nsyms is the number of slots in use, including the
+ * sentinel at 0.  Labels live in a string arena and are found through a
+ * hash index (see addsym() in misc.c), so there is no limit on the number
+ * of symbols or on the length of a label.
+ */
 typedef struct symbol {
-   char label[MAXSYMSIZE];
+   char *label;
    int freq;
 } SYMBOL;
 #define Sym(x)  (Symtab[x].label[0]=='\n'? "\\n" : Symtab[x].label)
 #define Freq(x) (Symtab[x].freq)
 #define DELIMITER 1		/* index of Delimiter symbol */
+
 /*
- * Allow MAXSYMS possible symbols. Set of symbols is initially empty.
+ * Everything the pfsa programs used to keep in globals lives in a
+ * CONTEXT: the symbol table, the pfsa being loaded, the options and
+ * the file names, and the scratch space of misc.c and of the learners.
+ * Ctx is the current context of the calling thread.  It starts out as
+ * Ctx0, so a program that never heard of contexts runs as it always
+ * did.  newcontext() makes another and usecontext() switches to it, so
+ * that several symbol tables, pfsas and learners can be used at once,
+ * one context to a thread at a time, without locks.  The old names of
+ * the globals are macros for the fields of *Ctx.  A thread that works
+ * on behalf of another (see ptablock() in misc.c and startpool() in
+ * skstr.c) must take on its context first.
+ *
+ * The fields up to callstring have initialisers in Ctx0, so their
+ * order matters.  The ones after pfsa are for misc.c only, and skstr
+ * is for skstr.c only.
  */
+typedef struct context {
+   char delim;
+   int lineno;
+   char infile[BUFSIZ], outfile[BUFSIZ];
+   char callstring[2 * BUFSIZ + 512];	/* See skheuristic() in skstr.c */
+   SYMBOL *symtab;
+   int nsyms;
+   int debug, graphplace, binary, verbose;
+   int tailsize;		/* For ktail.c and skstr.c */
+   NODE *pfsa;			/* Made by buildpfsa() and buildpta() */
+
+   int *symhash;		/* See addsym() */
+   unsigned symhashsize;
+   int symtabsize;
+   char *symarena, *symblocks;
+   size_t symarenaleft;
+   NODE **touched;		/* See domerge() */
+   int touchedsize;
+   struct timespec phase;	/* See phasetime() */
+   char fname[BUFSIZ];		/* For mkfname() */
+   int syms[BUFSIZ];		/* For toks2syms() */
+   char toks[BUFSIZ];		/* For syms2toks() */
+
+   void *loader;		/* See startload() */
+   void *skstr;			/* See skstr() */
+} CONTEXT;
+
+#define Symtab (Ctx->symtab)
+#define Nsyms (Ctx->nsyms)
+#define Lineno (Ctx->lineno)
+#define Pfsa (Ctx->pfsa)
+#define Debug (Ctx->debug)
+#define Graphplace (Ctx->graphplace)
+#define Binary (Ctx->binary)
+#define Delim (Ctx->delim)
+#define Verbose (Ctx->verbose)
+#define Tailsize (Ctx->tailsize)
+#define Infile (Ctx->infile)
+#define Outfile (Ctx->outfile)
+#define Callstring (Ctx->callstring)
+
 #ifdef MAIN
-   char *Author = "Author: Anand Raman, Department of Computer Science,\n"
+   const char *Author = "Author: Anand Raman, Department of Computer Science,\n"
                   "Massey University, Palmerston North, New Zealand.\n"
                   "Email: A.Raman@massey.ac.nz.\n"
                   "No warranties of any kind provided.\n"
                   "Studies using this program must cite it.\n";
 
-   SYMBOL Symtab[MAXSYMS] = {
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, 
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0},
-     {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0}, {"",0} 
-  };
-  int Lineno = 1;
-  NODE *Pfsa = (NODE *) 0;
-  int Debug = 0;
-  int Graphplace = 0;
-  char Delim = '\n';
-  int Verbose = 0;
+  CONTEXT Ctx0 = { '\n', 1, "-", "-", "opt" };
+  __thread CONTEXT *Ctx = &Ctx0;
+  __thread jmp_buf *Onerror = (jmp_buf *) 0;
 #else
-  extern SYMBOL Symtab[];
-  extern int Lineno, Debug, Graphplace, Verbose;
-  extern char Delim;
-  extern NODE *Pfsa;
+  extern CONTEXT Ctx0;
+  extern __thread CONTEXT *Ctx;
+  extern __thread jmp_buf *Onerror;	/* See bail() in misc.c */
 #endif
 
 extern int optind;
@@ -187,44 +310,62 @@ extern int isatty(int);
  * Return types of misc.c functions
  */
 void buildpfsa(char []);
+void buildpfsabuf(const char *, size_t);
+void buildpta(char [], int);
+void buildptabuf(const char *, size_t, int);
 void resetmaxstatenum(NODE *pfsa);
 void memerr(void);
 void Perror(char *); 
+void bail(int);
 void printpfsa(NODE *);
 void writepfsa(FILE *, NODE *);
+void writebpfsa(FILE *, NODE *);
 void output_pfsa(NODE *, char []);
 void delpfsa(NODE *);
 NODE *sortpfsa(NODE *);
-NODE *createnode(void);
-void statelimiterror(void);
+NODE *createpfsa(void);
+void *poolalloc(POOL *, size_t);
+void poolfree(POOL *, void *, size_t);
+NODE *createnode(NODE *);
 NODE *addnode(NODE *, int);
 void addtrans(NODE *, NODE *, int, int);
+void setprobs(NODE *);
 NODE *findnode(NODE *, int);
 int addsym(char []);
 int findsym(char []);
+int lookupsym(char []);
 void printsyms(int *);
 NODE *renumber(NODE *);
 NODE *bf_renumber(NODE *pfsa);
 NODE *copypfsa(NODE *);
 void merge(NODE *, NODE *, NODE *);
+MERGELOG *trymerge(NODE *, NODE *, NODE *);
+void undomerge(MERGELOG *);
+void keepmerge(MERGELOG *);
 int mealymerge(NODE *p1, NODE *p2);
 NODE *mergecopy(NODE *, NODE *, NODE *);
 NODE *newnode(NODE *);
 TRANS *findtrans(TRANS *, int); 
+TRANS *firsttrans(NODE *, int);
 int matchlen(NODE *, int *);
 TRANS *lfindtrans(TRANS *, int *); 
 int acceptable(NODE *, int *);
+double stringlogprob(NODE *, int *);
 char *mkfname(char *, char *);
 int *toks2syms(char *);
 char *syms2toks(int *);
 void onusr1(int);
+void phasetime(const char *);
 void clearmarks(NODE *);
+CONTEXT *newcontext(void);
+CONTEXT *usecontext(CONTEXT *);
+void freecontext(CONTEXT *);
 int isequiv(NODE *, NODE *);
    /* PONDY added this */
 int isequiv_unrealised(NODE *proot, NODE *p1, NODE *p2, NODE *qroot, NODE *q1, NODE *q2);
 NODE *trim(NODE *);
    /* PONDY added this */
-STATE *consStateNode(int state, STATE *next);
+STATE *consStateNode(NODE *pfsa, int state, STATE *next);
 
 /* int * functions equiv to the str * functions: Historical reasons */
 
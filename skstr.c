@@ -28,6 +28,15 @@
  * we need to ignore some strings at least.  The following heuristics
  * were looked at:
  *
+ * 16/10/26: It is possible after all, since the probability of a path
+ * can only go down as it is extended.  Paths are now taken best first
+ * off a heap (see kstrnext()), so strings come out in decreasing order
+ * of probability and are only made as far down the list as the AND,
+ * OR, LAX and STRICT tests read.  Heuristic 2 (Minprob) still bounds
+ * them.  The distance heuristics (XENTROPIC, VARDIST, HELLINGER and
+ * JSDIV) need every string, so they make the whole list at once as
+ * before.
+ *
  * Heuristic 1: At each state, choose transitions in decreasing order of
  * probability and stop when the maximum number of strings have been
  * built up from a state. This has the following disadvantage.  Suppose
@@ -80,40 +89,116 @@
 #define SKSTR_C
 #include "pfsa.h"
 #include <math.h>
+#include <pthread.h>
+#include "kvec.h"
 
 #define TAILSIZE 1
 #define AGREEPCT 50      /* What % of strings must agree before merging */
 #define PREC 1000        /* How many decimal places (/10) in percentages */
+                         /* 100 * PREC must be below 2^TPROBBITS, see tranprob() */
 #define MINPROB (1*PREC) /* reject strings less than 1% probable */
 #define MINENTROPY 0.5
 
 /*
- * The MAXSTR constant determines how many generated strings can be held
- * in the comparison buffer.  The default value is 1K. If MINPROB is set
- * to (100/MAXSTR)%,it ensures that the maximum number of strings generated
- * from a state is MAXSTR.
+ * KSBUDGET is the default for how many KB of strings may be held for
+ * any one state (see Ksbudget).  It used to be a fixed limit of 1000
+ * strings, past which the program gave up.
  */
-#define MAXSTR 1000
+#define KSBUDGET 1024
 
+/*
+ * The strings of a kstrList are stored end to end, each followed by a
+ * 0, in the one array buf, so that building a list takes no allocation
+ * per string.  kstr points into buf and len is the number of symbols.
+ *
+ * A list that is still being generated best first has a kstrgen (see
+ * kstrnext()).  Its ks[] then holds the most probable strings so far,
+ * in order, and kstrfill() makes more as they are asked for.
+ *
+ * mem is what the strings take up, each KSTRSIZE bytes, which is kept
+ * within Ksbudget by dropping the least probable ones.  Those of equal
+ * probability go together, so what is left is all the strings more
+ * probable than floor, and cut is set if any were dropped.  A list
+ * made whole turns bounded once it is full: ks[] is then a heap with
+ * the least probable string first (see keepstring()), and the last
+ * string added is held in ks[nstr] until the next one shows it is not
+ * a duplicate.  Dropped strings leave nhole ints unused in buf until
+ * it is next copied.
+ *
+ * For the distance heuristics, a finished list also has the string
+ * probabilities as doubles in pv, and in fv whatever function of them
+ * the distance needs, or pv again if none (see kstrvec()).
+ */
 typedef struct {
     int *kstr;
+    int len;
     u_long prob;
 } kstring;
 
+struct kstrgen;
+
 struct kstrList {
     kstring *ks;
-    int nstr;
+    int nstr, nks;		/* # of strings, slots in ks */
+    int *buf;
+    int nbuf, bufsize;		/* # of ints used, allocated in buf */
+    struct kstrgen *gen;	/* NULL once every string is in ks */
+    u_long mem, floor;
+    int nhole;
+    char bounded, held, cut;
+    double *pv, *fv;
+    u_long pass;		/* Npass when last looked up */
+};
+
+#define KSTRSIZE(len) (sizeof (kstring) + ((len) + 1) * sizeof (int))
+
+/*
+ * A path from the state a list is for is a chain of kpaths, each
+ * holding a symbol and the index of the one before it (or -1), all in
+ * one array.  A kitem is a path on the heap: p is the state it has got
+ * to, with k more symbols to go, or NULL if the path is a whole string.
+ * The heap is ordered by prob, and among equal probs the paths still
+ * to be followed come first, which is what lets kstrnext() give out
+ * the strings of a given prob as soon as one reaches the top.  s has
+ * room for the longest string, and sub holds those made by
+ * get_kstrList() below a state with two transitions on one symbol.
+ * Most lists are short, and are made and dropped again and again as
+ * states merge, so the arrays start out in the kstrgen itself.
+ */
+#define KGENLOCAL 16
+struct kpath {
+    int sym, up;
+};
+
+struct kitem {
+    u_long prob;
+    NODE *p;
+    int k, len, at;
+};
+
+struct kstrgen {
+    struct kpath *path;
+    int npath, pathsize;
+    struct kitem *heap;
+    int nheap, heapsize;
+    int *s;
+    struct kstrList sub;
+    struct kpath path0[2 * KGENLOCAL];
+    struct kitem heap0[KGENLOCAL];
+    int s0[KGENLOCAL];
 };
 
 
 /*
  * Externals
  */
-extern char *Prog, Outfile[], Infile[], Callstring[];
-extern int Tailsize; /* Defined in ktail.c */
+extern char *Prog;
 
 /*
- * Globals:
+ * The state of a run of skstr(), which used to be globals, is kept in
+ * an SKCTX hung off the current context (see pfsa.h), so that learners
+ * on different threads share none of it.  The old names of its fields
+ * are macros, defined along with it below.
  *
  * Agreepct is the percentage of the distribution of strings between
  * two states that must agree if they are to be merged.  The default is
@@ -128,55 +213,218 @@ extern int Tailsize; /* Defined in ktail.c */
  * to the string list for consideration)  This helps because the no.
  * of strings is exponential with tailsize.
  *
+ * Ksbudget is the most bytes of strings kept for a state, or 0 for no
+ * limit.  Past it only the most probable strings are kept, and
+ * Ksv_cut counts the lists so cut short, among those dropped from the
+ * cache.  The paths still to be followed in a list being made best
+ * first are not counted.
+ *
  * Ksv_cache is the cache of strings generated from a given state.
  * We need this since we may repeatedly require to access strings
- * from a state.  When a merge is done anywhere in the pfsa, the
- * cache needs to be flushed.
+ * from a state.  It is indexed by state number and grown by
+ * sizecache() as needed, Cache_size being the number of slots.  A
+ * merge only changes the strings of states upstream of the merged
+ * node, so only those entries are dropped (see invalidate_cache()).
+ * Npass counts the distinguishable merges, and so the passes of the
+ * search, and each entry notes the pass it was last looked up in.
+ * Skipfrom is the first state taken as p1 in this pass whose tests
+ * do_skstrings() cut short, or -1 (see inpass()).
+ * Cache_hits, Cache_misses and Cache_invalidations count lookups
+ * and dropped entries, and are reported by SIGUSR2 and in debug mode.
+ *
+ * Kdist is the distance the XENTROPIC, VARDIST, HELLINGER and JSDIV
+ * heuristics sum over the strings of two states (see kstrdist()), and
+ * KD_NONE for the others.
+ *
+ * The rest is bookkeeping for do_skstrings() so that it need not
+ * re-test pairs that cannot have changed since they were last found not
+ * to be mergeable.
+ * Every state whose strings (or whose neighbourhood as seen by
+ * acceptable()) a merge may have changed is appended to Changelog, and
+ * Changed[s] is the position just after the latest entry for state s.
+ * Scanned[s] is 1 + the length of Changelog when state s was last taken
+ * as p1, or 0 if it never was.  Changed and Scanned are indexed by
+ * state number and sized along with Ksv_cache.  Pair_tests counts the
+ * calls of Sk_mergeable.
+ *
+ * With -j, the tests of p1 against the candidate p2s are shared out
+ * among Nthreads threads (see testpairs()).  Each test is a pairtask.
+ * A test must not add to Ksv_cache while others are reading it, so the
+ * lists it has to build are kept in its task, and only moved into the
+ * cache afterwards if the serial search would have built them too.
+ * skdone() stops the workers.
  */
-int Agreepct = AGREEPCT;
-u_long Minprob = MINPROB;
-double MinEntropy = -1;
-struct kstrList **Ksv_cache = (struct kstrList **) NULL;
-int Cache_size = 0;
-char Heuristic[128] = "AND";
+struct pairtask {
+    NODE *p2;
+    int mergeable;
+    int nksv;			/* Lists built by this test, at most 2 */
+    int state[2];
+    struct kstrList *ksv[2];
+    int nhit;			/* Cached lists it looked up, likewise */
+    int hit[2];
+    u_long hits, misses;
+};
+
+struct pairpool {
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    pthread_key_t task;		/* Each thread's current pairtask */
+    NODE *p1;
+    struct pairtask *tasks;
+    int ntasks, next, found, busy;
+    u_long batch;		/* Bumped for each new lot of tasks */
+    int quit;			/* Set by skdone() */
+    pthread_t *worker;
+    int nworker;
+};
+
+typedef struct {
+    int agreepct;
+    u_long minprob;
+    double minentropy;
+    struct kstrList **ksv_cache;
+    int cache_size;
+    u_long cache_hits, cache_misses, cache_invalidations;
+    u_long ksbudget, ksv_cut;
+    int kdist;
+    u_long npass;
+    int skipfrom;
+    int *changed, *scanned, *changelog;
+    int nchangelog, changelogsize;
+    u_long pair_tests;
+    int nthreads;
+    struct pairpool pool;
+    char heuristic[128];
+    int corpus;			/* -s: Infile is a corpus, see buildpta() */
+    int (*sk_compare)(const void *, const void *);
+    int (*sk_mergeable)(int, NODE *, NODE *);
+    kvecfn kvec_sum;
+    double (*kvec_f)(double);
+    struct pairtask *task;	/* For do_skstrings() */
+    int tasksize;
+    int *cand, candsize;	/* For changedsince() */
+    int *stale, nstale, stalesize;	/* For invalidate_cache() */
+    NODE **queue;		/* For upstream() */
+    int queuesize;
+} SKCTX;
+
+#define Sk ((SKCTX *) Ctx->skstr)
+#define Agreepct (Sk->agreepct)
+#define Minprob (Sk->minprob)
+#define MinEntropy (Sk->minentropy)
+#define Ksv_cache (Sk->ksv_cache)
+#define Cache_size (Sk->cache_size)
+#define Cache_hits (Sk->cache_hits)
+#define Cache_misses (Sk->cache_misses)
+#define Cache_invalidations (Sk->cache_invalidations)
+#define Ksbudget (Sk->ksbudget)
+#define Ksv_cut (Sk->ksv_cut)
+#define Kdist (Sk->kdist)
+#define Npass (Sk->npass)
+#define Skipfrom (Sk->skipfrom)
+#define Changed (Sk->changed)
+#define Scanned (Sk->scanned)
+#define Changelog (Sk->changelog)
+#define Nchangelog (Sk->nchangelog)
+#define Changelogsize (Sk->changelogsize)
+#define Pair_tests (Sk->pair_tests)
+#define Nthreads (Sk->nthreads)
+#define Pool (Sk->pool)
+#define Heuristic (Sk->heuristic)
+#define Corpus (Sk->corpus)
+#define Sk_compare (Sk->sk_compare)
+#define Sk_mergeable (Sk->sk_mergeable)
+#define Kvec_sum (Sk->kvec_sum)
+#define Kvec_f (Sk->kvec_f)
 
 /*
  * local function prototypes
  */
-static int (*Sk_compare)(const void *, const void *);
+static void skinit(void);
+static void skdone(void);
+static int skheuristic(void);
 static int sk_compare_byProb(const void *, const void *);
 static int sk_compare_byStr(const void *, const void *);
 
 static NODE *do_skstrings(NODE *);
 int sk_distinguishable(NODE *p1, NODE *p2);
 int acceptlist(struct kstrList *, NODE *);
-void addstring(int [], u_long, struct kstrList *);
-void get_kstrList(int, NODE *, int [], u_long, struct kstrList *);
+void addstring(int [], int, u_long, struct kstrList *);
+static void appendstring(int [], int, u_long, struct kstrList *);
+static void keepstring(struct kstrList *);
+static int kstrworse(const kstring *, const kstring *);
+static void kstrsift(kstring *, int, int);
+static void kstrbuf(struct kstrList *, int);
+static void kstrreset(struct kstrList *);
+static void kstrdone(struct kstrList *);
+static u_long kstrmem(struct kstrList *);
+void get_kstrList(int, NODE *, int [], int, u_long, struct kstrList *);
+static int kstrcmp(const kstring *, const kstring *);
+static void kstrdfs(struct kstrList *, int, NODE *, int [], int, u_long);
+static void kstrtrim(struct kstrList *);
+static int kstrnext(struct kstrList *);
+static int kstrfill(struct kstrList *, int);
+static void kstrall(struct kstrList *);
+static int kitembefore(const struct kitem *, const struct kitem *);
+static void kpush(struct kstrgen *, u_long, NODE *, int, int, int);
+static void kpop(struct kstrgen *);
+static void *kgrow(void *, void *, int *, size_t);
+static int kpathadd(struct kstrgen *, int, int);
+static void freegen(struct kstrList *);
 void dispose_strs(struct kstrList *);
 void flush_cache(void);
+static void uncache(int);
+static int upstream(NODE *, int, NODE ***);
+static void invalidate_cache(NODE *, int, int);
+static int inpass(int);
+static void freeze_cache(NODE *, int);
+static void printcachestats(void);
+static u_long cutlists(void);
+static void sizecache(int);
+static void logchange(int);
+static int changedsince(NODE *, NODE *, int, int **);
+static int statecmpdesc(const void *, const void *);
+static int testpairs(NODE *, struct pairtask *, int);
+static void startpool(void);
+static void *pairworker(void *);
+static void runpairtasks(void);
 struct kstrList *get_sorted_kstrList(int k, NODE *p, int syms[], u_long prob);
 static void usage_skstr(char *);
 
 /* sk-string algorithms */
-static int (*Sk_mergeable)(int, NODE *, NODE *);
 static int skstr_or(int k, NODE *p, NODE *q);
 static int skstr_and(int k, NODE *p, NODE *q);
 static int skstr_lax(int k, NODE *p, NODE *q);
 static int skstr_strict(int k, NODE *p, NODE *q);
 static int skstr_xentropic(int k, NODE *p, NODE *q);
 static int skstr_vardist(int k, NODE *p, NODE *q);
+static int skstr_hellinger(int k, NODE *p, NODE *q);
+static int skstr_jsdiv(int k, NODE *p, NODE *q);
+static void kstrvec(struct kstrList *);
+static double kstrdist(int, NODE *, NODE *, double, double);
+static void kvecinit(void);
 static void onusr2(int);
 
 NODE *skstr(int argc,
         char **argv) {
+    static pthread_mutex_t optlock = PTHREAD_MUTEX_INITIALIZER;
+    NODE *pfsa;
+    char *heuristic = (char *) 0, *outfile = (char *) 0, *infile = (char *) 0;
     int c;
 
     setbuf(stderr, (char *) NULL);
+    skinit();
     Tailsize = TAILSIZE;
-    while ((c = getopt(argc, argv, "dvgD:o:m:t:p:e:hH:")) != EOF) {
+    /*
+     * getopt() keeps its place in globals, so one thread at a time, and
+     * it must start afresh each time: optind 0 tells glibc to.
+     */
+    pthread_mutex_lock(&optlock);
+    optind = 0;
+    while ((c = getopt(argc, argv, "dvgBsD:o:m:t:p:e:j:b:hH:")) != EOF) {
         switch (c) {
             case 'H':
-                strcpy(Heuristic, optarg);
+                heuristic = optarg;
                 break;
             case 'D':
                 Delim = optarg[0];
@@ -190,8 +438,14 @@ NODE *skstr(int argc,
             case 'g':
                 ++Graphplace;
                 break;
+            case 'B':
+                ++Binary;
+                break;
+            case 's':
+                ++Corpus;
+                break;
             case 'o':
-                strcpy(Outfile, optarg);
+                outfile = optarg;
                 break;
             case 'm':
                 Minprob = (u_long) (atof(optarg) * PREC);
@@ -214,6 +468,20 @@ NODE *skstr(int argc,
                     Tailsize = TAILSIZE;
                 }
                 break;
+            case 'b':
+                if (atol(optarg) < 0) {
+                    fprintf(stderr, "Illegal -b optarg reset to %d\n", KSBUDGET);
+                    Ksbudget = KSBUDGET * 1024L;
+                } else
+                    Ksbudget = atol(optarg) * 1024L;
+                break;
+            case 'j':
+                Nthreads = atoi(optarg);
+                if (Nthreads < 1) {
+                    fprintf(stderr, "Illegal -j optarg reset to 1\n");
+                    Nthreads = 1;
+                }
+                break;
             case 'p':
                 Agreepct = atoi(optarg);
                 if (Agreepct < 0 || Agreepct > 100) {
@@ -224,67 +492,173 @@ NODE *skstr(int argc,
                 break;
             case 'h':
             default:
+                pthread_mutex_unlock(&optlock);
                 usage_skstr(Prog);
-                exit(1);
+                bail(0);
                 break;
         }
     }
     if (argc > optind)
-        setfilenames(argv[optind]);
+        infile = argv[optind];
+    pthread_mutex_unlock(&optlock);
+
+    /* The names are kept in fixed buffers, in the context of this run */
+    if ((heuristic && strlen(heuristic) >= sizeof (Heuristic)) ||
+            (outfile && strlen(outfile) >= sizeof (Outfile)) ||
+            (infile && strlen(infile) >= sizeof (Infile))) {
+        fprintf(stderr, "%s: argument too long\n", Prog);
+        usage_skstr(Prog);
+        bail(0);
+    }
+    if (heuristic)
+        strcpy(Heuristic, heuristic);
+    if (outfile)
+        strcpy(Outfile, outfile);
+    if (infile) {
+        if (Corpus)
+            strcpy(Infile, infile);
+        else
+            setfilenames(infile);
+    }
+
+    if (skheuristic()) {
+        usage_skstr(Prog);
+        bail(0);
+    }
+
+    kvecinit();
+    signal(SIGUSR2, onusr2);
+    if (Corpus)
+        buildpta(Infile, Nthreads);
+    else
+        buildpfsa(Infile);
+    phasetime("load");
+    sizecache(getmaxstatenum(Pfsa));
+    pfsa = do_skstrings(Pfsa);
+    skdone();
+    return pfsa;
+}
+
+/*
+ * Set up for the heuristic named by Heuristic, or return -1 if there is
+ * no such heuristic.  Callstring, which heads the output, has room for
+ * the longest file names, so only an absurd Prog can overflow it.
+ */
+static int skheuristic(void) {
+    int n;
 
     Sk_compare = sk_compare_byProb;
     if (!strcasecmp(Heuristic, "or")) {
-        sprintf(Callstring, "%s -H %s %s%s-t %d -p %d -m %.2f -o %s %s", Prog,
-                Heuristic, Verbose ? "-v " : "", Debug ? "-d " : "", Tailsize,
-                Agreepct, ((double) Minprob) / PREC, Outfile, Infile);
         Sk_mergeable = skstr_or;
     } else if (!strcasecmp(Heuristic, "and")) {
         Sk_mergeable = skstr_and;
-        sprintf(Callstring, "%s -H %s %s%s-t %d -p %d -m %.2f -o %s %s", Prog,
-                Heuristic, Verbose ? "-v " : "", Debug ? "-d " : "", Tailsize,
-                Agreepct, ((double) Minprob) / PREC, Outfile, Infile);
     } else if (!strcasecmp(Heuristic, "lax")) {
         Sk_mergeable = skstr_lax;
-        sprintf(Callstring, "%s -H %s %s%s-t %d -p %d -m %.2f -o %s %s", Prog,
-                Heuristic, Verbose ? "-v " : "", Debug ? "-d " : "", Tailsize,
-                Agreepct, ((double) Minprob) / PREC, Outfile, Infile);
     } else if (!strcasecmp(Heuristic, "strict")) {
         Sk_mergeable = skstr_strict;
-        sprintf(Callstring, "%s -H %s %s%s-t %d -p %d -m %.2f -o %s %s", Prog,
-                Heuristic, Verbose ? "-v " : "", Debug ? "-d " : "", Tailsize,
-                Agreepct, ((double) Minprob) / PREC, Outfile, Infile);
     } else if (!strcasecmp(Heuristic, "xentropic")) {
         Agreepct = 100;
         Sk_mergeable = skstr_xentropic;
         Sk_compare = sk_compare_byStr;
+        Kdist = KD_XENT;
+        Kvec_f = log;
         if (MinEntropy < 0)
             MinEntropy = MINENTROPY;
-        sprintf(Callstring, "%s -H %s %s%s-t %d -e %.2f -m %.2f -o %s %s", Prog,
-                Heuristic, Verbose ? "-v " : "", Debug ? "-d " : "", Tailsize,
-                (double) MinEntropy, ((double) Minprob) / PREC, Outfile, Infile);
     } else if (!strcasecmp(Heuristic, "vardist")) {
         Agreepct = 100;
         Sk_mergeable = skstr_vardist;
         Sk_compare = sk_compare_byStr;
+        Kdist = KD_VAR;
+        if (MinEntropy < 0)
+            MinEntropy = MINENTROPY;
+    } else if (!strcasecmp(Heuristic, "hellinger")) {
+        Agreepct = 100;
+        Sk_mergeable = skstr_hellinger;
+        Sk_compare = sk_compare_byStr;
+        Kdist = KD_HELL;
+        Kvec_f = sqrt;
+        if (MinEntropy < 0)
+            MinEntropy = MINENTROPY;
+    } else if (!strcasecmp(Heuristic, "jsdiv")) {
+        Agreepct = 100;
+        Sk_mergeable = skstr_jsdiv;
+        Sk_compare = sk_compare_byStr;
+        Kdist = KD_JS;
+        Kvec_f = log;
         if (MinEntropy < 0)
             MinEntropy = MINENTROPY;
-        sprintf(Callstring, "%s -H %s %s%s-t %d -e %.2f -m %.2f -o %s %s", Prog,
+    } else
+        return -1;
+    if (Kdist == KD_NONE)
+        n = snprintf(Callstring, sizeof (Callstring),
+                "%s -H %s %s%s-t %d -p %d -m %.2f -o %s %s", Prog,
+                Heuristic, Verbose ? "-v " : "", Debug ? "-d " : "", Tailsize,
+                Agreepct, ((double) Minprob) / PREC, Outfile, Infile);
+    else
+        n = snprintf(Callstring, sizeof (Callstring),
+                "%s -H %s %s%s-t %d -e %.2f -m %.2f -o %s %s", Prog,
                 Heuristic, Verbose ? "-v " : "", Debug ? "-d " : "", Tailsize,
                 (double) MinEntropy, ((double) Minprob) / PREC, Outfile, Infile);
-    } else {
-        usage_skstr(Prog);
-        exit(1);
+    if (n < 0 || n >= (int) sizeof (Callstring)) {
+        fprintf(stderr, "%s: command line too long\n", Prog);
+        bail(0);
     }
+    return 0;
+}
 
-    signal(SIGUSR2, onusr2);
-    buildpfsa(Infile);
-    Ksv_cache = (struct kstrList **) calloc(nstates(Pfsa),
-            sizeof (struct kstrList *));
-    if (!Ksv_cache)
+/*
+ * Start a run with the defaults, and a fresh cache.
+ */
+static void skinit(void) {
+    SKCTX *sk;
+
+    skdone();
+    if (!(sk = (SKCTX *) calloc(1, sizeof (SKCTX))))
         memerr();
-    Cache_size = nstates(Pfsa);
-    return do_skstrings(Pfsa);
-    signal(SIGUSR2, SIG_DFL);
+    sk->agreepct = AGREEPCT;
+    sk->minprob = MINPROB;
+    sk->minentropy = -1;
+    sk->ksbudget = KSBUDGET * 1024L;
+    sk->kdist = KD_NONE;
+    sk->skipfrom = -1;
+    sk->nthreads = 1;
+    strcpy(sk->heuristic, "AND");
+    sk->kvec_sum = kvec_scalar;
+    Ctx->skstr = sk;
+}
+
+/*
+ * End the run: stop the pool and free the cache and the bookkeeping.
+ */
+static void skdone(void) {
+    int i;
+
+    if (!Sk)
+        return;
+    if (Pool.batch) {
+        pthread_mutex_lock(&Pool.lock);
+        Pool.quit = 1;
+        pthread_cond_broadcast(&Pool.work);
+        pthread_mutex_unlock(&Pool.lock);
+        for (i = 0; i < Pool.nworker; i++)
+            pthread_join(Pool.worker[i], (void **) NULL);
+        free(Pool.worker);
+        pthread_key_delete(Pool.task);
+        pthread_cond_destroy(&Pool.done);
+        pthread_cond_destroy(&Pool.work);
+        pthread_mutex_destroy(&Pool.lock);
+    }
+    flush_cache();
+    free(Ksv_cache);
+    free(Changed);
+    free(Scanned);
+    free(Changelog);
+    free(Sk->task);
+    free(Sk->cand);
+    free(Sk->stale);
+    free(Sk->queue);
+    free(Sk);
+    Ctx->skstr = (void *) NULL;
 }
 
 /*
@@ -306,47 +680,297 @@ int sk_distinguishable(NODE *p1, NODE *p2) {
     syms[0] = 0;
     ksv2 = get_sorted_kstrList(Tailsize, p2, syms, 100 * PREC);
 
-    if (ksv1->nstr != ksv2->nstr)
-        return 1;
-    for (i = 0; i < ksv1->nstr; i++) {
-        if (intcmp(ksv1->ks[i].kstr, ksv2->ks[i].kstr) ||
+    for (i = 0;; i++) {
+        if (kstrfill(ksv1, i) != kstrfill(ksv2, i))
+            return 1;
+        if (i >= ksv1->nstr)
+            return 0;
+        if (kstrcmp(&ksv1->ks[i], &ksv2->ks[i]) ||
                 ksv1->ks[i].prob != ksv2->ks[i].prob)
             return 1;
     }
-    return 0;
 }
 
+/*
+ * The search proper.  The states are taken in order as p1 and tested
+ * against every later state p2, merging where (*Sk_mergeable) says so.
+ * After a distinguishable merge, the search starts over from the first
+ * state.  The answer depends on that order, so it is kept as it was.
+ * But a test only reads the strings and transitions of states within
+ * Tailsize steps of p1 and p2, and a merge only changes those of the
+ * states invalidate_cache() visits, which are logged in Changelog.  So
+ * once p1 has been tested against all the states after it, a later
+ * pass need only test it against the states changed since then,
+ * unless p1 itself changed.  Those states are taken from the log in
+ * list (state) order, so the first mergeable pair found, and hence the
+ * result, is the same as testing them all.  A merge into p1 part way
+ * through a pass changes p1, so the rest of that pass tests every p2.
+ * The one place it may differ is which strings an indistinguishable
+ * merge leaves stale, as that depends on the lists the skipped tests
+ * would have looked up.  That is known but for AND (see inpass()), and
+ * under AND a later test may then see other strings and decide
+ * otherwise.
+ */
 static NODE *do_skstrings(NODE *pfsa) {
-    NODE *p1, *p2;
-    int restart = 0;
+    struct pairtask *task;
+    NODE *p1, *p2, *next;
+    int restart = 0, full, since, ncand = 0, *cand = (int *) 0, i, n;
 
+    if (Nthreads > 1)
+        startpool();
     for (p1 = pfsa->nextnode; p1; p1 = restart ? pfsa->nextnode : p1->nextnode) {
         restart = 0;
-        for (p2 = p1->nextnode; p2; p2 = p2->nextnode) {
+        since = Scanned[p1->state];
+        Scanned[p1->state] = Nchangelog + 1;
+        full = !since || Changed[p1->state] >= since;
+        if (full)
+            p2 = p1->nextnode;
+        else {
+            ncand = changedsince(pfsa, p1, since, &cand);
+            if (Skipfrom < 0)
+                Skipfrom = p1->state;
+        }
+
+        /* Line up the p2s to test, in order, then test them. */
+        for (n = 0;; n = 0) {
+            if (Sk->tasksize < nstates(pfsa)) {
+                Sk->tasksize = 2 * nstates(pfsa);
+                Sk->task = (struct pairtask *) realloc(Sk->task,
+                        Sk->tasksize * sizeof (struct pairtask));
+                if (!Sk->task)
+                    memerr();
+            }
+            task = Sk->task;
+            if (full)
+                for (; p2; p2 = p2->nextnode)
+                    task[n++].p2 = p2;
+            else
+                while (ncand > 0)
+                    task[n++].p2 = findnode(pfsa, cand[--ncand]);
+            i = testpairs(p1, task, n);
+            if (i == n)
+                break;
+            p2 = task[i].p2;
             if (Debug)
-                fprintf(stderr, "%d-equiv(%04d,%04d)?%s",
-                    Tailsize, p1->state, p2->state, isatty(2) ? "\r" : "\n");
-            if ((*Sk_mergeable)(Tailsize, p1, p2)) {
-                if (Debug)
-                    fprintf(stderr, "\nMerging %d & %d\n\n", p1->state, p2->state);
-                if (sk_distinguishable(p1, p2)) {
-                    merge(pfsa, p1, p2);
-                    flush_cache();
-                    restart = 1;
-                    break;
-                } else {
-                    dispose_strs(Ksv_cache[p2->state]);
-                    free((void *) Ksv_cache[p2->state]);
-                    Ksv_cache[p2->state] = (struct kstrList *) NULL;
-                    merge(pfsa, p1, p2);
-                }
+                fprintf(stderr, "\nMerging %d & %d\n\n", p1->state, p2->state);
+            if (sk_distinguishable(p1, p2)) {
+                uncache(p2->state);
+                merge(pfsa, p1, p2);
+                invalidate_cache(p1, Tailsize, 0);
+                Npass++;
+                Skipfrom = -1;
+                restart = 1;
+                break;
+            } else {
+                /* p1 has changed, so test it against the rest of
+                 * the states after p2 from here on. */
+                full = 1;
+                next = p2->nextnode;
+                freeze_cache(p1, Tailsize);
+                freeze_cache(p2, Tailsize);
+                uncache(p2->state);
+                merge(pfsa, p1, p2);
+                invalidate_cache(p1, Tailsize, 1);
+                p2 = next;
             }
         }
     }
+    if (Debug) {
+        printcachestats();
+        fprintf(stderr, "%lu pairs tested\n", Pair_tests);
+    }
+    if (cutlists())
+        fprintf(stderr, "Warning: the strings of some states would not fit in "
+                "%lu KB (-b), so only\nthe most probable were kept.  "
+                "Raise -m or -b to avoid this.\n", Ksbudget / 1024);
     pfsa = renumber(pfsa);
     return pfsa;
 }
 
+/*
+ * Test p1 against the n states of task[] in order and return the index
+ * of the first it is mergeable with, or n.  With more than one thread,
+ * the tests are handed out in order to the pool.  Once a mergeable
+ * pair is found, no tests beyond it are started, and the results of
+ * those already running are ignored, so the answer is that of the
+ * serial loop.  The lists built by tests up to and including the first
+ * mergeable one go into Ksv_cache, in order, and the rest are thrown
+ * away, so the cache also ends up as the serial loop would leave it.
+ * p1's own list is built first: every heuristic asks for it before
+ * anything else.  At debug level 2 and above the tests print, so they
+ * are always run in order on this thread.
+ */
+static int testpairs(NODE *p1, struct pairtask *task, int n) {
+    struct pairtask *t;
+    int i, j, m, syms[128];
+
+    if (Nthreads <= 1 || n < 2 || Debug > 1) {
+        for (i = 0; i < n; i++) {
+            if (Debug)
+                fprintf(stderr, "%d-equiv(%04d,%04d)?%s", Tailsize,
+                        p1->state, task[i].p2->state, isatty(2) ? "\r" : "\n");
+            Pair_tests++;
+            if ((*Sk_mergeable)(Tailsize, p1, task[i].p2))
+                break;
+        }
+        return i;
+    }
+
+    /* The threads all read p1's list, so it must not grow under them */
+    syms[0] = 0;
+    kstrall(get_sorted_kstrList(Tailsize, p1, syms, 100 * PREC));
+    for (i = 0; i < n; i++) {
+        task[i].nksv = task[i].nhit = 0;
+        task[i].hits = task[i].misses = 0;
+    }
+    pthread_mutex_lock(&Pool.lock);
+    Pool.p1 = p1;
+    Pool.tasks = task;
+    Pool.ntasks = n;
+    Pool.next = 0;
+    Pool.found = n;
+    Pool.batch++;
+    pthread_cond_broadcast(&Pool.work);
+    runpairtasks();
+    while (Pool.busy)
+        pthread_cond_wait(&Pool.done, &Pool.lock);
+    m = Pool.found;
+    pthread_mutex_unlock(&Pool.lock);
+
+    for (i = 0; i < n; i++) {
+        t = &task[i];
+        if (i <= m) {
+            if (Debug)
+                fprintf(stderr, "%d-equiv(%04d,%04d)?%s", Tailsize,
+                        p1->state, t->p2->state, isatty(2) ? "\r" : "\n");
+            Pair_tests++;
+            Cache_hits += t->hits;
+            Cache_misses += t->misses;
+            for (j = 0; j < t->nhit; j++)
+                Ksv_cache[t->hit[j]]->pass = Npass;
+        }
+        for (j = 0; j < t->nksv; j++) {
+            if (i <= m && !Ksv_cache[t->state[j]])
+                Ksv_cache[t->state[j]] = t->ksv[j];
+            else {
+                dispose_strs(t->ksv[j]);
+                free(t->ksv[j]);
+            }
+        }
+    }
+    return m;
+}
+
+/*
+ * Take tasks off the current lot until there are none left before the
+ * first mergeable one found so far.  Called, and returns, with
+ * Pool.lock held.
+ */
+static void runpairtasks(void) {
+    struct pairtask *t;
+    int i;
+
+    Pool.busy++;
+    while (Pool.next < Pool.found) {
+        i = Pool.next++;
+        t = &Pool.tasks[i];
+        pthread_mutex_unlock(&Pool.lock);
+        pthread_setspecific(Pool.task, t);
+        t->mergeable = (*Sk_mergeable)(Tailsize, Pool.p1, t->p2);
+        pthread_setspecific(Pool.task, (void *) NULL);
+        pthread_mutex_lock(&Pool.lock);
+        if (t->mergeable && i < Pool.found)
+            Pool.found = i;
+    }
+    if (!--Pool.busy)
+        pthread_cond_signal(&Pool.done);
+}
+
+static void *pairworker(void *arg) {
+    u_long seen = 0;
+
+    Ctx = (CONTEXT *) arg;
+    pthread_mutex_lock(&Pool.lock);
+    for (;;) {
+        while (Pool.batch == seen && !Pool.quit)
+            pthread_cond_wait(&Pool.work, &Pool.lock);
+        if (Pool.quit)
+            break;
+        seen = Pool.batch;
+        runpairtasks();
+    }
+    pthread_mutex_unlock(&Pool.lock);
+    return (void *) NULL;
+}
+
+/*
+ * Start Nthreads - 1 workers, in the context of this thread; it makes
+ * up the number.
+ */
+static void startpool(void) {
+    int i;
+
+    if (Pool.batch)
+        return;
+    Pool.batch = 1;
+    if (pthread_mutex_init(&Pool.lock, NULL) ||
+            pthread_cond_init(&Pool.work, NULL) ||
+            pthread_cond_init(&Pool.done, NULL) ||
+            pthread_key_create(&Pool.task, NULL))
+        Perror((char *) "pthread");
+    Pool.worker = (pthread_t *) malloc(Nthreads * sizeof (pthread_t));
+    if (!Pool.worker)
+        memerr();
+    for (i = 1; i < Nthreads; i++, Pool.nworker++)
+        if (pthread_create(&Pool.worker[Pool.nworker], NULL, pairworker, Ctx))
+            Perror((char *) "pthread_create");
+}
+
+/*
+ * Collect the states after p1 in the list (that is, with higher
+ * numbers) that are still in the pfsa and were logged as changed from
+ * position since of Changelog onwards.  Each is taken once, at its
+ * latest entry.  They are returned sorted in descending order, so that
+ * the caller can take them from the end in list order.
+ */
+static int changedsince(NODE *pfsa, NODE *p1, int since, int **candp) {
+    int i, n, s, *cand;
+
+    if (Sk->candsize < Nchangelog) {
+        Sk->candsize = 2 * Nchangelog;
+        Sk->cand = (int *) realloc(Sk->cand, Sk->candsize * sizeof (int));
+        if (!Sk->cand)
+            memerr();
+    }
+    cand = Sk->cand;
+    for (i = since - 1, n = 0; i < Nchangelog; i++) {
+        s = Changelog[i];
+        if (s > p1->state && Changed[s] == i + 1 && findnode(pfsa, s))
+            cand[n++] = s;
+    }
+    qsort((void *) cand, n, sizeof (int), statecmpdesc);
+    *candp = cand;
+    return n;
+}
+
+static int statecmpdesc(const void *p, const void *q) {
+    return *(const int *) q - *(const int *) p;
+}
+
+/*
+ * Note that state s may have changed, see do_skstrings().
+ */
+static void logchange(int s) {
+    if (Nchangelog == Changelogsize) {
+        Changelogsize = Changelogsize ? 2 * Changelogsize : 1024;
+        Changelog = (int *) realloc(Changelog, Changelogsize * sizeof (int));
+        if (!Changelog)
+            memerr();
+    }
+    Changelog[Nchangelog++] = s;
+    Changed[s] = Nchangelog;
+}
+
 static int sk_compare_byProb(const void *p, const void *q) /* Str is the secondary key */ {
     kstring *p1, *q1;
 
@@ -358,7 +982,7 @@ static int sk_compare_byProb(const void *p, const void *q) /* Str is the seconda
     else if (p1->prob > q1->prob)
         return -1;
 
-    return intcmp(p1->kstr, q1->kstr);
+    return kstrcmp(p1, q1);
 }
 
 static int sk_compare_byStr(const void *p, const void *q) /* Prob is the secondary key */ {
@@ -368,7 +992,7 @@ static int sk_compare_byStr(const void *p, const void *q) /* Prob is the seconda
     p1 = (kstring *) p;
     q1 = (kstring *) q;
 
-    diff = intcmp(p1->kstr, q1->kstr);
+    diff = kstrcmp(p1, q1);
     if (!diff)
         return (p1->prob == q1->prob ? 0 : (p1->prob < q1->prob ? 1 : -1));
     else
@@ -380,7 +1004,7 @@ int acceptlist(struct kstrList *ksv, NODE *p) /* Is the top Agreepct% of ksv acc
     int i;
 
     cutoff = 0;
-    for (i = 0; i < ksv->nstr; i++) {
+    for (i = 0; kstrfill(ksv, i); i++) {
         cutoff += ksv->ks[i].prob;
         if (!acceptable(p, ksv->ks[i].kstr))
             return 0;
@@ -390,55 +1014,223 @@ int acceptlist(struct kstrList *ksv, NODE *p) /* Is the top Agreepct% of ksv acc
     return 1;
 }
 
+/*
+ * Order strings as intcmp() would, but using their lengths rather than
+ * looking for the terminating 0.
+ */
+static int kstrcmp(const kstring *p, const kstring *q) {
+    int i, n;
+
+    n = p->len < q->len ? p->len : q->len;
+    for (i = 0; i < n; i++)
+        if (p->kstr[i] != q->kstr[i])
+            return p->kstr[i] - q->kstr[i];
+    return p->len - q->len;
+}
+
+/*
+ * Append the len symbols at s to ksv, or add prob to the last string if
+ * it is the same one.
+ */
 void addstring(int s[],
+        int len,
         u_long prob,
         struct kstrList *ksv) {
-    int *r;
+    kstring *last;
 
-    if (ksv->nstr > 0 && !intcmp(ksv->ks[ksv->nstr - 1].kstr, s)) {
-        ksv->ks[ksv->nstr - 1].prob += prob;
+    last = ksv->held ? &ksv->ks[ksv->nstr]
+            : ksv->nstr > 0 ? &ksv->ks[ksv->nstr - 1] : (kstring *) NULL;
+    if (last && last->len == len &&
+            !memcmp(last->kstr, s, len * sizeof (int))) {
+        last->prob += prob;
         return;
     }
-    r = intdup(s);
-    if (!r)
+    if (ksv->held)
+        keepstring(ksv);
+    appendstring(s, len, prob, ksv);
+}
+
+/*
+ * Add a string to the end of ksv, or hold it there if ksv is bounded.
+ * A list made whole is bounded once the string would take it over
+ * Ksbudget.  One made best first is cut short by kstrnext() instead.
+ */
+static void appendstring(int s[], int len, u_long prob, struct kstrList *ksv) {
+    kstring *ks;
+    int i;
+
+    if (!ksv->bounded && !ksv->gen && Ksbudget &&
+            ksv->mem + KSTRSIZE(len) > Ksbudget) {
+        for (i = ksv->nstr / 2 - 1; i >= 0; i--)
+            kstrsift(ksv->ks, ksv->nstr, i);
+        ksv->bounded = 1;
+    }
+    if (ksv->nbuf + len + 1 > ksv->bufsize) {
+        i = 2 * (ksv->nbuf - ksv->nhole + len + 1);
+        kstrbuf(ksv, i < 64 ? 64 : i);
+    }
+    if (ksv->nstr + 1 >= ksv->nks) {
+        ksv->nks = ksv->nks ? 2 * ksv->nks : 16;
+        ksv->ks = (kstring *) realloc(ksv->ks, ksv->nks * sizeof (kstring));
+        if (!ksv->ks)
+            memerr();
+    }
+    memcpy(&ksv->buf[ksv->nbuf], s, len * sizeof (int));
+    ks = &ksv->ks[ksv->nstr];
+    ks->kstr = &ksv->buf[ksv->nbuf];
+    ks->len = len;
+    ks->prob = prob;
+    ksv->nbuf += len;
+    ksv->buf[ksv->nbuf++] = 0;
+    ksv->mem += KSTRSIZE(len);
+    if (ksv->bounded)
+        ksv->held = 1;
+    else
+        ksv->nstr++;
+}
+
+/*
+ * Put the string held in a bounded list into its heap.  While that
+ * takes the list over Ksbudget, the floor is raised to the lowest
+ * probability among them and every string at or below it dropped.  So
+ * whatever the order the strings come in, the list ends up with the
+ * start of the whole list in sk_compare_byProb() order, up to the
+ * first probability whose strings do not all fit.
+ */
+static void keepstring(struct kstrList *ksv) {
+    kstring held, *ks = ksv->ks;
+    int i, up;
+
+    held = ks[ksv->nstr];
+    ksv->held = 0;
+    for (;;) {
+        if (held.prob <= ksv->floor) {
+            ksv->mem -= KSTRSIZE(held.len);
+            ksv->nhole += held.len + 1;
+            return;
+        }
+        if (ksv->mem <= Ksbudget)
+            break;
+        ksv->floor = ksv->nstr > 0 && ks[0].prob < held.prob
+                ? ks[0].prob : held.prob;
+        ksv->cut = 1;
+        while (ksv->nstr > 0 && ks[0].prob <= ksv->floor) {
+            ksv->mem -= KSTRSIZE(ks[0].len);
+            ksv->nhole += ks[0].len + 1;
+            ks[0] = ks[--ksv->nstr];
+            kstrsift(ks, ksv->nstr, 0);
+        }
+    }
+    for (i = ksv->nstr++; i > 0; i = up) {
+        up = (i - 1) / 2;
+        if (!kstrworse(&held, &ks[up]))
+            break;
+        ks[i] = ks[up];
+    }
+    ks[i] = held;
+}
+
+static int kstrworse(const kstring *p, const kstring *q) {
+    return p->prob < q->prob;
+}
+
+/*
+ * Sift ks[i] down the heap of the n strings at ks.
+ */
+static void kstrsift(kstring *ks, int n, int i) {
+    kstring k;
+    int c;
+
+    k = ks[i];
+    for (; (c = 2 * i + 1) < n; i = c) {
+        if (c + 1 < n && kstrworse(&ks[c + 1], &ks[c]))
+            c++;
+        if (!kstrworse(&ks[c], &k))
+            break;
+        ks[i] = ks[c];
+    }
+    ks[i] = k;
+}
+
+/*
+ * Move the strings of ksv, and any held, into a new buf of size ints,
+ * leaving out the holes.  Not realloc(), as the strings must all be
+ * re-pointed.
+ */
+static void kstrbuf(struct kstrList *ksv, int size) {
+    int *buf, i, n;
+
+    buf = (int *) malloc(size * sizeof (int));
+    if (!buf)
         memerr();
-    ksv->ks[ksv->nstr].kstr = r;
-    ksv->ks[ksv->nstr].prob = prob;
-    ksv->nstr++;
-    if (ksv->nstr == MAXSTR) {
-        fprintf(stderr, "Fatal Error:\n");
-        fprintf(stderr, "Too many strings are being considered (%d)\n", MAXSTR);
-
-        fprintf(stderr,
-                "Consider limiting this by increasing the value of the Minprob parameter\n"
-                "which determines the least probability a string should have, to be\n"
-                "considered.  A setting of -m %.2f ensures that a maximum of %d strings\n"
-                "will be considered\n\n", 100.0 / MAXSTR, MAXSTR);
-
-        fprintf(stderr,
-                "Alternatively, you may try recompiling this program with a larger value\n"
-                "of MAXSTR (currently %d) to allow more strings to be considered, but be\n"
-                "aware that the number of strings is exponential in tailsize and must be\n"
-                "limited with the MINPROB parameter (currently %.2f)\n",
-                MAXSTR, ((double) Minprob) / PREC);
-
-        exit(1);
+    for (i = n = 0; i < ksv->nstr + ksv->held; i++) {
+        memcpy(&buf[n], ksv->ks[i].kstr, (ksv->ks[i].len + 1) * sizeof (int));
+        ksv->ks[i].kstr = &buf[n];
+        n += ksv->ks[i].len + 1;
     }
-    return;
+    free(ksv->buf);
+    ksv->buf = buf;
+    ksv->bufsize = size;
+    ksv->nbuf = n;
+    ksv->nhole = 0;
+}
+
+/*
+ * Empty ksv, keeping its arrays, to be filled again.
+ */
+static void kstrreset(struct kstrList *ksv) {
+    ksv->nstr = ksv->nbuf = ksv->nhole = 0;
+    ksv->bounded = ksv->held = ksv->cut = 0;
+    ksv->mem = ksv->floor = 0;
+}
+
+/*
+ * Called when a list made whole is complete.
+ */
+static void kstrdone(struct kstrList *ksv) {
+    if (ksv->held)
+        keepstring(ksv);
 }
 
+/*
+ * The bytes allocated to ksv, including a kstrgen and its arrays.
+ */
+static u_long kstrmem(struct kstrList *ksv) {
+    struct kstrgen *g = ksv->gen;
+    u_long n;
+
+    n = sizeof (struct kstrList) + ksv->nks * sizeof (kstring) +
+            ksv->bufsize * sizeof (int);
+    if (ksv->pv)
+        n += (ksv->fv != ksv->pv ? 2 : 1) * ksv->nks * sizeof (double);
+    if (g) {
+        n += sizeof (struct kstrgen) + g->sub.nks * sizeof (kstring) +
+                g->sub.bufsize * sizeof (int);
+        if (g->heap != g->heap0)
+            n += g->heapsize * sizeof (struct kitem);
+        if (g->path != g->path0)
+            n += g->pathsize * sizeof (struct kpath);
+    }
+    return n;
+}
+
+/*
+ * s holds the len symbols of the path to p so far, and has room for k
+ * more.  Each transition followed is written in place at s[len], so a
+ * single buffer serves the whole walk.
+ */
 void get_kstrList(int k,
         NODE *p,
         int s[],
+        int len,
         u_long prob,
         struct kstrList *ksv) {
     u_long newprob;
-    int syms[128];
     TRANS *tp;
 
     if (k == 0) {
-        if (s[0])
-            addstring(s, prob, ksv);
+        if (len)
+            addstring(s, len, prob, ksv);
         return;
     }
 
@@ -449,15 +1241,14 @@ void get_kstrList(int k,
      * above.
      */
     for (tp = p->translist->next_tran; tp; tp = tp->next_tran) {
-        intcpy(syms, s);
-        intcat(syms, tp->sym);
-        newprob = prob * tp->freq / p->ntrans;
+        s[len] = tp->sym;
+        newprob = tranprob(p, tp, prob);
         if (newprob < Minprob)
             return;
         if (Symtab[tp->sym].label[0] == Delim)
-            addstring(syms, newprob, ksv);
+            addstring(s, len + 1, newprob, ksv);
         else
-            get_kstrList(k - 1, tp->target, syms, newprob, ksv);
+            get_kstrList(k - 1, tp->target, s, len + 1, newprob, ksv);
     }
     return;
 }
@@ -474,58 +1265,549 @@ void printstrings(struct kstrList *ksv) {
     }
 }
 
-struct kstrList *get_sorted_kstrList(int k, NODE *p, int syms[], u_long prob) {
-    struct kstrList *ksv;
+/*
+ * Make sure the cache has a slot for state number n.  It is indexed by
+ * state number, so it grows with the highest state rather than being
+ * fixed in size.
+ */
+static void sizecache(int n) {
+    int size;
 
-    if (!Ksv_cache) {
-        Ksv_cache = (struct kstrList **) calloc(MAXNODES, sizeof (struct kstrList *));
-        if (!Ksv_cache)
-            memerr();
-        Cache_size = MAXNODES;
-    }
+    if (n < Cache_size)
+        return;
+    for (size = Cache_size ? Cache_size : 64; size <= n; size *= 2)
+        ;
+    Ksv_cache = (struct kstrList **) realloc(Ksv_cache,
+            size * sizeof (struct kstrList *));
+    Changed = (int *) realloc(Changed, size * sizeof (int));
+    Scanned = (int *) realloc(Scanned, size * sizeof (int));
+    if (!Ksv_cache || !Changed || !Scanned)
+        memerr();
+    memset(&Ksv_cache[Cache_size], 0,
+            (size - Cache_size) * sizeof (struct kstrList *));
+    memset(&Changed[Cache_size], 0, (size - Cache_size) * sizeof (int));
+    memset(&Scanned[Cache_size], 0, (size - Cache_size) * sizeof (int));
+    Cache_size = size;
+}
 
-    if (Ksv_cache && Ksv_cache[p->state])
+/*
+ * Inside a test run by testpairs() on the pool, Ksv_cache is only read.
+ * A list not in it is built and kept in the thread's pairtask instead.
+ */
+struct kstrList *get_sorted_kstrList(int k, NODE *p, int syms[], u_long prob) {
+    struct kstrList *ksv;
+    struct kstrgen *g;
+    struct pairtask *t;
+    int i, len, at;
+
+    t = Pool.batch ? (struct pairtask *) pthread_getspecific(Pool.task)
+            : (struct pairtask *) NULL;
+    if (!t)
+        sizecache(p->state);
+    if (Ksv_cache[p->state]) {
+        if (t) {
+            t->hits++;
+            if (t->nhit < 2)
+                t->hit[t->nhit++] = p->state;
+        } else {
+            Cache_hits++;
+            Ksv_cache[p->state]->pass = Npass;
+        }
         return Ksv_cache[p->state];
+    }
+    if (t) {
+        for (i = 0; i < t->nksv; i++)
+            if (t->state[i] == p->state) {
+                t->hits++;
+                return t->ksv[i];
+            }
+        if (t->nksv == 2) {
+            fprintf(stderr, "A test may build the lists of two states only\n");
+            bail(0);
+        }
+        t->misses++;
+    } else
+        Cache_misses++;
 
     ksv = (struct kstrList *) calloc(1, sizeof (struct kstrList));
     if (!ksv)
         memerr();
-    ksv->ks = (kstring *) calloc((int) (100L * PREC / Minprob),
-            sizeof (kstring));
-    if (!ksv->ks)
-        memerr();
-    ksv->nstr = 0;
-    get_kstrList(k, p, syms, prob, ksv);
-    qsort((void *) ksv->ks, ksv->nstr, sizeof (kstring), Sk_compare);
-    Ksv_cache[p->state] = ksv;
+    ksv->pass = Npass;
+    len = intlen(syms);
+    /*
+     * Only lists in order of probability can be made best first, and
+     * at debug level 2 they are printed whole as soon as they are made.
+     */
+    if (Sk_compare != sk_compare_byProb || Debug > 1)
+        kstrdfs(ksv, k, p, syms, len, prob);
+    else {
+        g = (struct kstrgen *) malloc(sizeof (struct kstrgen));
+        if (!g)
+            memerr();
+        g->path = g->path0;
+        g->heap = g->heap0;
+        g->s = g->s0;
+        g->npath = g->nheap = 0;
+        g->pathsize = 2 * KGENLOCAL;
+        g->heapsize = KGENLOCAL;
+        memset(&g->sub, 0, sizeof (struct kstrList));
+        if (len + k + 1 > KGENLOCAL &&
+                !(g->s = (int *) malloc((len + k + 1) * sizeof (int))))
+            memerr();
+        ksv->gen = g;
+        for (i = 0, at = -1; i < len; i++)
+            at = kpathadd(g, syms[i], at);
+        if (k > 0)
+            kpush(g, prob, p, k, len, at);
+        else if (len)
+            kpush(g, prob, (NODE *) NULL, 0, len, at);
+    }
+    if (t) {
+        t->state[t->nksv] = p->state;
+        t->ksv[t->nksv++] = ksv;
+    } else
+        Ksv_cache[p->state] = ksv;
     if (Debug > 1) {
-        fprintf(stderr, "Strings from state %d\n", p->state);
+        fprintf(stderr, "Strings from state %d (%d, %lu bytes%s)\n", p->state,
+                ksv->nstr, kstrmem(ksv), ksv->cut ? ", cut short" : "");
         printstrings(ksv);
     }
     return ksv;
 }
 
-void dispose_strs(struct kstrList *ksv) {
-    while (ksv->nstr > 0) {
-        --ksv->nstr;
-        free((void *) ksv->ks[ksv->nstr].kstr);
+/*
+ * Make the whole list of strings from p at once, as get_sorted_kstrList()
+ * always used to.  syms holds the len symbols of the prefix.
+ */
+static void kstrdfs(struct kstrList *ksv, int k, NODE *p, int syms[],
+        int len, u_long prob) {
+    int path[128], *s;
+
+    kstrreset(ksv);
+    s = path;
+    if (len + k + 1 > 128 && !(s = (int *) malloc((len + k + 1) * sizeof (int))))
+        memerr();
+    memcpy(s, syms, len * sizeof (int));
+    get_kstrList(k, p, s, len, prob, ksv);
+    if (s != path)
+        free(s);
+    kstrdone(ksv);
+    qsort((void *) ksv->ks, ksv->nstr, sizeof (kstring), Sk_compare);
+    kstrtrim(ksv);
+    if (Kdist != KD_NONE)
+        kstrvec(ksv);
+}
+
+/*
+ * A finished list is kept in the cache, so give back the unused slots,
+ * and the holes left by any strings dropped.
+ */
+static void kstrtrim(struct kstrList *ksv) {
+    if (ksv->nhole)
+        kstrbuf(ksv, ksv->nbuf - ksv->nhole);
+    ksv->nks = ksv->nstr + 1;
+    ksv->ks = (kstring *) realloc(ksv->ks, ksv->nks * sizeof (kstring));
+    if (!ksv->ks)
+        memerr();
+}
+
+/*
+ * Add the next strings of a list being made best first, and return 0
+ * if there were none left.  Probabilities only go down along a path,
+ * so once a whole string is at the top of the heap no other string can
+ * come before it, nor before any other at the top with the same prob.
+ * Those are added together and put in order of symbols, as
+ * sk_compare_byProb() would.  Each path is extended as get_kstrList()
+ * would, in transition order and up to the first below Minprob.
+ *
+ * get_kstrList() adds up duplicate strings that are next to each
+ * other, which can only happen below a state with two transitions on
+ * the same symbol.  Rather than copy that, all the strings on from such
+ * a state are made by get_kstrList() and go on the heap whole, and are
+ * only appended when they come off it, duplicates or not.  Every
+ * state before it on the path has one transition per symbol, so the
+ * strings that get_kstrList() would make just before and after these
+ * differ from them, and nothing else would be added up.
+ */
+static int kstrnext(struct kstrList *ksv) {
+    struct kstrgen *g = ksv->gen;
+    struct kitem top;
+    TRANS *tp;
+    u_long newprob;
+    int n, i, at, prev;
+
+    if (!g)
+        return 0;
+    while (g->nheap > 0) {
+        top = g->heap[0];
+        if (!top.p) {
+            for (n = ksv->nstr; g->nheap > 0 && !g->heap[0].p &&
+                    g->heap[0].prob == top.prob;) {
+                top = g->heap[0];
+                kpop(g);
+                for (i = top.len, at = top.at; i > 0; at = g->path[at].up)
+                    g->s[--i] = g->path[at].sym;
+                appendstring(g->s, top.len, top.prob, ksv);
+            }
+            qsort((void *) &ksv->ks[n], ksv->nstr - n, sizeof (kstring),
+                    sk_compare_byProb);
+            if (Ksbudget && ksv->mem > Ksbudget) {
+                /* These and the rest are all less probable, so stop */
+                ksv->floor = top.prob;
+                while (ksv->nstr > n) {
+                    --ksv->nstr;
+                    ksv->mem -= KSTRSIZE(ksv->ks[ksv->nstr].len);
+                    ksv->nhole += ksv->ks[ksv->nstr].len + 1;
+                }
+                ksv->cut = 1;
+                freegen(ksv);
+                kstrtrim(ksv);
+                return ksv->nstr > n;
+            }
+            return 1;
+        }
+        kpop(g);
+        prev = -1;
+        for (tp = top.p->translist->next_tran; tp; tp = tp->next_tran) {
+            if (tranprob(top.p, tp, top.prob) < Minprob)
+                break;
+            if (tp->sym == prev)
+                break;
+            prev = tp->sym;
+        }
+        if (tp && tp->sym == prev &&
+                tranprob(top.p, tp, top.prob) >= Minprob) {
+            for (i = top.len, at = top.at; i > 0; at = g->path[at].up)
+                g->s[--i] = g->path[at].sym;
+            kstrreset(&g->sub);
+            get_kstrList(top.k, top.p, g->s, top.len, top.prob, &g->sub);
+            kstrdone(&g->sub);
+            if (g->sub.cut)
+                ksv->cut = 1;
+            for (n = 0; n < g->sub.nstr; n++) {
+                for (i = top.len, at = top.at; i < g->sub.ks[n].len; i++)
+                    at = kpathadd(g, g->sub.ks[n].kstr[i], at);
+                kpush(g, g->sub.ks[n].prob, (NODE *) NULL, 0,
+                        g->sub.ks[n].len, at);
+            }
+            continue;
+        }
+        for (tp = top.p->translist->next_tran; tp; tp = tp->next_tran) {
+            newprob = tranprob(top.p, tp, top.prob);
+            if (newprob < Minprob)
+                break;
+            at = kpathadd(g, tp->sym, top.at);
+            if (Symtab[tp->sym].label[0] == Delim || top.k == 1)
+                kpush(g, newprob, (NODE *) NULL, 0, top.len + 1, at);
+            else
+                kpush(g, newprob, tp->target, top.k - 1, top.len + 1, at);
+        }
     }
+    freegen(ksv);
+    kstrtrim(ksv);
+    return 0;
+}
+
+/*
+ * Is there an i'th string in the list?  Makes it if need be.
+ */
+static int kstrfill(struct kstrList *ksv, int i) {
+    while (i >= ksv->nstr && kstrnext(ksv))
+        ;
+    return i < ksv->nstr;
+}
+
+/*
+ * Finish the list.
+ */
+static void kstrall(struct kstrList *ksv) {
+    while (kstrnext(ksv))
+        ;
+}
+
+static int kitembefore(const struct kitem *a, const struct kitem *b) {
+    if (a->prob != b->prob)
+        return a->prob > b->prob;
+    return a->p && !b->p;
+}
+
+static void kpush(struct kstrgen *g, u_long prob, NODE *p, int k, int len, int at) {
+    struct kitem it;
+    int i, up;
+
+    if (g->nheap == g->heapsize)
+        g->heap = (struct kitem *) kgrow(g->heap, g->heap0, &g->heapsize,
+            sizeof (struct kitem));
+    it.prob = prob;
+    it.p = p;
+    it.k = k;
+    it.len = len;
+    it.at = at;
+    for (i = g->nheap++; i > 0; i = up) {
+        up = (i - 1) / 2;
+        if (!kitembefore(&it, &g->heap[up]))
+            break;
+        g->heap[i] = g->heap[up];
+    }
+    g->heap[i] = it;
+}
+
+/*
+ * Remove the top of the heap.
+ */
+static void kpop(struct kstrgen *g) {
+    struct kitem it;
+    int i, c;
+
+    it = g->heap[--g->nheap];
+    for (i = 0; (c = 2 * i + 1) < g->nheap; i = c) {
+        if (c + 1 < g->nheap && kitembefore(&g->heap[c + 1], &g->heap[c]))
+            c++;
+        if (!kitembefore(&g->heap[c], &it))
+            break;
+        g->heap[i] = g->heap[c];
+    }
+    g->heap[i] = it;
+}
+
+static int kpathadd(struct kstrgen *g, int sym, int up) {
+    if (g->npath == g->pathsize)
+        g->path = (struct kpath *) kgrow(g->path, g->path0, &g->pathsize,
+            sizeof (struct kpath));
+    g->path[g->npath].sym = sym;
+    g->path[g->npath].up = up;
+    return g->npath++;
+}
+
+/*
+ * Double the size of an array of a kstrgen, which may still be the one
+ * in the kstrgen itself.
+ */
+static void *kgrow(void *a, void *local, int *size, size_t elsize) {
+    void *b;
+
+    if (a == local) {
+        if ((b = malloc(2 * *size * elsize)))
+            memcpy(b, a, *size * elsize);
+    } else
+        b = realloc(a, 2 * *size * elsize);
+    if (!b)
+        memerr();
+    *size *= 2;
+    return b;
+}
+
+static void freegen(struct kstrList *ksv) {
+    struct kstrgen *g = ksv->gen;
+
+    if (!g)
+        return;
+    if (g->path != g->path0)
+        free(g->path);
+    if (g->heap != g->heap0)
+        free(g->heap);
+    if (g->s != g->s0)
+        free(g->s);
+    dispose_strs(&g->sub);
+    free(g);
+    ksv->gen = (struct kstrgen *) NULL;
+}
+
+void dispose_strs(struct kstrList *ksv) {
+    freegen(ksv);
+    kstrreset(ksv);
+    ksv->nks = ksv->bufsize = 0;
+    free((void *) ksv->buf);
     free((void *) ksv->ks);
+    ksv->buf = (int *) NULL;
     ksv->ks = (kstring *) NULL;
+    free((void *) ksv->pv);
+    ksv->pv = ksv->fv = (double *) NULL;
 }
 
 void flush_cache(void) {
     int i;
 
-    for (i = 0; i < Cache_size; i++) {
-        if (!Ksv_cache[i])
+    for (i = 0; i < Cache_size; i++)
+        uncache(i);
+}
+
+/*
+ * Drop the cached strings of the given state, if any.
+ */
+static void uncache(int state) {
+    if (state >= Cache_size || !Ksv_cache[state])
+        return;
+    if (Ksv_cache[state]->cut)
+        Ksv_cut++;
+    dispose_strs(Ksv_cache[state]);
+    free(Ksv_cache[state]);
+    Ksv_cache[state] = (struct kstrList *) NULL;
+    Cache_invalidations++;
+}
+
+/*
+ * Drop the cached strings of every state that may have changed after
+ * merging into p.  The k-strings of a state q are read off the
+ * transitions of the states less than k steps from q.  A merge changes
+ * the transitions of p itself and of the states that had the merged
+ * away node as a target, which are now p's sources.  So every state
+ * that can reach p in k steps or less is dropped (see upstream()).
+ * Arcs on the delimiter are skipped since get_kstrList() never follows
+ * them, which also keeps a merge into state 0 from dropping the whole
+ * cache.
+ *
+ * After merging indistinguishable states do_skstrings() has always
+ * carried on with the cached strings upstream as they were, and only
+ * flushed them at the next distinguishable merge.  To give the same
+ * answers, such a merge calls this with defer set, which only notes
+ * the states in a stale list, to be dropped at the next call without.
+ * But the flush would have emptied the cache at the start of the pass,
+ * so only the entries looked up in this pass would have been there to
+ * go stale.  Any others are kept from an earlier pass and dropped now.
+ */
+static void invalidate_cache(NODE *p, int k, int defer) {
+    NODE **queue;
+    int i, n;
+
+    if (!defer) {
+        while (Sk->nstale > 0) {
+            logchange(Sk->stale[--Sk->nstale]);
+            uncache(Sk->stale[Sk->nstale]);
+        }
+    }
+    n = upstream(p, k, &queue);
+    for (i = 0; i < n; i++) {
+        logchange(queue[i]->state);
+        if (queue[i]->state >= Cache_size || !Ksv_cache[queue[i]->state])
             continue;
-        dispose_strs(Ksv_cache[i]);
-        free(Ksv_cache[i]);
-        Ksv_cache[i] = (struct kstrList *) NULL;
+        if (!defer || !inpass(queue[i]->state))
+            uncache(queue[i]->state);
+        else {
+            if (Sk->nstale == Sk->stalesize) {
+                Sk->stalesize = Sk->stalesize ? 2 * Sk->stalesize : 64;
+                Sk->stale = (int *) realloc(Sk->stale,
+                        Sk->stalesize * sizeof (int));
+                if (!Sk->stale)
+                    memerr();
+            }
+            Sk->stale[Sk->nstale++] = queue[i]->state;
+        }
     }
 }
 
+/*
+ * Whether the cached list of state s would have been looked up in this
+ * pass of the search had no test been skipped.  Those looked up are
+ * marked with Npass.  Once a p1 has had its tests cut short, every
+ * state from it on would have been looked up too, as p1 or as the p2
+ * of a skipped test, except that under AND a test that fails one way
+ * does not look up p2's list at all.  There it is a guess, and the
+ * answer may differ from testing every pair (see do_skstrings()).
+ */
+static int inpass(int s) {
+    return Ksv_cache[s]->pass == Npass || (Skipfrom >= 0 && s >= Skipfrom);
+}
+
+/*
+ * Before merging indistinguishable states, finish the cached lists
+ * that invalidate_cache() will leave stale.  Those were always whole
+ * lists of the strings before the merge, and one still being made best
+ * first would otherwise carry on with the transitions after it.  The
+ * states whose strings the merge changes are those that can reach
+ * either state in k steps or less beforehand.  Lists from an earlier
+ * pass will be dropped instead.
+ */
+static void freeze_cache(NODE *p, int k) {
+    NODE **queue;
+    int i, n;
+
+    n = upstream(p, k, &queue);
+    for (i = 0; i < n; i++)
+        if (queue[i]->state < Cache_size && Ksv_cache[queue[i]->state] &&
+                inpass(queue[i]->state))
+            kstrall(Ksv_cache[queue[i]->state]);
+}
+
+/*
+ * Find the states that can reach p in k steps or less, not counting
+ * arcs on the delimiter, by a breadth first walk up the srclists.
+ * Sets *queuep to them, p first, and returns how many there are.
+ * Marks are clear between traversals (merge() leaves them so) and are
+ * cleared again here.
+ */
+static int upstream(NODE *p, int k, NODE ***queuep) {
+    int head, tail, end, depth;
+    NODE **queue, *q;
+    SOURCE *sp;
+
+    if (!Sk->queuesize) {
+        Sk->queuesize = 64;
+        Sk->queue = (NODE **) malloc(Sk->queuesize * sizeof (NODE *));
+        if (!Sk->queue)
+            memerr();
+    }
+    queue = Sk->queue;
+    head = tail = 0;
+    queue[tail++] = p;
+    p->mark = 1;
+    for (depth = 0; head < tail && depth < k; depth++) {
+        for (end = tail; head < end; head++) {
+            q = queue[head];
+            for (sp = q->srclist->next_src; sp; sp = sp->next_src) {
+                if (sp->source->mark || Symtab[sp->sym].label[0] == Delim)
+                    continue;
+                if (tail == Sk->queuesize) {
+                    Sk->queuesize *= 2;
+                    Sk->queue = queue = (NODE **) realloc(queue,
+                            Sk->queuesize * sizeof (NODE *));
+                    if (!queue)
+                        memerr();
+                }
+                sp->source->mark = 1;
+                queue[tail++] = sp->source;
+            }
+        }
+    }
+    for (head = 0; head < tail; head++)
+        queue[head]->mark = 0;
+    *queuep = queue;
+    return tail;
+}
+
+static void printcachestats(void) {
+    u_long n, total = 0, most = 0;
+    int i, state = -1;
+
+    fprintf(stderr, "String cache: %lu hits, %lu misses, %lu invalidations\n",
+            Cache_hits, Cache_misses, Cache_invalidations);
+    for (i = 0; i < Cache_size; i++)
+        if (Ksv_cache[i]) {
+            total += n = kstrmem(Ksv_cache[i]);
+            if (n > most) {
+                most = n;
+                state = i;
+            }
+        }
+    fprintf(stderr, "String lists: %lu bytes cached, at most %lu (state %d), "
+            "%lu cut short\n", total, most, state, cutlists());
+}
+
+/*
+ * How many of the lists made so far were cut short to fit in Ksbudget.
+ * With -j, tests beyond the first mergeable pair may have made lists
+ * further than the serial search would, so this can be more.
+ */
+static u_long cutlists(void) {
+    u_long n = Ksv_cut;
+    int i;
+
+    for (i = 0; i < Cache_size; i++)
+        if (Ksv_cache[i] && Ksv_cache[i]->cut)
+            n++;
+    return n;
+}
+
 /*
  * This handles the case when p's strings must be acceptable at q AND
  * q's strings must be acceptable at p.
@@ -609,8 +1891,8 @@ static int skstr_lax(int k, NODE *p, NODE *q) {
     ksv_p = get_sorted_kstrList(k, p, syms, 100 * PREC);
     syms[0] = 0;
     ksv_q = get_sorted_kstrList(k, q, syms, 100 * PREC);
-    for (i = 0; i < ksv_p->nstr && i < ksv_q->nstr; i++) {
-        if (intcmp(ksv_p->ks[i].kstr, ksv_q->ks[i].kstr))
+    for (i = 0; kstrfill(ksv_p, i) && kstrfill(ksv_q, i); i++) {
+        if (kstrcmp(&ksv_p->ks[i], &ksv_q->ks[i]))
             return 0;
         cutoffp += ksv_p->ks[i].prob;
         cutoffq += ksv_q->ks[i].prob;
@@ -633,9 +1915,9 @@ static int skstr_strict(int k, NODE *p, NODE *q) {
     ksv_p = get_sorted_kstrList(k, p, syms, 100 * PREC);
     syms[0] = 0;
     ksv_q = get_sorted_kstrList(k, q, syms, 100 * PREC);
-    for (i = 0; i < ksv_p->nstr && i < ksv_q->nstr; i++) {
+    for (i = 0; kstrfill(ksv_p, i) && kstrfill(ksv_q, i); i++) {
         if (ksv_p->ks[i].prob != ksv_q->ks[i].prob ||
-                intcmp(ksv_p->ks[i].kstr, ksv_q->ks[i].kstr))
+                kstrcmp(&ksv_p->ks[i], &ksv_q->ks[i]))
             return 0;
         cutoffp += ksv_p->ks[i].prob;
         cutoffq += ksv_q->ks[i].prob;
@@ -657,40 +1939,10 @@ static int skstr_strict(int k, NODE *p, NODE *q) {
  * between them.
  */
 static int skstr_xentropic(int k, NODE *p, NODE *q) {
-    int i, j, diff, syms[128];
-    struct kstrList *ksv_p, *ksv_q;
-    double xentropy = 0, epsilon, pi, qi;
+    double xentropy, epsilon;
 
-    syms[0] = 0;
-    ksv_p = get_sorted_kstrList(k, p, syms, 100 * PREC);
-    syms[0] = 0;
-    ksv_q = get_sorted_kstrList(k, q, syms, 100 * PREC);
-    i = j = 0;
     epsilon = (double) Minprob / 100.0 / PREC;
-    while (i < ksv_p->nstr && j < ksv_q->nstr) {
-        diff = intcmp(ksv_p->ks[i].kstr, ksv_q->ks[j].kstr);
-        if (!diff) {
-            pi = (double) ksv_p->ks[i++].prob / 100 / PREC;
-            qi = (double) ksv_q->ks[j++].prob / 100 / PREC;
-        } else if (diff < 0) {
-            pi = (double) ksv_p->ks[i++].prob / 100 / PREC;
-            qi = epsilon;
-        } else {
-            pi = epsilon;
-            qi = (double) ksv_q->ks[j++].prob / 100 / PREC;
-        }
-        xentropy += (pi - qi) * log(pi / qi);
-    }
-    while (i < ksv_p->nstr) {
-        pi = (double) ksv_p->ks[i++].prob / 100 / PREC;
-        qi = epsilon;
-        xentropy += (pi - qi) * log(pi / qi);
-    }
-    while (j < ksv_q->nstr) {
-        pi = epsilon;
-        qi = (double) ksv_q->ks[j++].prob / 100 / PREC;
-        xentropy += (pi - qi) * log(pi / qi);
-    }
+    xentropy = kstrdist(k, p, q, epsilon, log(epsilon));
     xentropy /= -2.0 * (1.0 - epsilon) * log(epsilon);
 
     if (Debug > 1)
@@ -706,45 +1958,152 @@ static int skstr_xentropic(int k, NODE *p, NODE *q) {
  * where pi and qi are probabilities of the i'th string at p and q resp.
  */
 static int skstr_vardist(int k, NODE *p, NODE *q) {
-    int i, j, diff, syms[128];
+    double vardist;
+
+    vardist = kstrdist(k, p, q, 0.0, 0.0) / 2.0;
+
+    if (Debug > 1)
+        fprintf(stderr, "Nodes %d and %d: vardist = %.3f\n",
+            p->state, q->state, vardist);
+    return (vardist <= MinEntropy);
+}
+
+/*
+ * The Hellinger distance between the string distributions of p and q,
+ * i.e.  Sqrt { Sigma { (Sqrt(pi)-Sqrt(qi))^2 } / 2 }
+ * which is 0 for identical states and 1 for states with no string in
+ * common.  Unlike xentropy, a string missing at one state adds no more
+ * than its own probability, however improbable it is at the other.
+ */
+static int skstr_hellinger(int k, NODE *p, NODE *q) {
+    double hellinger;
+
+    hellinger = sqrt(kstrdist(k, p, q, 0.0, 0.0) / 2.0);
+
+    if (Debug > 1)
+        fprintf(stderr, "Nodes %d and %d: hellinger = %.3f\n",
+            p->state, q->state, hellinger);
+    return (hellinger <= MinEntropy);
+}
+
+/*
+ * The Jensen-Shannon divergence between the string distributions of p
+ * and q, in bits, i.e.
+ * Sigma { pi*log(pi/mi) + qi*log(qi/mi) } / 2, where mi = (pi+qi)/2
+ * This is the mean Kullback divergence of p and q from their average,
+ * so a string missing at one of them needs no MINPROB stand in, and
+ * it too lies between 0 and 1.
+ */
+static int skstr_jsdiv(int k, NODE *p, NODE *q) {
+    double jsdiv;
+
+    jsdiv = kstrdist(k, p, q, 0.0, 0.0) / (2.0 * log(2.0));
+
+    if (Debug > 1)
+        fprintf(stderr, "Nodes %d and %d: jsdiv = %.3f\n",
+            p->state, q->state, jsdiv);
+    return (jsdiv <= MinEntropy);
+}
+
+/*
+ * Fill in pv and fv for a finished list.  The logs (or square roots)
+ * are taken once here rather than for each pair the list is tested in,
+ * which was most of the cost of XENTROPIC.
+ */
+static void kstrvec(struct kstrList *ksv) {
+    int i;
+
+    free((void *) ksv->pv);
+    ksv->pv = (double *) malloc((Kvec_f ? 2 : 1) * ksv->nks * sizeof (double));
+    if (!ksv->pv)
+        memerr();
+    ksv->fv = Kvec_f ? ksv->pv + ksv->nks : ksv->pv;
+    for (i = 0; i < ksv->nstr; i++)
+        ksv->pv[i] = (double) ksv->ks[i].prob / 100 / PREC;
+    if (Kvec_f)
+        for (i = 0; i < ksv->nstr; i++)
+            ksv->fv[i] = (*Kvec_f)(ksv->pv[i]);
+}
+
+/*
+ * Sum the Kdist term over the strings of p and q, both lists being in
+ * order of symbols.  A string missing from one side takes the
+ * probability px there, with fx for its fv.  The terms are
+ *
+ *   KD_XENT   (x - y) * (fx - fy)           fv = log
+ *   KD_VAR    Abs(x - y)
+ *   KD_HELL   (fx - fy)^2                   fv = sqrt
+ *   KD_JS     x*fx + y*fy - m               fv = log
+ *
+ * where m = (x+y)*log((x+y)/2) depends on both and so is worked out
+ * here, one log per string of the pair.
+ *
+ * The strings are lined up a block at a time, and each block is added
+ * to eight partial sums by Kvec_sum (see kvec.h), which are only added
+ * together at the end.  The last block is padded out to a multiple of
+ * 8 with zeros, which add nothing to any of the sums.
+ */
+static double kstrdist(int k, NODE *p, NODE *q, double px, double fx) {
+    struct kvecblock b;
     struct kstrList *ksv_p, *ksv_q;
-    double vardist = 0, pi, qi;
+    kstring *ks_p, *ks_q;
+    double *pv_p, *fv_p, *pv_q, *fv_q, acc[8], sum;
+    int i, j, n, np, nq, diff, js, syms[128];
 
     syms[0] = 0;
     ksv_p = get_sorted_kstrList(k, p, syms, 100 * PREC);
     syms[0] = 0;
     ksv_q = get_sorted_kstrList(k, q, syms, 100 * PREC);
-    i = j = 0;
-    while (i < ksv_p->nstr && j < ksv_q->nstr) {
-        diff = intcmp(ksv_p->ks[i].kstr, ksv_q->ks[j].kstr);
-        if (!diff) {
-            pi = (double) ksv_p->ks[i++].prob / 100 / PREC;
-            qi = (double) ksv_q->ks[j++].prob / 100 / PREC;
-        } else if (diff < 0) {
-            pi = (double) ksv_p->ks[i++].prob / 100 / PREC;
-            qi = 0;
-        } else {
-            pi = 0;
-            qi = (double) ksv_q->ks[j++].prob / 100 / PREC;
+    /* b is passed on in the loop, so keep all that is read in it apart */
+    ks_p = ksv_p->ks, pv_p = ksv_p->pv, fv_p = ksv_p->fv, np = ksv_p->nstr;
+    ks_q = ksv_q->ks, pv_q = ksv_q->pv, fv_q = ksv_q->fv, nq = ksv_q->nstr;
+    js = Kdist == KD_JS;
+    for (n = 0; n < 8; n++)
+        acc[n] = 0;
+    i = j = n = 0;
+    while (i < np || j < nq) {
+        if (i == np)
+            diff = 1;
+        else if (j == nq)
+            diff = -1;
+        else
+            diff = kstrcmp(&ks_p[i], &ks_q[j]);
+        b.x[n] = diff <= 0 ? pv_p[i] : px;
+        b.fx[n] = diff <= 0 ? fv_p[i++] : fx;
+        b.y[n] = diff >= 0 ? pv_q[j] : px;
+        b.fy[n] = diff >= 0 ? fv_q[j++] : fx;
+        if (js)
+            b.m[n] = (b.x[n] + b.y[n]) * log((b.x[n] + b.y[n]) / 2);
+        if (++n == KVECBLOCK) {
+            (*Kvec_sum)(Kdist, &b, n, acc);
+            n = 0;
         }
-        vardist += fabs(pi - qi);
     }
-    while (i < ksv_p->nstr)
-        vardist += (double) ksv_p->ks[i++].prob / 100 / PREC;
-    while (j < ksv_q->nstr)
-        vardist += (double) ksv_q->ks[j++].prob / 100 / PREC;
-    vardist /= 2.0;
+    if (n) {
+        for (; n % 8; n++)
+            b.x[n] = b.y[n] = b.fx[n] = b.fy[n] = b.m[n] = 0;
+        (*Kvec_sum)(Kdist, &b, n, acc);
+    }
+    for (sum = 0, n = 0; n < 8; n++)
+        sum += acc[n];
+    return sum;
+}
 
-    if (Debug > 1)
-        fprintf(stderr, "Nodes %d and %d: vardist = %.3f\n",
-            p->state, q->state, vardist);
-    return (vardist <= MinEntropy);
+/*
+ * Sum distances with the widest kernel the machine has.
+ */
+static void kvecinit(void) {
+    const char *name;
+
+    Kvec_sum = kvecpick(&name);
+    if (Debug && Kdist != KD_NONE)
+        fprintf(stderr, "Distance kernel: %s\n", name);
 }
 
 static void usage_skstr(char *prog) {
     char *usagestring = (char*)
             "This program optimises the given minimal canonical pfsa by successively\n"
-            "merging pairs of states it deems equivalent.  Six types of equivalence\n"
+            "merging pairs of states it deems equivalent.  Eight types of equivalence\n"
             "relations can be invoked by calling this program with the following\n"
             "options:\n"
             "\n"
@@ -773,13 +2132,27 @@ static void usage_skstr(char *prog) {
             "              That is Sigma (Abs(pi - qi)) where pi and qi are as above.\n"
             "              This is basically a hack version of the xentropic scheme.\n"
             "\n"
-            "              xentropy and vardist are normalised to be in the range\n"
-            "              0..1 before comparison with e.  Thus 0 <= e <= 1.\n"
+            "-H hellinger  P and Q are mergeable if the Hellinger distance between\n"
+            "              their string probability distributions is less than 'e'\n"
+            "              That is Sqrt(Sigma ((Sqrt(pi) - Sqrt(qi))^2) / 2).\n"
+            "\n"
+            "-H jsdiv      P and Q are mergeable if the Jensen-Shannon divergence of\n"
+            "              their string probability distributions is less than 'e'\n"
+            "              That is Sigma (pi*log(pi/mi) + qi*log(qi/mi)) / 2 in bits,\n"
+            "              where mi = (pi + qi) / 2.\n"
+            "\n"
+            "              xentropy, vardist, hellinger and jsdiv are normalised to\n"
+            "              be in the range 0..1 before comparison with e.  Thus\n"
+            "              0 <= e <= 1.\n"
             "\n"
             "If the strings are in the file f1.pfsa, the output is written to the\n"
             "file f1.opfsa.\n"
             "\n"
             "PFSA are specified as a list of source target symbol frequency' values\n"
+            "or in the binary format written with -B, which is recognised as such.\n"
+            "With -s, the input is instead a corpus of strings, each ending in the\n"
+            "delimiter, of symbols separated by ':'.  The canonical pfsa is built\n"
+            "from it directly, on -j threads, and the output goes to stdout or -o.\n"
             "\n"
             "Options: (Defaults shown in square brackets)\n"
             "Options unnecessary for the selected algorithm will be ignored.\n\n"
@@ -787,11 +2160,15 @@ static void usage_skstr(char *prog) {
             "-p num    Set Agreepct% to num [50%]\n"
             "-t num    Consider output strings of size <= num for every state [1]\n"
             "-m num    String must be at least num% probable to be considered [1%]\n"
-            "-e num    Set minimum entropy [0.5] or minimum vardist [0.5], see above\n"
+            "-e num    Set minimum entropy [0.5] or minimum distance [0.5], see above\n"
+            "-j num    Test pairs of states, and read a -s corpus, on num threads [1]\n"
+            "-b num    Keep at most num KB of strings for a state, 0 for no limit [1024]\n"
             "-d        Debug mode: prints miscellaneous info while executing [0]\n"
             "-v        Verbose mode: prints extra information in result [0]\n"
             "-D char   Set delimiter to 'char' [\\n]\n"
             "-g        Output PFSA in Graphplace format [0]\n"
+            "-B        Output PFSA in binary, which loads faster than text [0]\n"
+            "-s        The input is a corpus of strings, not a PFSA [0]\n"
             "-o file   Output PFSA in `file' [`infile.opfsa' or stdout]\n"
             "\n"
             "Minprob (set using -m) determines the least probability a string must\n"
@@ -801,13 +2178,17 @@ static void usage_skstr(char *prog) {
             "exponential in tailsize.  The default value of Minprob is 1%.  For\n"
             "practical reasons, Minprob canot be 0. Since the precision of operation\n"
             "is 3 decimal places, setting Minprob to less than .001% is the same as\n"
-            "setting it to zero, causing it to be reset to 1%.\n";
+            "setting it to zero, causing it to be reset to 1%.\n"
+            "\n"
+            "If the strings of a state will not fit in the space set by -b, only the\n"
+            "most probable ones that do are kept, and a warning is given at the end.\n";
     fprintf(stderr, "usage: skstr [options] [input file]\n");
     fprintf(stderr, "%s", usagestring);
     return;
 }
 
 static void onusr2(int par) {
-    fprintf(stderr, "No progress report available.  Try USR1\n");
+    if (Sk)
+        printcachestats();
 }
 #endif /*#ifndef SKSTR_C*/
\ No newline at end of file
@@ -0,0 +1,113 @@
+/*
+ * File:   stressbench.c
+ *
+ * Stress test of a pfsa far past the old MAXNODES limit of 4096 states.
+ * It builds a tree of n states (1000000 by default) shaped like a prefix
+ * tree acceptor: each state has up to FANOUT children, and each leaf
+ * goes back to state 0 on the delimiter, so state 0 has a source for
+ * every leaf.  Then it copies it with copypfsa(), renumbers the copy
+ * breadth first with bf_renumber(), merges MERGES pairs of leaves of
+ * the original and renumbers that.  It times each step, checks the
+ * counts after each and reports the peak memory.
+ *
+ * It is not part of the project build.  To build and run it:
+ *
+ *   cc -O2 -o stressbench stressbench.c -lm && ./stressbench [n]
+ */
+
+#define MAIN
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "pfsa.h"
+#include "misc.c"
+
+#define FANOUT 8
+#define MERGES 1000
+
+char *Prog = (char *) "stressbench";
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int check(const char *step, NODE *pfsa, int nstates, int narcs) {
+    if (nstates(pfsa) != nstates || trancnt(pfsa) != narcs) {
+        fprintf(stderr, "%s: %d states, %d arcs, expected %d and %d\n",
+                step, nstates(pfsa), trancnt(pfsa), nstates, narcs);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct rusage ru;
+    NODE *copy, *p, *q, *root;
+    char label[16];
+    double t;
+    int sym[FANOUT], n, nleaves, i, first;
+
+    n = argc > 1 ? atoi(argv[1]) : 1000000;
+    if (n < 4 * MERGES) {
+        fprintf(stderr, "%s: n must be at least %d\n", Prog, 4 * MERGES);
+        return 1;
+    }
+    startpfsa();
+    for (i = 0; i < FANOUT; i++) {
+        sprintf(label, "s%d", i);
+        sym[i] = addsym(label);
+    }
+
+    t = now();
+    root = addnode(Pfsa, 0);
+    for (nleaves = 0, i = 1; i < n; i++) {
+        p = addnode(Pfsa, i);
+        addtrans(findnode(Pfsa, (i - 1) / FANOUT), p, sym[(i - 1) % FANOUT], 1);
+        if ((long) FANOUT * i + 1 >= n) {
+            addtrans(p, root, DELIMITER, 1);
+            nleaves++;
+        }
+    }
+    printf("build        %7.3f s  %d states, %d arcs, %d sources of 0\n",
+            now() - t, nstates(Pfsa), trancnt(Pfsa), root->nsrclist);
+    if (check("build", Pfsa, n, n - 1))
+        return 1;
+
+    t = now();
+    copy = copypfsa(Pfsa);
+    printf("copypfsa     %7.3f s\n", now() - t);
+    if (check("copypfsa", copy, n, n - 1))
+        return 1;
+
+    t = now();
+    bf_renumber(copy);
+    printf("bf_renumber  %7.3f s\n", now() - t);
+    if (check("bf_renumber", copy, n, n - 1) || getmaxstatenum(copy) != n - 1)
+        return 1;
+    delpfsa(copy);
+
+    /*
+     * Pairs of leaves, the lower numbered first as merge() wants.  Their
+     * arcs on the delimiter fold, but trancnt does not count those.
+     */
+    t = now();
+    first = n - nleaves;
+    for (i = 0; i < MERGES; i++) {
+        p = findnode(Pfsa, first + 2 * i);
+        q = findnode(Pfsa, first + 2 * i + 1);
+        merge(Pfsa, p, q);
+    }
+    renumber(Pfsa);
+    printf("merge+renumber %5.3f s  %d merges\n", now() - t, MERGES);
+    if (check("merge", Pfsa, n - MERGES, n - 1) ||
+            getmaxstatenum(Pfsa) != n - MERGES - 1)
+        return 1;
+
+    getrusage(RUSAGE_SELF, &ru);
+    printf("max rss      %7.1f MB\n", ru.ru_maxrss / 1024.0);
+    delpfsa(Pfsa);
+    return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * File:   tokbench.c
+ *
+ * Benchmark of tokenising a large log with toks2syms().  It makes up a
+ * log of mb megabytes (64 by default, 1024 for the 1GB run) of lines of
+ * TOKENS ':' separated event names drawn from nlabels labels (10000 by
+ * default), each line ended by the delimiter as in a .str file, and
+ * times toks2syms() over all of it.  The log is made a block at a time
+ * in memory and tokenised from a copy, so only the tokenising is timed.
+ * On the first OLDMB megabytes only it also times the linear strncmp()
+ * scan of a fixed table of MAXSYMSIZE byte labels that findsym() did
+ * before the hash index, and checks that both give the same symbols.
+ *
+ * It is not part of the project build.  To build and run it:
+ *
+ *   cc -O2 -o tokbench tokbench.c -lm && ./tokbench [mb [nlabels]]
+ */
+
+#define MAIN
+#include <errno.h>
+#include <time.h>
+#include "pfsa.h"
+#include "misc.c"
+
+#define TOKENS 24		/* Event names a line */
+#define BLOCK (16 << 20)	/* Bytes of log made at a time */
+#define OLDMB 4			/* Megabytes for the old scan */
+#define MAXSYMSIZE 64
+
+char *Prog = (char *) "tokbench";
+
+static char (*oldtab)[MAXSYMSIZE];
+static int oldnsyms;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * findsym() and toks2syms() as they were, over oldtab.
+ */
+static int old_findsym(char label[]) {
+    int i;
+
+    for (i = 1; i < oldnsyms && oldtab[i][0]; i++)
+        if (!strncmp(oldtab[i], label, MAXSYMSIZE))
+            return i;
+    fprintf(stderr, "Couldn't find symbol %s in table\n", label);
+    exit(1);
+}
+
+static int *old_toks2syms(char *buf, int *symbols) {
+    char *label, *last;
+    int i = 0;
+
+    label = strtok_r(buf, ":", &last);
+    while (label && i < BUFSIZ - 1) {
+        symbols[i++] = old_findsym(label);
+        label = strtok_r((char *) NULL, ":", &last);
+    }
+    symbols[i] = 0;
+    return symbols;
+}
+
+/*
+ * Fill buf with whole lines up to about len bytes; return the length.
+ */
+static size_t makelog(char *buf, size_t len, int nlabels) {
+    size_t n = 0;
+    int i;
+
+    while (n + TOKENS * 16 < len) {
+        for (i = 0; i < TOKENS; i++)
+            n += sprintf(buf + n, "ev%d:", rand() % nlabels);
+        buf[n++] = Delim;
+        buf[n++] = '\0';
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    char *buf, *work, *line, label[MAXSYMSIZE];
+    int *syms, oldsyms[BUFSIZ];
+    double mb, t, tnew, told, newmb, oldmb;
+    size_t len, oldlen, done;
+    long ntoks, nlines;
+    int nlabels, i;
+
+    mb = argc > 1 ? atof(argv[1]) : 64;
+    nlabels = argc > 2 ? atoi(argv[2]) : 10000;
+    if (mb <= 0 || nlabels < 1) {
+        fprintf(stderr, "usage: %s [mb [nlabels]]\n", argv[0]);
+        return 1;
+    }
+    buf = (char *) malloc(BLOCK);
+    work = (char *) malloc(BLOCK);
+    oldtab = (char (*)[MAXSYMSIZE]) calloc(nlabels + 2, MAXSYMSIZE);
+    if (!buf || !work || !oldtab)
+        memerr();
+
+    startpfsa();
+    oldtab[1][0] = Delim;
+    for (i = 0; i < nlabels; i++) {
+        sprintf(label, "ev%d", i);
+        strcpy(oldtab[addsym(label)], label);
+    }
+    oldnsyms = Nsyms;
+
+    srand(1);
+    tnew = told = newmb = oldmb = 0;
+    ntoks = nlines = 0;
+    for (done = 0; done < mb * (1 << 20); done += len) {
+        len = makelog(buf, BLOCK, nlabels);
+        memcpy(work, buf, len);
+
+        t = now();
+        for (line = work; line < work + len; line += strlen(line) + 1)
+            for (syms = toks2syms(line); *syms; syms++)
+                ntoks++;
+        tnew += now() - t;
+        newmb += len / 1048576.0;
+
+        if (done)
+            continue;
+        oldlen = len < (OLDMB << 20) ? len : (OLDMB << 20);
+        memcpy(work, buf, len);
+        t = now();
+        for (line = work; line < work + oldlen; line += strlen(line) + 1)
+            old_toks2syms(line, oldsyms);
+        told = now() - t;
+        oldmb = (line - work) / 1048576.0;
+
+        for (line = buf; line < buf + oldlen; line += strlen(line) + 1) {
+            strcpy(work, line);
+            old_toks2syms(work, oldsyms);
+            strcpy(work, line);
+            syms = toks2syms(work);
+            for (i = 0; syms[i] && syms[i] == oldsyms[i]; i++)
+                ;
+            if (syms[i] != oldsyms[i]) {
+                fprintf(stderr, "line %ld: the symbols differ\n", nlines);
+                return 1;
+            }
+            nlines++;
+        }
+    }
+    printf("%d labels, %.0f MB, %ld tokens\n", Nsyms - 1, newmb, ntoks);
+    printf("toks2syms  %8.3f s  %7.1f MB/s\n", tnew, newmb / tnew);
+    printf("old scan   %8.3f s  %7.1f MB/s (first %.0f MB)\n", told,
+            oldmb / told, oldmb);
+    return 0;
+}